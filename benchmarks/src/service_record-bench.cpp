@@ -0,0 +1,149 @@
+// std
+#include <cstdio>
+#include <cstring>
+#include <vector>
+// 3rd party
+#include <benchmark/benchmark.h>
+// project
+#include <service_record/service_record.h>
+#include "services.h"
+
+namespace {
+
+void quiet_log(const char*, int, const char*, int, const char*, ...) {}
+
+struct sr_ctx* make_context(uint64_t service_id, const char* service_name) {
+  struct sr_config conf = {};
+  conf.mad_send_type = SR_MAD_SEND_LOOPBACK;
+  conf.service_id = service_id;
+  conf.service_name = const_cast<char*>(service_name);
+  conf.sr_retries = 1;
+
+  struct sr_ctx* context = nullptr;
+  if (sr_init(&context, "", 0, quiet_log, &conf))
+    return nullptr;
+  return context;
+}
+
+// Wire records as a GET_TABLE returns them, every other one named 'name'
+std::vector<struct sr_ib_service_record> make_records(int num, const char* name) {
+  std::vector<struct sr_ib_service_record> records(num);
+
+  for (int i = 0; i < num; ++i) {
+    struct sr_ib_service_record& record = records[i];
+    std::memset(&record, 0, sizeof(record));
+    record.service_id = __cpu_to_be64(0x1000 + i);
+    record.service_gid[15] = static_cast<uint8_t>(i);
+    record.service_lease = __cpu_to_be32(SR_DEFAULT_LEASE_TIME);
+    std::snprintf(record.service_name, sizeof(record.service_name), "%s", i % 2 ? "other" : name);
+    std::memset(&record.service_data, i, sizeof(record.service_data));
+  }
+  return records;
+}
+
+}  // namespace
+
+static void BM_PrepareRecord(benchmark::State& state) {
+  struct sr_ctx* context = make_context(SR_DEFAULT_SERVICE_ID, "bench");
+  struct sr_dev_service service;
+  struct sr_ib_service_record record;
+  uint8_t data[SR_DEV_SERVICE_DATA_MAX] = {1, 2, 3};
+
+  if (!context) {
+    state.SkipWithError("sr_init failed");
+    return;
+  }
+  for (auto _ : state) {
+    sr_prepare_ib_service_record(context, &service, &record, SR_DEFAULT_SERVICE_ID, "bench", data, sizeof(data), nullptr);
+    benchmark::DoNotOptimize(record);
+  }
+  state.SetItemsProcessed(state.iterations());
+  sr_cleanup(context);
+}
+BENCHMARK(BM_PrepareRecord);
+
+static void BM_FillDevService(benchmark::State& state) {
+  std::vector<struct sr_ib_service_record> records = make_records(1, "bench");
+  struct sr_dev_service service;
+
+  for (auto _ : state) {
+    fill_dev_service_from_ib_service_record(&service, &records[0]);
+    benchmark::DoNotOptimize(service);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FillDevService);
+
+// The name filtering and decoding dev_get_service() does on a GET_TABLE response
+static void BM_DecodeServices(benchmark::State& state) {
+  const int num = static_cast<int>(state.range(0));
+  struct sr_ctx* context = make_context(SR_DEFAULT_SERVICE_ID, "bench");
+  std::vector<struct sr_ib_service_record> records = make_records(num, "bench");
+  std::vector<struct sr_dev_service> services(num);
+  struct sr_sa_txn txn = {};
+
+  if (!context) {
+    state.SkipWithError("sr_init failed");
+    return;
+  }
+  txn.resp_data = records.data();
+  txn.resp_size = records.size() * sizeof(records[0]);
+  txn.record_size = sizeof(records[0]);
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(dev_decode_services(context, "bench", &txn, num, services.data(), num, 0));
+  state.SetItemsProcessed(state.iterations() * num);
+  state.SetBytesProcessed(state.iterations() * txn.resp_size);
+  sr_cleanup(context);
+}
+BENCHMARK(BM_DecodeServices)->RangeMultiplier(10)->Range(10, 100000);
+
+// Register and unregister through the in-process SA, which stands in for the SM
+static void BM_RegisterLoopback(benchmark::State& state) {
+  struct sr_ctx* context = make_context(SR_DEFAULT_SERVICE_ID, "bench");
+  uint8_t data[SR_DEV_SERVICE_DATA_MAX] = {1, 2, 3};
+
+  if (!context) {
+    state.SkipWithError("sr_init failed");
+    return;
+  }
+  for (auto _ : state) {
+    if (sr_register_service(context, data, sizeof(data), nullptr)) {
+      state.SkipWithError("sr_register_service failed");
+      break;
+    }
+    state.PauseTiming();
+    sr_unregister_service(context, nullptr);
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations());
+  sr_cleanup(context);
+}
+BENCHMARK(BM_RegisterLoopback)->UseRealTime();
+
+// Query a service registered from another port through the in-process SA
+static void BM_QueryLoopback(benchmark::State& state) {
+  struct sr_ctx* registrar = make_context(SR_DEFAULT_SERVICE_ID, "bench");
+  struct sr_ctx* context = make_context(SR_DEFAULT_SERVICE_ID, "bench");
+  uint8_t data[SR_DEV_SERVICE_DATA_MAX] = {1, 2, 3};
+  struct sr_dev_service service;
+
+  if (!registrar || !context || sr_register_service(registrar, data, sizeof(data), nullptr)) {
+    state.SkipWithError("registration failed");
+  } else {
+    for (auto _ : state) {
+      if (sr_query_service(context, &service, 1, 1) != 1) {
+        state.SkipWithError("sr_query_service found no record");
+        break;
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+    sr_unregister_service(registrar, nullptr);
+  }
+
+  sr_cleanup(registrar);
+  sr_cleanup(context);
+}
+BENCHMARK(BM_QueryLoopback)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -19,9 +19,9 @@ class service_record_libRecipe(ConanFile):
     options = {"shared": [True, False], "fPIC": [True, False]}
     default_options = {"shared": False, "fPIC": True}
 
-    requires = ("fmt/11.0.2", "cxxopts/3.1.1", "doctest/2.4.11")
+    requires = ("fmt/11.0.2", "cxxopts/3.1.1", "doctest/2.4.11", "benchmark/1.9.1")
     # Sources are located in the same place as this recipe, copy them to the recipe
-    exports_sources = "CMakeLists.txt", "src/*", "include/*", "cli/*", "tests/*", "cmake/*"
+    exports_sources = "CMakeLists.txt", "src/*", "include/*", "cli/*", "tests/*", "benchmarks/*", "cmake/*"
 
     def config_options(self):
         if self.settings.os == "Windows":
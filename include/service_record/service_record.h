@@ -14,6 +14,7 @@
 #include <infiniband/verbs.h>
 #include <linux/connector.h>
 #include <linux/types.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/time.h>
 
@@ -29,9 +30,19 @@ extern "C" {
 #define SR_128_BIT_SIZE         (128 / 8)
 #define SR_DEV_SERVICE_NAME_MAX 64
 #define SR_DEV_SERVICE_DATA_MAX 64
-#define SR_DEV_MAX_SERVICES     4
 #define SRS_MAX                 64
 
+#define SR_VERBS_SEND_DEPTH     64   /* Outstanding MAD sends on the verbs QP */
+#define SR_VERBS_RECV_DEPTH     64   /* Pre-posted MAD receive slots */
+#define SR_VERBS_POLL_BATCH     16
+#define SR_VERBS_MAD_SIZE       256
+#define SR_VERBS_RECV_SLOT_SIZE 512  /* GRH + MAD */
+#define SR_VERBS_RMPP_WINDOW    (SR_VERBS_RECV_DEPTH / 2) /* RMPP segments granted per ACK */
+#define SR_VERBS_RMPP_IDLE_MS   5000 /* Partial RMPP responses are dropped after this */
+#define SR_VERBS_SEND_WRID      (1ULL << 63)
+
+#define SR_SA_TXN_BUCKETS 256 /* TID and query key hash size, power of 2 */
+
 #define SR_DEFAULT_SERVICE_NAME      "sr_default_service_name"
 #define SR_DEFAULT_SERVICE_ID        0x100002c900000002UL
 #define SR_DEFAULT_FORMAT            1
@@ -42,6 +53,13 @@ extern "C" {
 #define SR_DEFAULT_FABRIC_TIMEOUT    200
 #define SR_DEFAULT_SA_FABRIC_TIMEOUT 200
 #define SR_DEFAULT_QUERY_SLEEP       500000
+#define SR_DEFAULT_QUERY_SLEEP_MAX   2000000 /* Backoff cap, usec */
+#define SR_DEFAULT_BREAKER_THRESHOLD 3 /* Timed out requests in a row before failing fast */
+#define SR_DEFAULT_BREAKER_COOLDOWN  5000 /* ms between probes while failing fast */
+#define SR_DEFAULT_RENEWAL_MARGIN    60000 /* ms before lease expiry to renew */
+#define SR_DEFAULT_COMPLETION_SPIN_US 50
+#define SR_DEFAULT_SNAPSHOT_RECORDS  1024 /* Records a node snapshot holds */
+#define SR_DEFAULT_RATE_LIMIT_BURST  16 /* MADs sent back to back after idling, under a rate limit */
 
 #define SA_WELL_KNOWN_GUID 0x0200000000000002
 
@@ -59,12 +77,46 @@ struct sr_dev_service
     uint32_t lease;                        /* Lease time, in sec */
 };
 
+/* One record of a sr_register_services() batch */
+struct sr_service_entry
+{
+    uint64_t id;                                   /* Service ID, 0 for the context service ID */
+    const char* name;                              /* Service name, NULL for the context service name */
+    const void* data;                              /* Private data */
+    size_t data_size;
+    const uint8_t (*service_key)[SR_128_BIT_SIZE]; /* Optional service key */
+    int status;                                    /* Set on return: 0 or negative errno */
+};
+
 enum sr_mad_send_type
 {
     SR_MAD_SEND_UMAD = 0,
     SR_MAD_SEND_VERBS = 1,
     SR_MAD_SEND_VERBS_DEVX = 2,
-    SR_MAD_SEND_LAST = SR_MAD_SEND_VERBS_DEVX,
+    SR_MAD_SEND_LOOPBACK = 3, /* In-process simulated SA, no HCA required */
+    SR_MAD_SEND_LAST = SR_MAD_SEND_LOOPBACK,
+};
+
+/* How the verbs receive path waits for completions */
+enum sr_completion_mode
+{
+    SR_COMPLETION_ADAPTIVE = 0, /* Spin for completion_spin_us, then sleep on the completion channel */
+    SR_COMPLETION_POLL = 1,     /* Busy-poll the CQ until the timeout, lowest latency */
+    SR_COMPLETION_EVENT = 2,    /* Sleep on the completion channel right away */
+    SR_COMPLETION_LAST = SR_COMPLETION_EVENT,
+};
+
+struct sr_transport_ops;
+struct sr_loopback_dev;
+struct sr_io;
+struct sr_service_cache;
+struct sr_rmpp_recv;
+struct sr_sa_txn;
+
+struct sr_ib_recv
+{
+    uint32_t slot;
+    uint32_t length;
 };
 
 struct sr_ib_dev
@@ -76,7 +128,67 @@ struct sr_ib_dev
     struct ibv_ah* sa_ah;
     void* mad_buf;
     struct ibv_mr* mad_buf_mr;
+    struct ibv_comp_channel* channel;
     uint64_t mad_start_time;
+    uint32_t send_posted;    /* Send slots used, slot = send_posted % SR_VERBS_SEND_DEPTH */
+    uint32_t send_completed;
+    struct sr_ib_recv recv_ready[SR_VERBS_RECV_DEPTH]; /* Received, not yet returned by recv() */
+    uint32_t recv_head;
+    uint32_t recv_tail;
+    int recv_last;           /* Slot returned by the previous recv(), reposted on the next one */
+    struct sr_rmpp_recv* rmpp;  /* RMPP responses being reassembled */
+    void* rmpp_last;         /* Reassembled MAD returned by the previous recv() */
+};
+
+struct sr_umad_dev
+{
+    struct ib_user_mad* send_buf;
+    struct ib_user_mad* recv_buf;
+    int recv_buf_len;
+};
+
+enum sr_stats_method
+{
+    SR_STATS_SET = 0,
+    SR_STATS_GET,
+    SR_STATS_GET_TABLE,
+    SR_STATS_DELETE,
+    SR_STATS_OTHER,
+    SR_STATS_METHOD_NUM
+};
+
+#define SR_STATS_LATENCY_BUCKETS 24 /* Bucket i counts latencies under 2^i usec, the last one all longer */
+
+struct sr_method_stats
+{
+    uint64_t requests;       /* Transactions submitted */
+    uint64_t sends;          /* MADs sent, resends included */
+    uint64_t retries;        /* Resends after an empty result, error or timeout */
+    uint64_t timeouts;       /* Responses that didn't arrive in time */
+    uint64_t sa_errors;      /* Responses with a non-zero MAD status */
+    uint64_t found;          /* Completed with records */
+    uint64_t empty;          /* Completed without records */
+    uint64_t failed;         /* Completed with an error */
+    uint64_t latency_sum_us; /* Submit to completion */
+    uint64_t latency[SR_STATS_LATENCY_BUCKETS];
+};
+
+/* Counters only grow; all are updated with relaxed atomics */
+struct sr_stats
+{
+    struct sr_method_stats methods[SR_STATS_METHOD_NUM];
+    uint64_t tid_mismatches;  /* Responses to no outstanding request */
+    uint64_t recv_timeouts;   /* Receive waits that expired */
+    uint64_t reports;         /* Unsolicited Reports */
+    uint64_t breaker_rejects; /* Requests failed fast by the circuit breaker */
+    uint64_t dev_updates;     /* Port re-reads after a failed query */
+    uint64_t failovers;       /* Moves to another port, SR_MULTI_PORT only */
+    uint64_t snapshot_hits;   /* Queries answered from the node snapshot without asking the SA */
+    uint64_t throttled;       /* Sends delayed or rejected by the process rate limit */
+    uint64_t coalesced;       /* Queries answered by an identical one already pending */
+    uint64_t register_skips;  /* Registrations of an unchanged, confirmed record that sent nothing */
+    uint64_t mad_status[8];   /* By MAD status invalid-field code, see report_sa_err() */
+    uint64_t sa_status[8];    /* By SA status code */
 };
 
 struct sr_dev
@@ -90,19 +202,86 @@ struct sr_dev
     int agent;
     unsigned seed;
     uint16_t pkey_index;
-    struct sr_dev_service service_cache[SR_DEV_MAX_SERVICES];
+    struct sr_service_cache* service_cache; /* Registered records, see service_cache.c */
     unsigned fabric_timeout_ms;
-    int query_sleep;
+    int query_sleep;     /* First resend delay, usec */
+    int query_sleep_max; /* Resend delays grow with jitter up to this, usec */
+    unsigned breaker_threshold; /* 0 disables the circuit breaker */
+    unsigned breaker_cooldown_ms;
+    unsigned breaker_failures;  /* Requests in a row that timed out */
+    uint64_t breaker_open_until; /* Fail fast until this, usec */
+    struct sr_sa_txn* breaker_probe; /* Request let through to test the SA */
     uint64_t sa_mkey;
     uint16_t pkey;
     enum sr_mad_send_type mad_send_type;
+    enum sr_completion_mode completion_mode;
+    unsigned completion_spin_us;
+    const struct sr_transport_ops* transport;
+    struct sr_sa_txn* txns; /* Outstanding SA transactions */
+    struct sr_sa_txn* txn_table[SR_SA_TXN_BUCKETS]; /* Sent transactions by TID */
+    struct sr_sa_txn* query_table[SR_SA_TXN_BUCKETS]; /* Pending queries by key, for coalescing */
     struct sr_ib_dev verbs;
+    struct sr_umad_dev umad;
+    struct sr_loopback_dev* loopback;
+    unsigned loopback_latency_us;
+    uint32_t report_qpn; /* QP the SA sends Reports to */
+    void (*report)(struct sr_dev* dev, const void* notice, void* arg); /* Unsolicited Report handler */
+    void* report_arg;
+    struct sr_stats stats;
+    struct sr_io* io; /* I/O thread owning everything above, SR_IO_THREAD only */
+    void (*timer)(struct sr_dev* dev, void* arg); /* Called by progress once timer_next passed */
+    void* timer_arg;
+    uint64_t timer_next; /* usec, 0 for none */
+    int failover;        /* SR_MULTI_PORT */
+    char failover_ca[UMAD_CA_NAME_LEN]; /* CA whose ports failover may use, "" for any */
+    int rate_limit_reject; /* SR_RATE_LIMIT_REJECT */
+    int rate_limited;      /* Asked for process rate limits, released by sr_cleanup() */
 };
 
 enum
 {
     SR_HIDE_ERRORS = 1 << 0,
+    SR_NO_CIRCUIT_BREAKER = 1 << 1,
+    /*
+     * Serve all threads of the process from one context. An I/O thread owns the
+     * transport and the asynchronous request API is not available.
+     */
+    SR_IO_THREAD = 1 << 2,
+    /*
+     * Once the port stops answering and is no longer active, move to another
+     * active port, of the CA given to sr_init() if any, and register the
+     * context records again from there. sr_get_fd() may change meanwhile.
+     */
+    SR_MULTI_PORT = 1 << 3,
+    /* Fail requests over the process rate limit with -EBUSY instead of delaying them */
+    SR_RATE_LIMIT_REJECT = 1 << 4,
+    /*
+     * Have sr_unregister_service() remove every record registered through the
+     * context, whatever its ID, with all DELETEs in flight together and no
+     * lookup, instead of looking up the context service on every port.
+     * Records other ports left behind are not looked for: they expire with
+     * their lease, or go with sr_unregister_services().
+     */
+    SR_BULK_UNREGISTER = 1 << 5,
+};
+struct sr_query_cache;
+struct sr_lease_engine;
+struct sr_snapshot;
+
+#define SR_TRAP_GID_IN_SERVICE     64
+#define SR_TRAP_GID_OUT_OF_SERVICE 65
+
+/* SA event delivered to sr_subscribe() callbacks */
+struct sr_notice
+{
+    uint16_t trap_num;   /* SR_TRAP_* */
+    uint16_t issuer_lid;
+    uint8_t gid[16];     /* Port GID the trap is about */
 };
+
+struct sr_ctx;
+typedef void (*sr_notice_cb)(struct sr_ctx* context, const struct sr_notice* notice, void* arg);
+
 struct sr_ctx
 {
     struct sr_dev* dev;  /* SR device */
@@ -111,6 +290,23 @@ struct sr_ctx
     uint32_t flags;      /* flags */
     char* service_name;  /* Service name */
     uint64_t service_id; /* Service ID */
+    struct sr_query_cache* query_cache; /* sr_query_service() results, NULL if disabled */
+    sr_notice_cb notice_cb; /* Set while subscribed */
+    void* notice_arg;
+    struct sr_lease_engine* lease; /* Registrations being renewed, NULL if disabled */
+    struct sr_snapshot* snapshot; /* Node-wide sr_query_service() results, NULL if disabled */
+    void* arena;         /* Reused for blocking query results */
+    size_t arena_size;
+    int arena_busy;
+};
+
+/* Query records in SA wire format, read them with the sr_view_*() accessors */
+struct sr_service_view
+{
+    const void* records;
+    int num;
+    int record_size;
+    size_t size;         /* Bytes of records, or the size needed on -ENOBUFS */
 };
 
 struct sr_config
@@ -126,17 +322,52 @@ struct sr_config
     uint32_t flags;
     char* service_name;  /* Service name */
     uint64_t service_id; /* Service ID */
+    unsigned loopback_latency_us; /* Simulated SA response latency, SR_MAD_SEND_LOOPBACK only */
+    enum sr_completion_mode completion_mode; /* Verbs receive wait mode */
+    unsigned completion_spin_us; /* Spin time before sleeping, SR_COMPLETION_ADAPTIVE only */
+    unsigned query_cache_ttl_ms; /* Reuse sr_query_service() results, bounded by the record lease; 0 disables */
+    unsigned query_cache_negative_ttl_ms; /* Reuse empty results, 0 to always ask the SA */
+    /*
+     * Serve expired results while refreshing them in the background. Without
+     * SR_IO_THREAD the refresh only moves when the device is progressed: by
+     * later sr_query_service() calls of the same service or sr_progress(),
+     * which a context that rarely queries should call meanwhile.
+     */
+    unsigned query_cache_stale_ms;
+    int query_sleep_max; /* Resend delay cap, usec */
+    unsigned breaker_threshold; /* Timed out requests in a row before failing fast, see SR_NO_CIRCUIT_BREAKER */
+    unsigned breaker_cooldown_ms; /* Time between SA probes while failing fast */
+    /*
+     * Share sr_query_service() results with the other processes of the node
+     * through shared memory, one of them refreshing them once older than this;
+     * 0 disables. Every process of the node must use the same configuration.
+     * The segment is removed once no context is attached to it anymore.
+     */
+    unsigned snapshot_ttl_ms;
+    unsigned snapshot_max_records; /* Records the node snapshot holds, 0 for SR_DEFAULT_SNAPSHOT_RECORDS */
+    /*
+     * MADs per second the whole process may send, shared by all its contexts:
+     * GET and GET_TABLE are queries, the other methods updates; 0 asks for no
+     * limit. While contexts asking for limits exist, the lowest rate and burst
+     * any of them asked for apply; sr_cleanup() of the last one lifts them.
+     * By default there is none.
+     */
+    unsigned rate_limit_queries;
+    unsigned rate_limit_updates;
+    unsigned rate_limit_burst; /* MADs sent back to back after idling, 0 for SR_DEFAULT_RATE_LIMIT_BURST */
 };
 
 typedef void (*sr_log_func)(const char* filename, int line_num, const char* func_name, int log_level, const char* format, ...)
     __check_format(5, 6);
 
+/* Set by every sr_init(), possibly while other contexts log from their threads */
 extern sr_log_func log_func;
 
-#define sr_log(log_level, format, ...)                                                \
-    do {                                                                              \
-        if (log_func)                                                                 \
-            log_func(__FILE__, __LINE__, __func__, log_level, format, ##__VA_ARGS__); \
+#define sr_log(log_level, format, ...)                                                 \
+    do {                                                                               \
+        sr_log_func sr_log_fn = __atomic_load_n(&log_func, __ATOMIC_ACQUIRE);          \
+        if (sr_log_fn)                                                                 \
+            sr_log_fn(__FILE__, __LINE__, __func__, log_level, format, ##__VA_ARGS__); \
     } while (0)
 
 #define sr_log_err(format, ...)   sr_log(1, format "\n", ##__VA_ARGS__)
@@ -147,11 +378,144 @@ extern sr_log_func log_func;
 int sr_init(struct sr_ctx** context, const char* dev_name, int port, sr_log_func log_func_in, struct sr_config* conf);
 int sr_init_via_guid(struct sr_ctx** context, uint64_t guid, sr_log_func log_func_in, struct sr_config* conf);
 int sr_cleanup(struct sr_ctx* context);
+/*
+ * Fail the next blocking call this thread makes on the context with -ETIMEDOUT
+ * once 'timeout_ms' from now has passed, whatever retries are left. It covers
+ * that call only, and none of the lease renewals, cache refreshes or
+ * asynchronous requests running meanwhile; 0 disarms it.
+ */
+void sr_set_deadline(struct sr_ctx* context, unsigned timeout_ms);
+/* Snapshot of the SA transaction counters of the context device */
+void sr_get_stats(struct sr_ctx* context, struct sr_stats* stats);
+/*
+ * Write the counters in Prometheus text format. Returns the length of the
+ * whole text, which was truncated if it is not less than 'size'.
+ */
+int sr_dump_stats(struct sr_ctx* context, char* buf, size_t size);
+/*
+ * Register the context service. A record the SA acknowledged lately, within
+ * half its lease, is not sent again unchanged. A changed one is SET and
+ * followed by one lookup for stale records of other ports, where the first
+ * registration looks until none are left.
+ */
 int sr_register_service(struct sr_ctx* context, const void* data, size_t data_size, const uint8_t (*service_key)[SR_128_BIT_SIZE]);
+/*
+ * Remove every record of the context service, or with SR_BULK_UNREGISTER every
+ * record registered through the context. Returns how many could not be
+ * removed, or a negative errno.
+ */
 int sr_unregister_service(struct sr_ctx* context, const uint8_t (*service_key)[SR_128_BIT_SIZE]);
+/*
+ * Remove the records of 'srs', by ID and port GID, with all DELETEs in flight
+ * together. Returns how many could not be removed, or a negative errno.
+ */
+int sr_unregister_services(struct sr_ctx* context, const struct sr_dev_service* srs, int num, const uint8_t (*service_key)[SR_128_BIT_SIZE]);
+/*
+ * Register 'num' services with all SETs in flight together, then remove stale
+ * records of the registered IDs once for the whole batch. Records are skipped
+ * or replaced as by sr_register_service(). Per-record results are stored in
+ * entries[i].status. Returns the number of records registered.
+ */
+int sr_register_services(struct sr_ctx* context, struct sr_service_entry* entries, int num);
 int sr_query_service(struct sr_ctx* context, struct sr_dev_service* srs, int srs_num, int retries);
+
+enum
+{
+    SR_QUERY_FILTER_NAME = 1 << 0,
+    SR_QUERY_FILTER_GID = 1 << 1,
+    SR_QUERY_FILTER_PKEY = 1 << 2,
+    SR_QUERY_FILTER_KEY = 1 << 3,
+};
+
+/* Fields the SA matches a query on, besides the service ID */
+struct sr_query_filter
+{
+    uint32_t flags;                          /* SR_QUERY_FILTER_* */
+    uint64_t id;                             /* Service ID, 0 for the context service ID */
+    const char* name;                        /* NULL for the context service name */
+    uint8_t port_gid[16];
+    uint16_t pkey;
+    uint8_t service_key[SR_128_BIT_SIZE];
+};
+
+/* Query with the filter matched by the SA. Without SR_QUERY_FILTER_NAME records of any name are returned */
+int sr_query_service_filter(struct sr_ctx* context, const struct sr_query_filter* filter, struct sr_dev_service* srs, int srs_num, int retries);
+
+/* Called for each record as it is decoded; return non-zero to stop */
+typedef int (*sr_service_cb)(const struct sr_dev_service* service, void* arg);
+
+/* Visit every record of the service, with no limit on their number. Returns the number visited */
+int sr_foreach_service(struct sr_ctx* context, int retries, sr_service_cb cb, void* arg);
+void sr_flush_query_cache(struct sr_ctx* context);
+
+/* Called when a lease renewal fails; it is tried again shortly */
+typedef void (*sr_renewal_cb)(struct sr_ctx* context, uint64_t id, const char* name, int status, void* arg);
+
+/*
+ * Keep services registered from now on alive: each is SET again 'margin_ms'
+ * (0 for the default) before its lease expires, and at once after the SA
+ * reports a port event when subscribed. Renewals are sent while the context
+ * is progressed, by the I/O thread with SR_IO_THREAD, otherwise by
+ * sr_progress() or any blocking call. Stays enabled until sr_cleanup().
+ */
+int sr_enable_renewal(struct sr_ctx* context, unsigned margin_ms, sr_renewal_cb cb, void* arg);
+
+/*
+ * Query without copying records out. They are left in 'buf' or, if 'buf' is
+ * NULL, in the context arena, which is valid until the next blocking query on
+ * the context. Returns the number of records or -ENOBUFS if 'buf' is too small.
+ */
+int sr_query_service_view(struct sr_ctx* context, void* buf, size_t buf_size, int retries, struct sr_service_view* view);
+uint64_t sr_view_id(const struct sr_service_view* view, int i);
+const char* sr_view_name(const struct sr_service_view* view, int i, size_t* len); /* Not NUL-terminated */
+const uint8_t* sr_view_port_gid(const struct sr_service_view* view, int i);
+const uint8_t* sr_view_data(const struct sr_service_view* view, int i);
+uint32_t sr_view_lease(const struct sr_service_view* view, int i);
+
+/*
+ * Subscribe to GID in/out of service traps. The SA pushes a Report for every
+ * event; it is acknowledged and delivered to 'cb' from sr_progress() or any
+ * blocking call. Cached query results are dropped before the callback runs.
+ */
+int sr_subscribe(struct sr_ctx* context, sr_notice_cb cb, void* arg);
+int sr_unsubscribe(struct sr_ctx* context);
 void sr_printout_service(struct sr_dev_service* srs, int srs_num);
 
+/*
+ * Asynchronous requests. The *_async() calls return immediately; the request
+ * is driven by sr_progress() and completes with the same result the blocking
+ * call would return. Any number of requests may be in flight on one context.
+ * If 'request' is NULL the handle is released after the callback, otherwise
+ * the caller releases it with sr_request_free(), also allowed from the callback.
+ * Requests must be released before sr_cleanup().
+ */
+struct sr_request;
+typedef void (*sr_request_cb)(struct sr_request* request, int status, void* arg);
+
+int sr_register_service_async(struct sr_ctx* context,
+                              const void* data,
+                              size_t data_size,
+                              const uint8_t (*service_key)[SR_128_BIT_SIZE],
+                              sr_request_cb cb,
+                              void* arg,
+                              struct sr_request** request);
+int sr_unregister_service_async(struct sr_ctx* context,
+                                const uint8_t (*service_key)[SR_128_BIT_SIZE],
+                                sr_request_cb cb,
+                                void* arg,
+                                struct sr_request** request);
+int sr_query_service_async(struct sr_ctx* context, sr_request_cb cb, void* arg, struct sr_request** request);
+int sr_request_status(struct sr_request* request); /* -EINPROGRESS while pending */
+int sr_request_services(struct sr_request* request, struct sr_dev_service* srs, int srs_num);
+void sr_request_free(struct sr_request* request);
+
+/* Pollable descriptor, readable when sr_progress() has responses to process */
+int sr_get_fd(struct sr_ctx* context);
+/* Milliseconds until sr_progress() must run for timeouts, retries and lease renewals, -1 if idle */
+int sr_get_timeout(struct sr_ctx* context);
+/* Process responses and timers, waiting up to timeout_ms. Returns completed SA transactions */
+int sr_progress(struct sr_ctx* context, int timeout_ms);
+
 #ifdef __cplusplus
 }
 #endif
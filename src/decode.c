@@ -0,0 +1,206 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * Batch scans of GET_TABLE ServiceRecord payloads. Names are matched against
+ * a needle zero-padded to the 64-byte field: a record matches when its field
+ * equals the needle up to and including the terminating NUL, whatever follows.
+ * The result is a bitmap, so callers copy out only the matching records. On
+ * x86-64 the fields are compared 32 bytes at a time with AVX2 when the CPU
+ * has it and 16 at a time with SSE2 otherwise; other CPUs, 32-bit x86 among
+ * them as SSE2 is not part of its baseline, take the scalar loop, which is
+ * also the reference the vector ones are tested against.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define SR_DECODE_X86 1
+#endif
+
+#include <infiniband/umad_sa.h>
+
+#include "service_record.h"
+#include "services.h"
+
+#define SR_DECODE_NAME_LEN sizeof(((struct sr_ib_service_record*)0)->service_name)
+#define SR_DECODE_NAME_OFF offsetof(struct sr_ib_service_record, service_name)
+#define SR_DECODE_LEASE_OFF offsetof(struct sr_ib_service_record, service_lease)
+
+static void decode_match_scalar(const uint8_t* names, int stride, int num, const uint8_t* needle, size_t len,
+                                uint64_t* bitmap)
+{
+    for (int i = 0; i < num; ++i)
+        if (!memcmp(names + (size_t)i * stride, needle, len))
+            bitmap[i / 64] |= 1ULL << (i % 64);
+}
+
+#ifdef SR_DECODE_X86
+/* 'prefix' has a bit set for each byte of the needle that must match */
+static void decode_match_sse2(const uint8_t* names, int stride, int num, const uint8_t* needle, uint64_t prefix,
+                              uint64_t* bitmap)
+{
+    __m128i n0 = _mm_loadu_si128((const __m128i*)needle);
+    __m128i n1 = _mm_loadu_si128((const __m128i*)(needle + 16));
+    __m128i n2 = _mm_loadu_si128((const __m128i*)(needle + 32));
+    __m128i n3 = _mm_loadu_si128((const __m128i*)(needle + 48));
+    const uint8_t* p;
+    uint64_t eq;
+
+    for (int i = 0; i < num; ++i) {
+        p = names + (size_t)i * stride;
+        eq = (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), n0)) |
+             (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), n1)) << 16 |
+             (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), n2)) << 32 |
+             (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), n3)) << 48;
+        if ((eq & prefix) == prefix)
+            bitmap[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+__attribute__((target("avx2"))) static void decode_match_avx2(const uint8_t* names, int stride, int num,
+                                                              const uint8_t* needle, uint64_t prefix, uint64_t* bitmap)
+{
+    __m256i lo = _mm256_loadu_si256((const __m256i*)needle);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(needle + 32));
+    const uint8_t* p;
+    uint64_t eq;
+
+    for (int i = 0; i < num; ++i) {
+        p = names + (size_t)i * stride;
+        eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), lo));
+        /* Names of up to 31 characters are decided by the first half */
+        if ((uint32_t)prefix == prefix) {
+            if (((uint32_t)eq & prefix) == prefix)
+                bitmap[i / 64] |= 1ULL << (i % 64);
+            continue;
+        }
+        eq |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), hi))
+              << 32;
+        if ((eq & prefix) == prefix)
+            bitmap[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+/* Smallest of the big-endian leases, eight records per step */
+__attribute__((target("avx2"))) static uint32_t decode_min_lease_avx2(const uint8_t* leases, int stride, int num)
+{
+    const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i min = _mm256_set1_epi32(-1);
+    uint32_t lanes[8], lease, ret;
+    int i;
+
+    for (i = 0; i + 8 <= num; i += 8) {
+        __m256i v = _mm256_i32gather_epi32((const int*)(leases + (size_t)i * stride), index, 1);
+        min = _mm256_min_epu32(min, _mm256_shuffle_epi8(v, bswap));
+    }
+
+    _mm256_storeu_si256((__m256i*)lanes, min);
+    ret = lanes[0];
+    for (int j = 1; j < 8; ++j)
+        ret = lanes[j] < ret ? lanes[j] : ret;
+
+    for (; i < num; ++i) {
+        memcpy(&lease, leases + (size_t)i * stride, sizeof(lease));
+        lease = __be32_to_cpu(lease);
+        ret = lease < ret ? lease : ret;
+    }
+    return ret;
+}
+#endif
+
+/*
+ * Build the needle of 'name', zero padded to the field, and clear the bitmap.
+ * Returns the bytes that must match, 0 if no record can.
+ */
+static size_t decode_needle(const char* name, int num, uint8_t* needle, uint64_t* bitmap)
+{
+    size_t len = strnlen(name, SR_DECODE_NAME_LEN + 1);
+
+    memset(bitmap, 0, (num + 63) / 64 * sizeof(*bitmap));
+    memset(needle, 0, SR_DECODE_NAME_LEN);
+    /* No record holds a name longer than the field */
+    if (len > SR_DECODE_NAME_LEN)
+        return 0;
+
+    memcpy(needle, name, len);
+    /* The terminator must match too, unless the name fills the field */
+    return len < SR_DECODE_NAME_LEN ? len + 1 : len;
+}
+
+static int decode_count(const uint64_t* bitmap, int num)
+{
+    int matches = 0;
+
+    for (int i = 0; i < (num + 63) / 64; ++i)
+        matches += __builtin_popcountll(bitmap[i]);
+    return matches;
+}
+
+/*
+ * Set the bit of each of the 'num' records, at most SR_DECODE_BATCH, whose
+ * name is 'name'. Returns the number of matches.
+ */
+int decode_match_names(const void* records, int record_size, int num, const char* name, uint64_t* bitmap)
+{
+    const uint8_t* names = (const uint8_t*)records + SR_DECODE_NAME_OFF;
+    uint8_t needle[SR_DECODE_NAME_LEN];
+    size_t len = decode_needle(name, num, needle, bitmap);
+
+    if (!len)
+        return 0;
+
+#ifdef SR_DECODE_X86
+    uint64_t prefix = len == 64 ? UINT64_MAX : (1ULL << len) - 1;
+
+    if (__builtin_cpu_supports("avx2"))
+        decode_match_avx2(names, record_size, num, needle, prefix, bitmap);
+    else
+        decode_match_sse2(names, record_size, num, needle, prefix, bitmap);
+#else
+    decode_match_scalar(names, record_size, num, needle, len, bitmap);
+#endif
+
+    return decode_count(bitmap, num);
+}
+
+/* decode_match_names() without vector instructions */
+int decode_match_names_scalar(const void* records, int record_size, int num, const char* name, uint64_t* bitmap)
+{
+    uint8_t needle[SR_DECODE_NAME_LEN];
+    size_t len = decode_needle(name, num, needle, bitmap);
+
+    if (!len)
+        return 0;
+
+    decode_match_scalar((const uint8_t*)records + SR_DECODE_NAME_OFF, record_size, num, needle, len, bitmap);
+    return decode_count(bitmap, num);
+}
+
+/* Smallest lease of the records, in sec, UINT32_MAX (infinite) if there are none */
+uint32_t decode_min_lease(const void* records, int record_size, int num)
+{
+    const uint8_t* leases = (const uint8_t*)records + SR_DECODE_LEASE_OFF;
+    uint32_t min = UINT32_MAX, lease;
+
+#ifdef SR_DECODE_X86
+    /* Gather offsets are 32-bit */
+    if (__builtin_cpu_supports("avx2") && record_size < INT32_MAX / 8)
+        return decode_min_lease_avx2(leases, record_size, num);
+#endif
+
+    for (int i = 0; i < num; ++i) {
+        memcpy(&lease, leases + (size_t)i * record_size, sizeof(lease));
+        lease = __be32_to_cpu(lease);
+        min = lease < min ? lease : min;
+    }
+    return min;
+}
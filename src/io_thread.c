@@ -0,0 +1,247 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * I/O thread for contexts created with SR_IO_THREAD. The thread owns the
+ * transport and the SA engine; other threads hand it operations through a
+ * lock-free multi-producer queue and sleep until their transactions complete.
+ * Producers push onto a stack with compare-and-swap, and the I/O thread takes
+ * the whole stack at once and reverses it, so operations run in push order.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "service_record.h"
+#include "services.h"
+
+struct sr_io
+{
+    pthread_t thread;
+    int event_fd;                /* Wakes the thread when the queue becomes non-empty */
+    int stop;
+    struct sr_io_op* queue;      /* Pushed by any thread, taken whole by the I/O thread */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;         /* Broadcast when transactions or operations complete */
+};
+
+int dev_io_direct(struct sr_dev* dev)
+{
+    return !dev->io || pthread_equal(pthread_self(), dev->io->thread);
+}
+
+static void io_push(struct sr_io* io, struct sr_io_op* op)
+{
+    struct sr_io_op* head = __atomic_load_n(&io->queue, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+
+    /* Once pushed the op belongs to the I/O thread, only 'head' may be looked at */
+    do {
+        op->next = head;
+    } while (!__atomic_compare_exchange_n(&io->queue, &head, op, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* Only the push onto an empty queue needs to wake the thread */
+    if (!head && write(io->event_fd, &one, sizeof(one)) < 0)
+        sr_log_warn("I/O thread wakeup failed: %s", strerror(errno));
+}
+
+static void io_wake_waiters(struct sr_io* io)
+{
+    pthread_mutex_lock(&io->lock);
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+}
+
+static void io_wait_status(struct sr_io* io, int* status)
+{
+    pthread_mutex_lock(&io->lock);
+    while (__atomic_load_n(status, __ATOMIC_ACQUIRE) == -EINPROGRESS)
+        pthread_cond_wait(&io->cond, &io->lock);
+    pthread_mutex_unlock(&io->lock);
+}
+
+/* Run queued operations in push order. Returns non-zero if any completed */
+static int io_drain(struct sr_dev* dev)
+{
+    struct sr_io_op *op, *next, *list = NULL;
+    int ret, done = 0;
+
+    op = __atomic_exchange_n(&dev->io->queue, NULL, __ATOMIC_ACQUIRE);
+    for (; op; op = next) {
+        next = op->next;
+        op->next = list;
+        list = op;
+    }
+
+    for (op = list; op; op = next) {
+        next = op->next;
+        switch (op->type) {
+            case SR_IO_SUBMIT:
+                if (__atomic_load_n(&dev->io->stop, __ATOMIC_ACQUIRE)) {
+                    ret = -ECANCELED;
+                } else if ((ret = dev_sa_start(dev, op->txn)) >= 0) {
+                    continue;
+                }
+                __atomic_store_n(&op->txn->status, ret, __ATOMIC_RELEASE);
+                break;
+            case SR_IO_CANCEL:
+                dev_sa_cancel(dev, op->txn);
+                __atomic_store_n(&op->status, 0, __ATOMIC_RELEASE);
+                break;
+            case SR_IO_UPDATE:
+                __atomic_store_n(&op->status, services_dev_update(dev), __ATOMIC_RELEASE);
+                break;
+        }
+        done = 1;
+    }
+
+    return done;
+}
+
+static void* io_thread(void* arg)
+{
+    struct sr_dev* dev = arg;
+    struct sr_io* io = dev->io;
+    struct pollfd fds[2];
+    uint64_t events;
+    int ret;
+
+    fds[0].fd = io->event_fd;
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+
+    while (!__atomic_load_n(&io->stop, __ATOMIC_ACQUIRE)) {
+        /* A device update may reopen the transport */
+        fds[1].fd = dev->transport->get_fd(dev);
+        if (poll(fds, 2, dev_sa_next_timeout(dev)) < 0 && errno != EINTR) {
+            sr_log_err("I/O thread poll failed: %s", strerror(errno));
+            break;
+        }
+
+        /* Read the wakeup before taking the queue, so no push goes unnoticed */
+        if (fds[0].revents & POLLIN && read(io->event_fd, &events, sizeof(events)) < 0)
+            sr_log_warn("I/O thread wakeup read failed: %s", strerror(errno));
+
+        ret = io_drain(dev);
+        if ((ret |= dev_sa_progress(dev, 0)) < 0)
+            sr_log_info("I/O thread progress failed: %s", strerror(-ret));
+        if (ret)
+            io_wake_waiters(io);
+    }
+
+    /* Fail whatever was queued meanwhile, then whatever is still outstanding */
+    io_drain(dev);
+    while (dev->txns) {
+        struct sr_sa_txn* txn = dev->txns;
+
+        dev_sa_cancel(dev, txn);
+        __atomic_store_n(&txn->status, -ECANCELED, __ATOMIC_RELEASE);
+    }
+    io_wake_waiters(io);
+    return NULL;
+}
+
+int io_thread_start(struct sr_dev* dev)
+{
+    struct sr_io* io;
+    int ret;
+
+    if (!dev->transport->get_fd) {
+        sr_log_err("%s transport has no fd for an I/O thread", dev->transport->name);
+        return -ENOTSUP;
+    }
+
+    io = calloc(1, sizeof(*io));
+    if (!io) {
+        sr_log_err("Failed to allocate I/O thread");
+        return -ENOMEM;
+    }
+
+    io->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->event_fd < 0) {
+        ret = -errno;
+        sr_log_err("eventfd failed: %s", strerror(errno));
+        free(io);
+        return ret;
+    }
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+
+    dev->io = io;
+    if ((ret = pthread_create(&io->thread, NULL, io_thread, dev))) {
+        sr_log_err("Failed to start I/O thread: %s", strerror(ret));
+        dev->io = NULL;
+        close(io->event_fd);
+        pthread_cond_destroy(&io->cond);
+        pthread_mutex_destroy(&io->lock);
+        free(io);
+        return -ret;
+    }
+
+    return 0;
+}
+
+void io_thread_stop(struct sr_dev* dev)
+{
+    struct sr_io* io = dev->io;
+    uint64_t one = 1;
+
+    if (!io)
+        return;
+
+    __atomic_store_n(&io->stop, 1, __ATOMIC_RELEASE);
+    if (write(io->event_fd, &one, sizeof(one)) < 0)
+        sr_log_warn("I/O thread wakeup failed: %s", strerror(errno));
+    pthread_join(io->thread, NULL);
+
+    dev->io = NULL;
+    close(io->event_fd);
+    pthread_cond_destroy(&io->cond);
+    pthread_mutex_destroy(&io->lock);
+    free(io);
+}
+
+void io_submit(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    txn->op.type = SR_IO_SUBMIT;
+    txn->op.txn = txn;
+    io_push(dev->io, &txn->op);
+}
+
+void io_wait(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    io_wait_status(dev->io, &txn->status);
+}
+
+/* Run an operation on the I/O thread and wait for its result */
+int io_call(struct sr_dev* dev, int type, struct sr_sa_txn* txn)
+{
+    struct sr_io_op op = {.type = type, .txn = txn, .status = -EINPROGRESS};
+
+    io_push(dev->io, &op);
+    io_wait_status(dev->io, &op.status);
+    return op.status;
+}
+
+/* Make the I/O thread look at the device timer again */
+void dev_wake(struct sr_dev* dev)
+{
+    uint64_t one = 1;
+
+    if (dev->io && !dev_io_direct(dev) && write(dev->io->event_fd, &one, sizeof(one)) < 0)
+        sr_log_warn("I/O thread wakeup failed: %s", strerror(errno));
+}
+
+int dev_update(struct sr_dev* dev)
+{
+    return dev_io_direct(dev) ? services_dev_update(dev) : io_call(dev, SR_IO_UPDATE, NULL);
+}
@@ -0,0 +1,400 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * Lease renewal. Every record the context registers is kept with the time it
+ * has to be renewed, a margin before its lease runs out, in a hierarchical
+ * timer wheel of one second ticks. Records due in the same tick are SET again
+ * back to back when the device is progressed, which is done by the I/O thread
+ * with SR_IO_THREAD and by sr_progress() or any blocking call otherwise.
+ *
+ * The wheel has SR_WHEEL_LEVELS levels of SR_WHEEL_SIZE slots; a slot of level
+ * l spans SR_WHEEL_SIZE^l ticks. Each time the low bits of the tick wrap, the
+ * matching slot of the next level is spread back over the lower ones.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <infiniband/umad_sa.h>
+
+#include "service_record.h"
+#include "services.h"
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define SR_LEASE_TICK_US   1000000ULL
+#define SR_LEASE_RETRY     10          /* Ticks before a failed renewal is tried again */
+#define SR_LEASE_INFINITE  0xffffffff
+
+#define SR_WHEEL_BITS      6
+#define SR_WHEEL_SIZE      (1 << SR_WHEEL_BITS)
+#define SR_WHEEL_MASK      (SR_WHEEL_SIZE - 1)
+#define SR_WHEEL_LEVELS    3
+#define SR_WHEEL_MAX       ((1ULL << (SR_WHEEL_BITS * SR_WHEEL_LEVELS)) - 1) /* Furthest tick ahead, ~3 days */
+
+struct sr_lease
+{
+    struct sr_lease* next;            /* Wheel slot or due list */
+    struct sr_lease** pprev;
+    struct sr_lease* all_next;        /* All leases of the context */
+    uint64_t expires;                 /* Renewal tick */
+    int queued;                       /* On a wheel slot */
+    int renewing;                     /* SET in flight */
+    int dead;                         /* Unregistered, freed when the SET completes */
+    struct sr_ctx* context;
+    struct sr_ib_service_record record;
+    struct sr_sa_txn txn;
+};
+
+struct sr_lease_engine
+{
+    pthread_mutex_t lock;             /* Taken by the device thread too, never held while waiting on it */
+    uint64_t base;                    /* usec of tick 0 */
+    uint64_t now;                     /* Last tick handled */
+    struct sr_lease* slots[SR_WHEEL_LEVELS][SR_WHEEL_SIZE];
+    int num_queued;
+    struct sr_lease* leases;
+    uint64_t margin;                  /* Renew this many ticks before expiry */
+    sr_renewal_cb cb;
+    void* arg;
+};
+
+static void wheel_unlink(struct sr_lease_engine* engine, struct sr_lease* lease)
+{
+    if (!lease->queued)
+        return;
+
+    *lease->pprev = lease->next;
+    if (lease->next)
+        lease->next->pprev = lease->pprev;
+    lease->queued = 0;
+    engine->num_queued--;
+}
+
+/* Queue on the slot matching 'expires', which must not be behind the wheel */
+static void wheel_insert(struct sr_lease_engine* engine, struct sr_lease* lease)
+{
+    struct sr_lease** slot;
+    uint64_t delta = lease->expires - engine->now;
+    int level;
+
+    for (level = 0; level < SR_WHEEL_LEVELS - 1 && delta >= (1ULL << (SR_WHEEL_BITS * (level + 1))); ++level)
+        ;
+    slot = &engine->slots[level][(lease->expires >> (SR_WHEEL_BITS * level)) & SR_WHEEL_MASK];
+
+    lease->next = *slot;
+    if (lease->next)
+        lease->next->pprev = &lease->next;
+    lease->pprev = slot;
+    *slot = lease;
+    lease->queued = 1;
+    engine->num_queued++;
+}
+
+static void wheel_add(struct sr_lease_engine* engine, struct sr_lease* lease)
+{
+    wheel_unlink(engine, lease);
+
+    /* Due or overdue fires on the next tick, too far ahead waits on the last level */
+    if (lease->expires <= engine->now)
+        lease->expires = engine->now + 1;
+    if (lease->expires - engine->now > SR_WHEEL_MAX)
+        lease->expires = engine->now + SR_WHEEL_MAX;
+
+    wheel_insert(engine, lease);
+}
+
+/* Advance to tick 'to' and return the leases that came due, linked by 'next' */
+static struct sr_lease* wheel_advance(struct sr_lease_engine* engine, uint64_t to)
+{
+    struct sr_lease *due = NULL, *lease, *next;
+    int level;
+
+    while (engine->now < to && engine->num_queued) {
+        engine->now++;
+
+        /*
+         * Spread higher level slots over the lower ones as their turn comes.
+         * Entries due this very tick land on the level 0 slot handled below.
+         */
+        for (level = 1; level < SR_WHEEL_LEVELS && !(engine->now & ((1ULL << (SR_WHEEL_BITS * level)) - 1)); ++level) {
+            for (lease = engine->slots[level][(engine->now >> (SR_WHEEL_BITS * level)) & SR_WHEEL_MASK]; lease; lease = next) {
+                next = lease->next;
+                wheel_unlink(engine, lease);
+                wheel_insert(engine, lease);
+            }
+        }
+
+        for (lease = engine->slots[0][engine->now & SR_WHEEL_MASK]; lease; lease = next) {
+            next = lease->next;
+            wheel_unlink(engine, lease);
+            lease->next = due;
+            due = lease;
+        }
+    }
+    engine->now = MAX(engine->now, to);
+
+    return due;
+}
+
+/* First tick something may be due, or 0 if the wheel is empty */
+static uint64_t wheel_next(struct sr_lease_engine* engine)
+{
+    uint64_t tick;
+
+    if (!engine->num_queued)
+        return 0;
+
+    for (tick = engine->now + 1; tick & SR_WHEEL_MASK; ++tick)
+        if (engine->slots[0][tick & SR_WHEEL_MASK])
+            return tick;
+
+    /* Nothing on level 0 before it wraps, wake up to cascade */
+    return tick;
+}
+
+static uint64_t lease_tick(struct sr_lease_engine* engine, uint64_t now)
+{
+    return (now - engine->base) / SR_LEASE_TICK_US;
+}
+
+static void lease_update_timer(struct sr_dev* dev, struct sr_lease_engine* engine)
+{
+    uint64_t next = wheel_next(engine);
+
+    __atomic_store_n(&dev->timer_next, next ? engine->base + next * SR_LEASE_TICK_US : 0, __ATOMIC_RELAXED);
+}
+
+/* The wheel may lag behind the clock until the timer fires, so count from the clock */
+static void lease_schedule(struct sr_lease_engine* engine, struct sr_lease* lease, uint64_t ticks)
+{
+    lease->expires = lease_tick(engine, get_time_stamp()) + ticks;
+    wheel_add(engine, lease);
+}
+
+static uint64_t lease_interval(struct sr_lease_engine* engine, struct sr_lease* lease)
+{
+    uint64_t lease_ticks = __be32_to_cpu(lease->record.service_lease);
+
+    /* Renew a margin before expiry, but at least halfway through short leases */
+    return lease_ticks > 2 * engine->margin ? lease_ticks - engine->margin : MAX(lease_ticks / 2, 1);
+}
+
+static void lease_free(struct sr_lease_engine* engine, struct sr_lease* lease)
+{
+    struct sr_lease** p;
+
+    wheel_unlink(engine, lease);
+    for (p = &engine->leases; *p; p = &(*p)->all_next) {
+        if (*p == lease) {
+            *p = lease->all_next;
+            break;
+        }
+    }
+    free(lease);
+}
+
+static void lease_renew_done(struct sr_sa_txn* txn)
+{
+    struct sr_lease* lease = txn->arg;
+    struct sr_ctx* context = lease->context;
+    struct sr_lease_engine* engine = context->lease;
+    char name[SR_DEV_SERVICE_NAME_MAX];
+    sr_renewal_cb cb = NULL;
+    int status = txn->status;
+    uint64_t id;
+
+    pthread_mutex_lock(&engine->lock);
+    id = __be64_to_cpu(lease->record.service_id);
+    snprintf(name, sizeof(name), "%.*s", (int)sizeof(lease->record.service_name), lease->record.service_name);
+    lease->renewing = 0;
+    if (lease->dead) {
+        lease_free(engine, lease);
+    } else if (status > 0) {
+        service_cache_save(context->dev, &lease->record);
+        lease_schedule(engine, lease, lease_interval(engine, lease));
+    } else {
+        sr_log_warn("Couldn't renew service 0x%016" PRIx64 ": %d", id, status);
+        service_cache_unconfirm(context->dev);
+        lease_schedule(engine, lease, SR_LEASE_RETRY);
+        cb = engine->cb;
+    }
+    lease_update_timer(context->dev, engine);
+    pthread_mutex_unlock(&engine->lock);
+
+    /* The lease may be gone by now */
+    if (cb)
+        cb(context, id, name, status ? status : -EPROTO, engine->arg);
+}
+
+/* Device timer: SET again every record that came due, all in flight together */
+static void lease_timer(struct sr_dev* dev, void* arg)
+{
+    struct sr_ctx* context = arg;
+    struct sr_lease_engine* engine = context->lease;
+    struct sr_lease *lease, *next;
+    int num = 0, ret;
+
+    pthread_mutex_lock(&engine->lock);
+    for (lease = wheel_advance(engine, lease_tick(engine, get_time_stamp())); lease; lease = next) {
+        next = lease->next;
+
+        /* The port GID may have changed since the record was registered */
+        memcpy(lease->record.service_gid, &dev->port_gid, sizeof(lease->record.service_gid));
+        dev_register_txn_init(&lease->txn, &lease->record);
+        lease->txn.retries = context->sr_retries;
+        lease->txn.complete = lease_renew_done;
+        lease->txn.arg = lease;
+        if ((ret = dev_sa_submit(dev, &lease->txn)) < 0) {
+            sr_log_warn("Couldn't send lease renewal: %s", strerror(-ret));
+            lease_schedule(engine, lease, SR_LEASE_RETRY);
+            continue;
+        }
+        lease->renewing = 1;
+        num++;
+    }
+    lease_update_timer(dev, engine);
+    pthread_mutex_unlock(&engine->lock);
+
+    if (num)
+        sr_log_info("Renewing %d service leases", num);
+}
+
+void lease_track(struct sr_ctx* context, const struct sr_ib_service_record* record)
+{
+    struct sr_lease_engine* engine = context->lease;
+    struct sr_lease* lease;
+
+    if (!engine || __be32_to_cpu(record->service_lease) == SR_LEASE_INFINITE)
+        return;
+
+    pthread_mutex_lock(&engine->lock);
+    for (lease = engine->leases; lease; lease = lease->all_next)
+        if (!lease->dead && lease->record.service_id == record->service_id &&
+            !strncmp(lease->record.service_name, record->service_name, sizeof(record->service_name)))
+            break;
+
+    if (!lease) {
+        lease = calloc(1, sizeof(*lease));
+        if (!lease) {
+            pthread_mutex_unlock(&engine->lock);
+            sr_log_err("Failed to allocate lease of service 0x%016" PRIx64, __be64_to_cpu(record->service_id));
+            return;
+        }
+        lease->context = context;
+        lease->all_next = engine->leases;
+        engine->leases = lease;
+    }
+
+    lease->record = *record;
+    if (!lease->renewing)
+        lease_schedule(engine, lease, lease_interval(engine, lease));
+    lease_update_timer(context->dev, engine);
+    pthread_mutex_unlock(&engine->lock);
+
+    dev_wake(context->dev);
+}
+
+void lease_untrack(struct sr_ctx* context, uint64_t id, const char* name)
+{
+    struct sr_lease_engine* engine = context->lease;
+    struct sr_lease *lease, *next;
+
+    if (!engine)
+        return;
+
+    pthread_mutex_lock(&engine->lock);
+    for (lease = engine->leases; lease; lease = next) {
+        next = lease->all_next;
+        if (lease->dead || __be64_to_cpu(lease->record.service_id) != id ||
+            strncmp(lease->record.service_name, name, sizeof(lease->record.service_name)))
+            continue;
+
+        /* A SET in flight still points at the lease, its completion frees it */
+        if (lease->renewing) {
+            wheel_unlink(engine, lease);
+            lease->dead = 1;
+        } else {
+            lease_free(engine, lease);
+        }
+    }
+    lease_update_timer(context->dev, engine);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/* Port came or went: renew everything on the next tick */
+void lease_kick(struct sr_ctx* context)
+{
+    struct sr_lease_engine* engine = context->lease;
+    struct sr_lease* lease;
+
+    if (!engine)
+        return;
+
+    pthread_mutex_lock(&engine->lock);
+    for (lease = engine->leases; lease; lease = lease->all_next)
+        if (lease->queued)
+            lease_schedule(engine, lease, 0);
+    lease_update_timer(context->dev, engine);
+    pthread_mutex_unlock(&engine->lock);
+
+    dev_wake(context->dev);
+}
+
+int sr_enable_renewal(struct sr_ctx* context, unsigned margin_ms, sr_renewal_cb cb, void* arg)
+{
+    struct sr_lease_engine* engine;
+
+    if (context->lease)
+        return -EALREADY;
+
+    engine = calloc(1, sizeof(*engine));
+    if (!engine) {
+        sr_log_err("Failed to allocate lease renewal");
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&engine->lock, NULL);
+    engine->base = get_time_stamp();
+    engine->margin = (margin_ms ? margin_ms : SR_DEFAULT_RENEWAL_MARGIN) * 1000ULL / SR_LEASE_TICK_US;
+    engine->cb = cb;
+    engine->arg = arg;
+    context->lease = engine;
+
+    context->dev->timer_arg = context;
+    __atomic_store_n(&context->dev->timer, lease_timer, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void lease_cleanup(struct sr_ctx* context)
+{
+    struct sr_lease_engine* engine = context->lease;
+    struct sr_lease* lease;
+
+    if (!engine)
+        return;
+
+    context->dev->timer = NULL;
+    context->dev->timer_next = 0;
+    while ((lease = engine->leases)) {
+        engine->leases = lease->all_next;
+        if (lease->renewing)
+            dev_sa_cancel(context->dev, &lease->txn);
+        free(lease);
+    }
+
+    pthread_mutex_destroy(&engine->lock);
+    free(engine);
+    context->lease = NULL;
+}
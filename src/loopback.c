@@ -0,0 +1,558 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * Loopback transport: an in-process Subnet Administrator serving ServiceRecord
+ * SET/GET/GET_TABLE/DELETE from a table shared by all loopback contexts of the
+ * process. Each context behaves like a separate port on one subnet. Responses
+ * are queued and released loopback_latency_us after the request was sent, so
+ * several transactions may be outstanding at the same time. Ports subscribed
+ * through InformInfo get GID in/out of service Reports when other loopback
+ * ports open and close.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <infiniband/umad_sa.h>
+#include <infiniband/umad_types.h>
+
+#include "service_record.h"
+#include "services.h"
+
+#define LOOPBACK_SUBNET_PREFIX 0xfe80000000000000ULL
+#define LOOPBACK_GUID_BASE     0x0002c90300000000ULL
+#define LOOPBACK_SM_LID        1
+#define LOOPBACK_INFINITE_LEASE 0xffffffffU
+
+/* MAD status field values, see report_sa_err() */
+#define LOOPBACK_MAD_STATUS_BAD_METHOD      (2 << 2)
+#define LOOPBACK_MAD_STATUS_BAD_METHOD_ATTR (3 << 2)
+#define LOOPBACK_SA_STATUS_NO_RESOURCES     (1 << 8)
+#define LOOPBACK_SA_STATUS_REQ_INVALID      (2 << 8)
+#define LOOPBACK_SA_STATUS_NO_RECORDS       (3 << 8)
+#define LOOPBACK_SA_STATUS_TOO_MANY_RECORDS (4 << 8)
+
+struct loopback_record
+{
+    struct sr_ib_service_record record;
+    uint64_t expires; /* usec timestamp, 0 - never */
+};
+
+struct loopback_resp
+{
+    struct loopback_resp* next;
+    uint64_t ready; /* usec timestamp the response becomes visible */
+    int length;
+    struct umad_sa_packet mad; /* must be last, may extend past UMAD_LEN_SA_DATA */
+};
+
+struct sr_loopback_dev
+{
+    struct loopback_resp* head;
+    struct loopback_resp** tail;
+    struct loopback_resp* last; /* returned by the previous recv() */
+    int fd;                     /* timerfd armed for the head response */
+    struct sr_loopback_dev* next; /* loopback_sa.devs */
+    uint32_t traps;             /* Subscribed traps, bit (trap - 64) */
+    struct loopback_resp* reports; /* Queued by other ports, guarded by loopback_sa.lock */
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    int refs;
+    uint64_t next_guid;
+    struct loopback_record* records;
+    int num_records;
+    int max_records;
+    struct sr_loopback_dev* devs;
+    uint32_t next_tid;
+} loopback_sa = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Offset and size of ServiceRecord component 'bit' */
+static int loopback_component(int bit, size_t* offset, size_t* size)
+{
+    static const struct
+    {
+        size_t offset;
+        size_t size;
+    } fields[] = {
+        {offsetof(struct sr_ib_service_record, service_id), 8},
+        {offsetof(struct sr_ib_service_record, service_gid), 16},
+        {offsetof(struct sr_ib_service_record, service_pkey), 2},
+        {0, 0}, /* reserved */
+        {offsetof(struct sr_ib_service_record, service_lease), 4},
+        {offsetof(struct sr_ib_service_record, service_key), SR_128_BIT_SIZE},
+        {offsetof(struct sr_ib_service_record, service_name), 64},
+    };
+    size_t data = offsetof(struct sr_ib_service_record, service_data);
+
+    if (bit < 7) {
+        *offset = fields[bit].offset;
+        *size = fields[bit].size;
+    } else if (bit < 23) {
+        *offset = data + (bit - 7);
+        *size = 1;
+    } else if (bit < 31) {
+        *offset = data + 16 + (bit - 23) * 2;
+        *size = 2;
+    } else if (bit < 35) {
+        *offset = data + 32 + (bit - 31) * 4;
+        *size = 4;
+    } else if (bit < 37) {
+        *offset = data + 48 + (bit - 35) * 8;
+        *size = 8;
+    } else {
+        return 0;
+    }
+
+    return *size != 0;
+}
+
+static int loopback_match(const struct sr_ib_service_record* rec, const struct sr_ib_service_record* req, uint64_t comp_mask)
+{
+    size_t offset, size;
+
+    for (int bit = 0; comp_mask >> bit; bit++) {
+        if (!(comp_mask & BIT(bit)) || !loopback_component(bit, &offset, &size))
+            continue;
+        if (memcmp((const char*)rec + offset, (const char*)req + offset, size))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void loopback_expire(uint64_t now)
+{
+    int i = 0;
+
+    while (i < loopback_sa.num_records) {
+        if (loopback_sa.records[i].expires && loopback_sa.records[i].expires <= now)
+            loopback_sa.records[i] = loopback_sa.records[--loopback_sa.num_records];
+        else
+            i++;
+    }
+}
+
+static uint16_t loopback_set(const struct sr_ib_service_record* req, uint64_t now)
+{
+    const uint64_t rid_mask = BIT(0) | BIT(1) | BIT(2); /* ServiceID, ServiceGID, ServicePKey */
+    struct loopback_record* entry = NULL;
+    uint32_t lease = __be32_to_cpu(req->service_lease);
+
+    for (int i = 0; i < loopback_sa.num_records; i++) {
+        if (loopback_match(&loopback_sa.records[i].record, req, rid_mask)) {
+            entry = &loopback_sa.records[i];
+            break;
+        }
+    }
+
+    if (!entry) {
+        if (loopback_sa.num_records == loopback_sa.max_records) {
+            int max = loopback_sa.max_records ? 2 * loopback_sa.max_records : 64;
+            struct loopback_record* records = realloc(loopback_sa.records, max * sizeof(*records));
+
+            if (!records)
+                return LOOPBACK_SA_STATUS_NO_RESOURCES;
+            loopback_sa.records = records;
+            loopback_sa.max_records = max;
+        }
+        entry = &loopback_sa.records[loopback_sa.num_records++];
+    }
+
+    entry->record = *req;
+    entry->expires = (lease == LOOPBACK_INFINITE_LEASE) ? 0 : now + lease * 1000000ULL;
+    return 0;
+}
+
+static struct loopback_resp* loopback_resp_alloc(const struct umad_sa_packet* req, int num_records)
+{
+    size_t data_size = num_records * sizeof(struct sr_ib_service_record);
+    size_t length = offsetof(struct umad_sa_packet, data) + data_size;
+    struct loopback_resp* resp;
+
+    /* Only RMPP (table) responses are sized by their payload, other MADs are full size */
+    if (req->mad_hdr.method != UMAD_SA_METHOD_GET_TABLE && length < sizeof(struct umad_sa_packet))
+        length = sizeof(struct umad_sa_packet);
+
+    resp = calloc(1, offsetof(struct loopback_resp, mad) + length);
+    if (!resp)
+        return NULL;
+
+    resp->length = length;
+    resp->mad.mad_hdr = req->mad_hdr;
+    resp->mad.mad_hdr.method =
+        (req->mad_hdr.method == UMAD_METHOD_SET ? UMAD_METHOD_GET : req->mad_hdr.method) | UMAD_METHOD_RESP_MASK;
+    resp->mad.attr_offset = __cpu_to_be16(sizeof(struct sr_ib_service_record) / 8);
+    resp->mad.comp_mask = req->comp_mask;
+    return resp;
+}
+
+/* Serve one ServiceRecord request from the shared table */
+static struct loopback_resp* loopback_process(const struct umad_sa_packet* req)
+{
+    const struct sr_ib_service_record* rec = (const struct sr_ib_service_record*)req->data;
+    uint64_t comp_mask = __be64_to_cpu(req->comp_mask);
+    uint64_t now = get_time_stamp();
+    struct loopback_resp* resp;
+    uint8_t* data;
+    uint16_t status = 0;
+    int num = 0;
+
+    pthread_mutex_lock(&loopback_sa.lock);
+    loopback_expire(now);
+
+    if (__be16_to_cpu(req->mad_hdr.attr_id) != UMAD_SA_ATTR_SERVICE_REC) {
+        status = LOOPBACK_MAD_STATUS_BAD_METHOD_ATTR;
+        goto respond;
+    }
+
+    switch (req->mad_hdr.method) {
+        case UMAD_METHOD_SET:
+            if ((comp_mask & (BIT(0) | BIT(1))) != (BIT(0) | BIT(1)))
+                status = LOOPBACK_SA_STATUS_REQ_INVALID;
+            else
+                status = loopback_set(rec, now);
+            num = !status;
+            break;
+        case UMAD_METHOD_GET:
+        case UMAD_SA_METHOD_GET_TABLE:
+        case UMAD_SA_METHOD_DELETE:
+            for (int i = 0; i < loopback_sa.num_records; i++)
+                num += loopback_match(&loopback_sa.records[i].record, rec, comp_mask);
+            if (req->mad_hdr.method == UMAD_METHOD_GET && num > 1)
+                status = LOOPBACK_SA_STATUS_TOO_MANY_RECORDS;
+            else if (req->mad_hdr.method != UMAD_SA_METHOD_GET_TABLE && num == 0)
+                status = LOOPBACK_SA_STATUS_NO_RECORDS;
+            break;
+        default:
+            status = LOOPBACK_MAD_STATUS_BAD_METHOD;
+            break;
+    }
+
+respond:
+    if (status)
+        num = 0;
+
+    resp = loopback_resp_alloc(req, num);
+    if (!resp)
+        goto out;
+
+    resp->mad.mad_hdr.status = __cpu_to_be16(status);
+    data = (uint8_t*)&resp->mad + offsetof(struct umad_sa_packet, data);
+
+    if (req->mad_hdr.method == UMAD_METHOD_SET) {
+        if (num)
+            memcpy(data, rec, sizeof(*rec));
+    } else if (num) {
+        int i = 0;
+
+        /* DELETE returns the removed records */
+        while (i < loopback_sa.num_records) {
+            struct loopback_record* entry = &loopback_sa.records[i];
+
+            if (!loopback_match(&entry->record, rec, comp_mask)) {
+                i++;
+                continue;
+            }
+
+            memcpy(data, &entry->record, sizeof(entry->record));
+            data += sizeof(entry->record);
+            if (req->mad_hdr.method == UMAD_SA_METHOD_DELETE)
+                *entry = loopback_sa.records[--loopback_sa.num_records];
+            else
+                i++;
+        }
+    }
+
+out:
+    pthread_mutex_unlock(&loopback_sa.lock);
+    return resp;
+}
+
+/* Serve an InformInfo SET, only GID in/out of service traps are supported */
+static struct loopback_resp* loopback_inform(struct sr_loopback_dev* lb, const struct umad_sa_packet* req)
+{
+    const struct sr_ib_inform_info* inform = (const struct sr_ib_inform_info*)req->data;
+    uint16_t trap = __be16_to_cpu(inform->trap_num);
+    struct loopback_resp* resp;
+    uint16_t status = 0;
+
+    if (req->mad_hdr.method != UMAD_METHOD_SET)
+        status = LOOPBACK_MAD_STATUS_BAD_METHOD_ATTR;
+    else if (!inform->is_generic || (trap != SR_TRAP_GID_IN_SERVICE && trap != SR_TRAP_GID_OUT_OF_SERVICE))
+        status = LOOPBACK_SA_STATUS_REQ_INVALID;
+
+    resp = loopback_resp_alloc(req, 0);
+    if (!resp)
+        return NULL;
+
+    resp->mad.mad_hdr.status = __cpu_to_be16(status);
+    if (status)
+        return resp;
+
+    memcpy(resp->mad.data, inform, sizeof(*inform));
+
+    pthread_mutex_lock(&loopback_sa.lock);
+    if (inform->subscribe)
+        lb->traps |= 1U << (trap - SR_TRAP_GID_IN_SERVICE);
+    else
+        lb->traps &= ~(1U << (trap - SR_TRAP_GID_IN_SERVICE));
+    pthread_mutex_unlock(&loopback_sa.lock);
+    return resp;
+}
+
+/* Queue a Report for every other subscribed port. Called with loopback_sa.lock held */
+static void loopback_notify(struct sr_loopback_dev* from, uint16_t trap, const union ibv_gid* gid)
+{
+    struct itimerspec its = {.it_value = {.tv_nsec = 1}}; /* in the past, fires immediately */
+    struct sr_loopback_dev* lb;
+    struct loopback_resp* resp;
+    struct sr_ib_notice* notice;
+
+    for (lb = loopback_sa.devs; lb; lb = lb->next) {
+        if (lb == from || !(lb->traps & (1U << (trap - SR_TRAP_GID_IN_SERVICE))))
+            continue;
+
+        resp = calloc(1, sizeof(*resp));
+        if (!resp)
+            continue;
+
+        resp->ready = get_time_stamp();
+        resp->length = sizeof(struct umad_sa_packet);
+        resp->mad.mad_hdr.base_version = 1;
+        resp->mad.mad_hdr.mgmt_class = UMAD_CLASS_SUBN_ADM;
+        resp->mad.mad_hdr.class_version = UMAD_SA_CLASS_VERSION;
+        resp->mad.mad_hdr.method = UMAD_METHOD_REPORT;
+        resp->mad.mad_hdr.tid = __cpu_to_be64(++loopback_sa.next_tid);
+        resp->mad.mad_hdr.attr_id = __cpu_to_be16(UMAD_ATTR_NOTICE);
+
+        notice = (struct sr_ib_notice*)resp->mad.data;
+        notice->generic_type = 0x80 | 4;   /* Generic, Informational */
+        notice->producer_type[2] = 4;      /* Class Manager */
+        notice->trap_num = __cpu_to_be16(trap);
+        notice->issuer_lid = __cpu_to_be16(LOOPBACK_SM_LID);
+        memcpy(notice->data_details.gid_service.gid, gid, sizeof(notice->data_details.gid_service.gid));
+
+        resp->next = lb->reports;
+        lb->reports = resp;
+        timerfd_settime(lb->fd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+}
+
+/* Move Reports queued by other ports into the response queue, in ready order */
+static void loopback_take_reports(struct sr_loopback_dev* lb)
+{
+    struct loopback_resp *resp, **p;
+
+    pthread_mutex_lock(&loopback_sa.lock);
+    while ((resp = lb->reports)) {
+        lb->reports = resp->next;
+        for (p = &lb->head; *p && (*p)->ready <= resp->ready; p = &(*p)->next)
+            ;
+        resp->next = *p;
+        *p = resp;
+        if (!resp->next)
+            lb->tail = &resp->next;
+    }
+    pthread_mutex_unlock(&loopback_sa.lock);
+}
+
+/* Sleep until get_time_stamp() reaches 't' */
+static void loopback_wait_until(uint64_t t)
+{
+    struct timespec ts = {.tv_sec = t / 1000000, .tv_nsec = (t % 1000000) * 1000};
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void loopback_arm(struct sr_loopback_dev* lb)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (lb->head) {
+        its.it_value.tv_sec = lb->head->ready / 1000000;
+        its.it_value.tv_nsec = (lb->head->ready % 1000000) * 1000;
+    }
+
+    timerfd_settime(lb->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int loopback_dev_open(struct sr_dev* dev, const char* dev_name, int port)
+{
+    uint64_t guid;
+
+    /* Every loopback context is a port of its own, whatever it asked for */
+    (void)dev_name;
+    (void)port;
+
+    dev->loopback = calloc(1, sizeof(*dev->loopback));
+    if (!dev->loopback) {
+        sr_log_err("Failed to allocate loopback device");
+        return -ENOMEM;
+    }
+    dev->loopback->tail = &dev->loopback->head;
+
+    /* get_time_stamp() is CLOCK_MONOTONIC */
+    dev->loopback->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (dev->loopback->fd < 0) {
+        sr_log_err("timerfd_create failed: %m");
+        free(dev->loopback);
+        dev->loopback = NULL;
+        return -errno;
+    }
+
+    pthread_mutex_lock(&loopback_sa.lock);
+    loopback_sa.refs++;
+    guid = LOOPBACK_GUID_BASE | ++loopback_sa.next_guid;
+
+    snprintf(dev->dev_name, sizeof(dev->dev_name), "loopback");
+    dev->port_num = 1;
+    dev->port_gid.global.subnet_prefix = __cpu_to_be64(LOOPBACK_SUBNET_PREFIX);
+    dev->port_gid.global.interface_id = __cpu_to_be64(guid);
+    dev->port_lid = guid & 0xbfff;
+    dev->port_smlid = LOOPBACK_SM_LID;
+    dev->report_qpn = 1;
+
+    loopback_notify(dev->loopback, SR_TRAP_GID_IN_SERVICE, &dev->port_gid);
+    dev->loopback->next = loopback_sa.devs;
+    loopback_sa.devs = dev->loopback;
+    pthread_mutex_unlock(&loopback_sa.lock);
+
+    sr_log_info("Using loopback SA, port guid=0x%" PRIx64 " latency=%uus", guid, dev->loopback_latency_us);
+    return 0;
+}
+
+static int loopback_dev_update(struct sr_dev* dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static void loopback_dev_close(struct sr_dev* dev)
+{
+    struct sr_loopback_dev** p;
+    struct loopback_resp* resp;
+
+    if (!dev->loopback)
+        return;
+
+    pthread_mutex_lock(&loopback_sa.lock);
+    for (p = &loopback_sa.devs; *p != dev->loopback; p = &(*p)->next)
+        ;
+    *p = dev->loopback->next;
+    loopback_notify(dev->loopback, SR_TRAP_GID_OUT_OF_SERVICE, &dev->port_gid);
+    pthread_mutex_unlock(&loopback_sa.lock);
+
+    loopback_take_reports(dev->loopback);
+    while ((resp = dev->loopback->head)) {
+        dev->loopback->head = resp->next;
+        free(resp);
+    }
+    free(dev->loopback->last);
+    close(dev->loopback->fd);
+    free(dev->loopback);
+    dev->loopback = NULL;
+
+    /* The simulated SA forgets everything once the last port is closed */
+    pthread_mutex_lock(&loopback_sa.lock);
+    if (--loopback_sa.refs == 0) {
+        free(loopback_sa.records);
+        loopback_sa.records = NULL;
+        loopback_sa.num_records = 0;
+        loopback_sa.max_records = 0;
+    }
+    pthread_mutex_unlock(&loopback_sa.lock);
+}
+
+static int loopback_dev_send(struct sr_dev* dev, const struct umad_sa_packet* mad)
+{
+    struct loopback_resp* resp;
+
+    if (mad->mad_hdr.method == UMAD_METHOD_REPORT_RESP)
+        return 0;
+
+    if (__be16_to_cpu(mad->mad_hdr.attr_id) == UMAD_ATTR_INFORM_INFO)
+        resp = loopback_inform(dev->loopback, mad);
+    else
+        resp = loopback_process(mad);
+
+    if (!resp)
+        return -ENOMEM;
+
+    resp->ready = get_time_stamp() + dev->loopback_latency_us;
+    *dev->loopback->tail = resp;
+    dev->loopback->tail = &resp->next;
+    if (dev->loopback->head == resp)
+        loopback_arm(dev->loopback);
+    return 0;
+}
+
+static int loopback_dev_recv(struct sr_dev* dev, struct umad_sa_packet** mad, int* length, int timeout_ms)
+{
+    struct sr_loopback_dev* lb = dev->loopback;
+    struct loopback_resp* resp;
+    uint64_t deadline = get_time_stamp() + timeout_ms * 1000ULL;
+    uint64_t expirations;
+
+    free(lb->last);
+    lb->last = NULL;
+
+    loopback_take_reports(lb);
+    resp = lb->head;
+
+    if (read(lb->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        sr_log_debug("timerfd read failed: %m");
+
+    if (!resp || resp->ready > deadline) {
+        /* The head may have become ready after 'deadline', keep the fd readable for it */
+        loopback_arm(lb);
+        loopback_wait_until(deadline);
+        return -ETIMEDOUT;
+    }
+
+    loopback_wait_until(resp->ready);
+
+    lb->head = resp->next;
+    if (!lb->head)
+        lb->tail = &lb->head;
+    lb->last = resp;
+    loopback_arm(lb);
+
+    *mad = &resp->mad;
+    *length = resp->length;
+    return 0;
+}
+
+static int loopback_dev_get_fd(struct sr_dev* dev)
+{
+    return dev->loopback->fd;
+}
+
+const struct sr_transport_ops sr_loopback_transport = {
+    .name = "loopback",
+    .caps = SR_TRANSPORT_CAP_TABLE,
+    .open = loopback_dev_open,
+    .update = loopback_dev_update,
+    .close = loopback_dev_close,
+    .send = loopback_dev_send,
+    .recv = loopback_dev_recv,
+    .get_fd = loopback_dev_get_fd,
+};
@@ -0,0 +1,150 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * SA event subscriptions. An InformInfo SET registers this port for a trap;
+ * the SA then sends a Report for every matching event. Reports are matched in
+ * dev_sa_progress() and handed to notice_report() below.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <infiniband/umad_sa.h>
+#include <infiniband/umad_types.h>
+
+#include "service_record.h"
+#include "services.h"
+
+#define SR_INFORM_RETRIES       2
+#define SR_INFORM_RESP_TIME     19         /* 4.096 us * 2^19, ~2 s */
+#define SR_INFORM_TYPE_ALL      0xffff
+#define SR_INFORM_PRODUCER_ALL  0xffffff
+#define SR_INFORM_LID_ALL       0xffff
+
+static const uint16_t notice_traps[] = {SR_TRAP_GID_IN_SERVICE, SR_TRAP_GID_OUT_OF_SERVICE};
+
+#define SR_NUM_TRAPS (sizeof(notice_traps) / sizeof(notice_traps[0]))
+
+static void notice_report(struct sr_dev* dev, const void* data, void* arg)
+{
+    const struct sr_ib_notice* ib_notice = data;
+    struct sr_ctx* context = arg;
+    struct sr_notice notice;
+
+    (void)dev;
+
+    if (!(ib_notice->generic_type & 0x80)) {
+        sr_log_info("Ignoring vendor specific notice");
+        return;
+    }
+
+    memset(&notice, 0, sizeof(notice));
+    notice.trap_num = __be16_to_cpu(ib_notice->trap_num);
+    notice.issuer_lid = __be16_to_cpu(ib_notice->issuer_lid);
+    if (notice.trap_num == SR_TRAP_GID_IN_SERVICE || notice.trap_num == SR_TRAP_GID_OUT_OF_SERVICE)
+        memcpy(notice.gid, ib_notice->data_details.gid_service.gid, sizeof(notice.gid));
+
+    sr_log_info("Received trap %u from lid %u", notice.trap_num, notice.issuer_lid);
+
+    /* Records of a port that came or went may be anywhere in the cache */
+    query_cache_expire(context);
+    snapshot_expire(context);
+    service_cache_unconfirm(context->dev);
+    lease_kick(context);
+
+    if (context->notice_cb)
+        context->notice_cb(context, &notice, context->notice_arg);
+}
+
+/* Send (un)subscribe requests for all traps in one go. Returns the number that succeeded */
+static int notice_set(struct sr_ctx* context, int subscribe, struct sr_sa_txn* txns, uint64_t deadline)
+{
+    struct sr_dev* dev = context->dev;
+    struct sr_ib_inform_info inform;
+    int i, ret, done = 0;
+
+    for (i = 0; i < (int)SR_NUM_TRAPS; ++i) {
+        memset(&inform, 0, sizeof(inform));
+        inform.lid_range_begin = __cpu_to_be16(SR_INFORM_LID_ALL);
+        inform.is_generic = 1;
+        inform.subscribe = subscribe;
+        inform.type = __cpu_to_be16(SR_INFORM_TYPE_ALL);
+        inform.trap_num = __cpu_to_be16(notice_traps[i]);
+        inform.qpn_resp_time = __cpu_to_be32(dev->report_qpn << 8 | SR_INFORM_RESP_TIME);
+        inform.producer_type = __cpu_to_be32(SR_INFORM_PRODUCER_ALL);
+
+        dev_sa_txn_init(&txns[i], UMAD_METHOD_SET, UMAD_ATTR_INFORM_INFO, 0, &inform, sizeof(inform));
+        txns[i].retries = SR_INFORM_RETRIES;
+        txns[i].hide_errors = context->flags & SR_HIDE_ERRORS;
+        txns[i].deadline = deadline;
+        if ((ret = dev_sa_submit(dev, &txns[i])) < 0)
+            txns[i].status = ret;
+    }
+
+    if ((ret = dev_sa_wait_all(dev, txns, SR_NUM_TRAPS)) < 0)
+        return ret;
+
+    for (i = 0; i < (int)SR_NUM_TRAPS; ++i) {
+        if (txns[i].status > 0)
+            done++;
+        else
+            sr_log_warn("Couldn't %s trap %u: %d", subscribe ? "subscribe to" : "unsubscribe from", notice_traps[i], txns[i].status);
+    }
+
+    return done;
+}
+
+int sr_subscribe(struct sr_ctx* context, sr_notice_cb cb, void* arg)
+{
+    struct sr_sa_txn txns[SR_NUM_TRAPS];
+    struct sr_dev* dev = context->dev;
+    uint64_t deadline = call_deadline(context);
+    int ret;
+
+    context->notice_cb = cb;
+    context->notice_arg = arg;
+
+    /* Reports may arrive before the last response */
+    dev->report = notice_report;
+    dev->report_arg = context;
+
+    ret = notice_set(context, 1, txns, deadline);
+    if (ret == (int)SR_NUM_TRAPS) {
+        sr_log_info("Subscribed to GID in/out of service traps");
+        return 0;
+    }
+
+    sr_unsubscribe(context);
+    return ret < 0 ? ret : -EPROTO;
+}
+
+int sr_unsubscribe(struct sr_ctx* context)
+{
+    struct sr_sa_txn txns[SR_NUM_TRAPS];
+    struct sr_dev* dev = context->dev;
+    int ret;
+
+    if (dev->report_arg != context)
+        return 0;
+
+    ret = notice_set(context, 0, txns, call_deadline(context));
+
+    dev->report = NULL;
+    dev->report_arg = NULL;
+    context->notice_cb = NULL;
+    context->notice_arg = NULL;
+
+    return ret < 0 ? ret : 0;
+}
+
+void notice_cleanup(struct sr_ctx* context)
+{
+    if (context->dev->report_arg == context)
+        sr_unsubscribe(context);
+}
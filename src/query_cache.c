@@ -0,0 +1,329 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * Per-context cache of sr_query_service() results, keyed by service ID and
+ * name. An entry is fresh for the configured TTL, shortened to the smallest
+ * record lease. After that it is served for the stale window while a GET_TABLE
+ * refreshes it in the background; the refresh is driven by the I/O thread, or
+ * else by any later call that progresses the device, lookups of the entry
+ * included, and its result is taken in by the next lookup. Empty
+ * results are kept for the negative TTL and are never served stale. Every
+ * access takes the cache lock but query_cache_expire(), which only bumps the
+ * epoch: the I/O thread never takes the lock, so holding it while waiting on
+ * the I/O thread is safe. A result is only stored if the cache did not expire
+ * since its query was sent: it may predate the change that expired it.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <infiniband/umad_sa.h>
+
+#include "service_record.h"
+#include "services.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define SR_QUERY_CACHE_MAX     64         /* Entries per context, the least recently used is evicted */
+#define SR_LEASE_INFINITE      0xffffffff
+
+struct sr_query_cache_entry
+{
+    struct sr_query_cache_entry* next;
+    struct sr_ctx* context;
+    uint64_t id;
+    char name[SR_DEV_SERVICE_NAME_MAX];
+    uint64_t fresh_until;             /* usec */
+    uint64_t stale_until;             /* usec */
+    uint64_t last_used;               /* usec */
+    unsigned epoch;                   /* Entries of an older epoch are expired */
+    int refreshing;                   /* refresh was submitted and not yet taken in */
+    unsigned refresh_epoch;           /* Cache epoch when the refresh was submitted */
+    int num_srs;
+    struct sr_dev_service* srs;
+    struct sr_sa_txn refresh;         /* Background GET_TABLE, -EINPROGRESS while in flight */
+};
+
+struct sr_query_cache
+{
+    struct sr_query_cache_entry* entries;
+    int num_entries;
+    pthread_mutex_t lock;
+    unsigned epoch;                   /* Bumped by query_cache_expire() */
+    uint64_t ttl;                     /* usec */
+    uint64_t negative_ttl;            /* usec */
+    uint64_t stale;                   /* usec */
+};
+
+int query_cache_init(struct sr_ctx* context, const struct sr_config* conf)
+{
+    struct sr_query_cache* cache;
+
+    if (!conf || !conf->query_cache_ttl_ms)
+        return 0;
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        sr_log_err("Failed to allocate query cache");
+        return -ENOMEM;
+    }
+
+    cache->ttl = conf->query_cache_ttl_ms * 1000ULL;
+    cache->negative_ttl = conf->query_cache_negative_ttl_ms * 1000ULL;
+    cache->stale = conf->query_cache_stale_ms * 1000ULL;
+    pthread_mutex_init(&cache->lock, NULL);
+    context->query_cache = cache;
+    return 0;
+}
+
+static void query_cache_entry_free(struct sr_query_cache_entry* entry)
+{
+    if (entry->refreshing)
+        dev_sa_cancel(entry->context->dev, &entry->refresh);
+    free(entry->refresh.resp_data);
+    free(entry->srs);
+    free(entry);
+}
+
+static void query_cache_unlink(struct sr_query_cache* cache, struct sr_query_cache_entry* entry)
+{
+    struct sr_query_cache_entry** p;
+
+    for (p = &cache->entries; *p; p = &(*p)->next) {
+        if (*p == entry) {
+            *p = entry->next;
+            cache->num_entries--;
+            return;
+        }
+    }
+}
+
+static struct sr_query_cache_entry* query_cache_find(struct sr_query_cache* cache, uint64_t id, const char* name)
+{
+    struct sr_query_cache_entry* entry;
+
+    for (entry = cache->entries; entry; entry = entry->next)
+        if (entry->id == id && !strcmp(entry->name, name))
+            return entry;
+
+    return NULL;
+}
+
+/* Smallest lease among the returned records, in usec, or UINT64_MAX if all are infinite */
+static uint64_t query_cache_min_lease(struct sr_sa_txn* txn, int num_records)
+{
+    uint32_t lease = decode_min_lease(txn->resp_data, txn->record_size, num_records);
+
+    return lease == SR_LEASE_INFINITE ? UINT64_MAX : lease * 1000000ULL;
+}
+
+static void query_cache_store_locked(struct sr_ctx* context, uint64_t id, const char* name, struct sr_sa_txn* txn,
+                                     unsigned epoch)
+{
+    struct sr_query_cache* cache = context->query_cache;
+    struct sr_query_cache_entry *entry, *lru;
+    struct sr_dev_service* srs = NULL;
+    uint64_t now, ttl;
+    int num = txn->status;
+
+    if (num < 0 || (!num && !cache->negative_ttl))
+        return;
+
+    if (epoch != __atomic_load_n(&cache->epoch, __ATOMIC_RELAXED)) {
+        sr_log_debug("Not caching records of 0x%016" PRIx64 " `%s' queried before the cache expired", id, name);
+        return;
+    }
+
+    if (num > 0) {
+        srs = calloc(num, sizeof(*srs));
+        if (!srs)
+            return;
+        num = dev_decode_services(context, name, txn, num, srs, num, 0);
+    }
+
+    entry = query_cache_find(cache, id, name);
+    if (!entry) {
+        if (cache->num_entries >= SR_QUERY_CACHE_MAX) {
+            for (lru = entry = cache->entries; entry; entry = entry->next)
+                if (entry->last_used < lru->last_used)
+                    lru = entry;
+            query_cache_unlink(cache, lru);
+            query_cache_entry_free(lru);
+        }
+
+        entry = calloc(1, sizeof(*entry));
+        if (!entry) {
+            free(srs);
+            return;
+        }
+        entry->context = context;
+        entry->id = id;
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+        entry->next = cache->entries;
+        cache->entries = entry;
+        cache->num_entries++;
+    }
+
+    now = get_time_stamp();
+    ttl = num ? MIN(cache->ttl, query_cache_min_lease(txn, txn->status)) : cache->negative_ttl;
+
+    free(entry->srs);
+    entry->srs = srs;
+    entry->num_srs = num;
+    entry->fresh_until = now + ttl;
+    entry->stale_until = entry->fresh_until + (num ? cache->stale : 0);
+    entry->last_used = now;
+    entry->epoch = epoch;
+    sr_log_debug("Cached %d records of 0x%016" PRIx64 " `%s' for %" PRIu64 " usec", num, id, name, ttl);
+}
+
+/* Current epoch, to pass to query_cache_store() with the result of a query sent now */
+unsigned query_cache_epoch(struct sr_ctx* context)
+{
+    struct sr_query_cache* cache = context->query_cache;
+
+    return cache ? __atomic_load_n(&cache->epoch, __ATOMIC_RELAXED) : 0;
+}
+
+void query_cache_store(struct sr_ctx* context, uint64_t id, const char* name, struct sr_sa_txn* txn, unsigned epoch)
+{
+    struct sr_query_cache* cache = context->query_cache;
+
+    if (!cache)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    query_cache_store_locked(context, id, name, txn, epoch);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Take in a finished background refresh */
+static void query_cache_refresh_done(struct sr_query_cache_entry* entry)
+{
+    struct sr_sa_txn* txn = &entry->refresh;
+    int status = __atomic_load_n(&txn->status, __ATOMIC_ACQUIRE);
+
+    if (status == -EINPROGRESS)
+        return;
+
+    entry->refreshing = 0;
+    if (status >= 0)
+        query_cache_store_locked(entry->context, entry->id, entry->name, txn, entry->refresh_epoch);
+    else
+        sr_log_info("Background refresh of 0x%016" PRIx64 " failed: %s", entry->id, strerror(-status));
+
+    free(txn->resp_data);
+    txn->resp_data = NULL;
+}
+
+/* Copy up to 'max' cached records. Returns the number copied, or -ENOENT if not cached */
+int query_cache_lookup(struct sr_ctx* context, uint64_t id, const char* name, struct sr_dev_service* srs, int max)
+{
+    struct sr_query_cache* cache = context->query_cache;
+    struct sr_query_cache_entry* entry;
+    uint64_t now;
+    int num;
+
+    if (!cache)
+        return -ENOENT;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = query_cache_find(cache, id, name);
+    /* Without an I/O thread nothing may receive the refresh response meanwhile */
+    if (entry && entry->refreshing && !context->dev->io &&
+        __atomic_load_n(&entry->refresh.status, __ATOMIC_ACQUIRE) == -EINPROGRESS) {
+        /* Unlocked, completion callbacks may query again */
+        pthread_mutex_unlock(&cache->lock);
+        dev_sa_progress(context->dev, 0);
+        pthread_mutex_lock(&cache->lock);
+        entry = query_cache_find(cache, id, name);
+    }
+    if (entry && entry->refreshing)
+        query_cache_refresh_done(entry);
+
+    now = get_time_stamp();
+    if (!entry || entry->epoch != __atomic_load_n(&cache->epoch, __ATOMIC_RELAXED) || now >= entry->stale_until) {
+        pthread_mutex_unlock(&cache->lock);
+        return -ENOENT;
+    }
+
+    if (now >= entry->fresh_until && !entry->refreshing) {
+        dev_get_service_txn_init(context, &entry->refresh, id, entry->name, 1);
+        entry->refresh_epoch = entry->epoch;
+        entry->refreshing = dev_sa_submit(context->dev, &entry->refresh) >= 0;
+    }
+
+    entry->last_used = now;
+    num = MIN(max, entry->num_srs);
+    if (num > 0)
+        memcpy(srs, entry->srs, num * sizeof(*srs));
+    pthread_mutex_unlock(&cache->lock);
+    return num;
+}
+
+void query_cache_invalidate(struct sr_ctx* context, uint64_t id)
+{
+    struct sr_query_cache* cache = context->query_cache;
+    struct sr_query_cache_entry **p, *entry;
+
+    if (!cache)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    for (p = &cache->entries; (entry = *p);) {
+        if (entry->id == id) {
+            *p = entry->next;
+            cache->num_entries--;
+            query_cache_entry_free(entry);
+        } else {
+            p = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Expire all entries without taking the lock, safe from the I/O thread */
+void query_cache_expire(struct sr_ctx* context)
+{
+    struct sr_query_cache* cache = context->query_cache;
+
+    if (cache)
+        __atomic_fetch_add(&cache->epoch, 1, __ATOMIC_RELAXED);
+}
+
+void sr_flush_query_cache(struct sr_ctx* context)
+{
+    struct sr_query_cache* cache = context->query_cache;
+    struct sr_query_cache_entry* entry;
+
+    if (!cache)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    while ((entry = cache->entries)) {
+        cache->entries = entry->next;
+        query_cache_entry_free(entry);
+    }
+    cache->num_entries = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void query_cache_cleanup(struct sr_ctx* context)
+{
+    sr_flush_query_cache(context);
+    if (context->query_cache)
+        pthread_mutex_destroy(&context->query_cache->lock);
+    free(context->query_cache);
+    context->query_cache = NULL;
+}
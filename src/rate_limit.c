@@ -0,0 +1,131 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * Process-wide limit on the MADs sent to the SA, so that one application
+ * cannot flood the subnet manager whatever its contexts do. Queries and
+ * updates each have a token bucket, kept as the time the next MAD is due
+ * (GCRA): a MAD may go once that time is at most a burst ahead of now, and
+ * moves it one interval later. The buckets are updated with compare-and-swap,
+ * so devices and I/O threads share them without a lock.
+ *
+ * Each context may ask for limits of its own. The strictest rate and burst
+ * asked for by any of them apply until the last of those contexts is cleaned
+ * up, which lifts them.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <infiniband/umad_sa.h>
+#include <infiniband/umad_types.h>
+
+#include "service_record.h"
+#include "services.h"
+
+enum
+{
+    SR_RATE_LIMIT_QUERIES = 0,
+    SR_RATE_LIMIT_UPDATES,
+    SR_RATE_LIMIT_CLASSES
+};
+
+struct sr_rate_limit_bucket
+{
+    uint64_t interval;  /* usec between MADs, 0 for unlimited */
+    uint64_t tolerance; /* usec the due time may run ahead of now */
+    uint64_t due;       /* usec, when the next MAD may go at the steady rate */
+};
+
+static struct sr_rate_limit_bucket rate_limit[SR_RATE_LIMIT_CLASSES];
+
+static pthread_mutex_t rate_limit_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned rate_limit_users;                      /* Contexts that asked for limits */
+static unsigned rate_limit_rates[SR_RATE_LIMIT_CLASSES]; /* Lowest asked for, 0 for none */
+static unsigned rate_limit_burst;                      /* Lowest asked for */
+
+static void rate_limit_set(struct sr_rate_limit_bucket* bucket, unsigned rate, unsigned burst)
+{
+    uint64_t interval = 1000000 / rate ? 1000000 / rate : 1;
+
+    __atomic_store_n(&bucket->interval, interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->tolerance, interval * (burst - 1), __ATOMIC_RELAXED);
+}
+
+static unsigned rate_limit_min(unsigned current, unsigned asked)
+{
+    return !current || (asked && asked < current) ? asked : current;
+}
+
+/* Apply the limits of a new context. Returns 1 if it asked for any, to be released by rate_limit_release() */
+int rate_limit_configure(const struct sr_config* conf)
+{
+    unsigned rates[SR_RATE_LIMIT_CLASSES];
+    int i;
+
+    if (!conf || (!conf->rate_limit_queries && !conf->rate_limit_updates))
+        return 0;
+
+    rates[SR_RATE_LIMIT_QUERIES] = conf->rate_limit_queries;
+    rates[SR_RATE_LIMIT_UPDATES] = conf->rate_limit_updates;
+
+    pthread_mutex_lock(&rate_limit_lock);
+    rate_limit_users++;
+    rate_limit_burst =
+        rate_limit_min(rate_limit_burst, conf->rate_limit_burst ? conf->rate_limit_burst : SR_DEFAULT_RATE_LIMIT_BURST);
+    for (i = 0; i < SR_RATE_LIMIT_CLASSES; ++i) {
+        rate_limit_rates[i] = rate_limit_min(rate_limit_rates[i], rates[i]);
+        if (rate_limit_rates[i])
+            rate_limit_set(&rate_limit[i], rate_limit_rates[i], rate_limit_burst);
+    }
+
+    sr_log_info("SA rate limit: %u queries, %u updates per second, bursts of %u",
+                rate_limit_rates[SR_RATE_LIMIT_QUERIES], rate_limit_rates[SR_RATE_LIMIT_UPDATES], rate_limit_burst);
+    pthread_mutex_unlock(&rate_limit_lock);
+    return 1;
+}
+
+/* A context that asked for limits is gone, the last one lifts them */
+void rate_limit_release(void)
+{
+    int i;
+
+    pthread_mutex_lock(&rate_limit_lock);
+    if (rate_limit_users && !--rate_limit_users) {
+        for (i = 0; i < SR_RATE_LIMIT_CLASSES; ++i) {
+            __atomic_store_n(&rate_limit[i].interval, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&rate_limit[i].tolerance, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&rate_limit[i].due, 0, __ATOMIC_RELAXED);
+            rate_limit_rates[i] = 0;
+        }
+        rate_limit_burst = 0;
+        sr_log_info("SA rate limit lifted");
+    }
+    pthread_mutex_unlock(&rate_limit_lock);
+}
+
+/* Take a token to send a MAD of 'method'. Returns 0, or the usec until one is available */
+uint64_t rate_limit_take(int method, uint64_t now)
+{
+    struct sr_rate_limit_bucket* bucket;
+    uint64_t interval, tolerance, due, next;
+
+    bucket = &rate_limit[method == UMAD_METHOD_GET || method == UMAD_SA_METHOD_GET_TABLE ? SR_RATE_LIMIT_QUERIES
+                                                                                        : SR_RATE_LIMIT_UPDATES];
+    if (!(interval = __atomic_load_n(&bucket->interval, __ATOMIC_RELAXED)))
+        return 0;
+    tolerance = __atomic_load_n(&bucket->tolerance, __ATOMIC_RELAXED);
+
+    due = __atomic_load_n(&bucket->due, __ATOMIC_RELAXED);
+    do {
+        next = due > now ? due : now;
+        if (next - now > tolerance)
+            return next - now - tolerance;
+    } while (!__atomic_compare_exchange_n(&bucket->due, &due, next + interval, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 0;
+}
@@ -0,0 +1,797 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * SA transaction engine. Requests are sent through the device transport and
+ * kept on a pending list until a response with the same TID arrives, the
+ * response times out, or the retry budget is exhausted. Any number of
+ * transactions may be outstanding on one device. A query identical to a
+ * pending one is not sent, it follows the pending one and completes with a
+ * copy of its result.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <infiniband/umad_sa.h>
+#include <infiniband/umad_types.h>
+
+#include "service_record.h"
+#include "services.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#ifndef offsetof
+#define offsetof(type, member) ((size_t)&((type*)0)->member)
+#endif
+
+#define SR_SA_TXN_HASH(tid)  ((tid) & (SR_SA_TXN_BUCKETS - 1))
+#define SR_SA_RECV_BATCH     64 /* MADs handled by one sr_progress() call after the first completion */
+
+static int dev_sa_response_method(int method)
+{
+    switch (method) {
+        case UMAD_METHOD_GET:
+        case UMAD_SA_METHOD_GET_TABLE:
+        case UMAD_METHOD_REPORT:
+        case UMAD_METHOD_TRAP:
+        case UMAD_SA_METHOD_GET_TRACE_TABLE:
+        case UMAD_SA_METHOD_GET_MULTI:
+        case UMAD_SA_METHOD_DELETE:
+            return method;
+        case UMAD_METHOD_SET:
+            return UMAD_METHOD_GET;
+        default:
+            return -EINVAL;
+    }
+}
+
+/* Log a non-zero MAD status and return it as a negative errno */
+static inline int report_sa_err(struct sr_dev* dev, uint16_t mad_status, int hide_errors)
+{
+    static const char* mad_invalid_field_errors[] = {[1] = "Bad version or class",
+                                                     [2] = "Method not supported",
+                                                     [3] = "Method/attribute combination not supported",
+                                                     [4] = "Reserved",
+                                                     [5] = "Reserved",
+                                                     [6] = "Reserved",
+                                                     [7] = "Invalid value in one or more fields of attribute or attribute modifier"};
+
+    static const char* sa_errors[] = {
+        [1] = "ERR_NO_RESOURCES",
+        [2] = "ERR_REQ_INVALID",
+        [3] = "ERR_NO_RECORDS",
+        [4] = "ERR_TOO_MANY_RECORDS",
+        [5] = "ERR_REQ_INVALID_GID",
+        [6] = "ERR_REQ_INSUFFICIENT_COMPONENTS",
+        [7] = "ERR_REQ_DENIED",
+    };
+
+    int log_level = (hide_errors) ? 3 : 1;
+
+    sr_log(log_level, "OpenSM request failed with status: 0x%04hx", mad_status);
+
+    uint8_t status = (mad_status >> 2) & 0x7;
+    if (status) {
+        sr_log(log_level, "MAD status: %s", mad_invalid_field_errors[status]);
+        SR_STAT_INC(dev->stats.mad_status[status]);
+    }
+    uint8_t sa_status = mad_status >> 8;
+    if (sa_status > 0 && sa_status <= 7) {
+        sr_log(log_level, "SA status field: %s", sa_errors[sa_status]);
+        SR_STAT_INC(dev->stats.sa_status[sa_status]);
+    }
+
+    /* Busy is worth another attempt, anything else is the answer */
+    if (mad_status & 0x1)
+        return -EAGAIN;
+    switch (sa_status) {
+        case 1:
+            return -ENOSPC;
+        case 2:
+        case 5:
+        case 6:
+            return -EINVAL;
+        case 3:
+            return -ENOENT;
+        case 4:
+            return -E2BIG;
+        case 7:
+            return -EACCES;
+    }
+    return -EPROTO;
+}
+
+static struct sr_sa_txn* dev_sa_find(struct sr_dev* dev, uint32_t tid)
+{
+    struct sr_sa_txn* txn;
+
+    for (txn = dev->txn_table[SR_SA_TXN_HASH(tid)]; txn; txn = txn->hnext)
+        if (txn->tid == tid)
+            return txn;
+
+    return NULL;
+}
+
+static void dev_sa_hash_del(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    struct sr_sa_txn** p;
+
+    if (!txn->sent)
+        return;
+
+    for (p = &dev->txn_table[SR_SA_TXN_HASH(txn->tid)]; *p; p = &(*p)->hnext) {
+        if (*p == txn) {
+            *p = txn->hnext;
+            break;
+        }
+    }
+    txn->sent = 0;
+}
+
+static int dev_sa_is_query(const struct sr_sa_txn* txn)
+{
+    return txn->method == UMAD_METHOD_GET || txn->method == UMAD_SA_METHOD_GET_TABLE;
+}
+
+static void dev_sa_unlink(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    struct sr_sa_txn** p;
+
+    if (dev_sa_is_query(txn)) {
+        for (p = &dev->query_table[SR_SA_TXN_HASH(txn->key)]; *p; p = &(*p)->qnext) {
+            if (*p == txn) {
+                *p = txn->qnext;
+                break;
+            }
+        }
+    }
+
+    for (p = &dev->txns; *p; p = &(*p)->next) {
+        if (*p == txn) {
+            *p = txn->next;
+            txn->next = NULL;
+            return;
+        }
+    }
+}
+
+static int dev_sa_send(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    struct umad_sa_packet req;
+    uint64_t now, delay;
+    __be64 sa_mkey;
+    int ret;
+
+    /* Over the process rate limit, keep the request pending until a token is due */
+    now = get_time_stamp();
+    if ((delay = rate_limit_take(txn->method, now))) {
+        SR_STAT_INC(dev->stats.throttled);
+        if (dev->rate_limit_reject) {
+            sr_log_debug("Rate limited, rejecting attr 0x%x method 0x%x", txn->attr, txn->method);
+            return -EBUSY;
+        }
+        if (txn->deadline && now + delay >= txn->deadline)
+            return -ETIMEDOUT;
+        txn->sent = 0;
+        txn->timeout = now + delay;
+        return 0;
+    }
+
+    /* TIDs are matched on 32 bits, keep them unique among outstanding requests */
+    do {
+        txn->tid = rand_r(&dev->seed);
+    } while (dev_sa_find(dev, txn->tid));
+
+    memset(&req, 0, sizeof(req));
+    req.mad_hdr.base_version = 1;
+    req.mad_hdr.mgmt_class = UMAD_CLASS_SUBN_ADM;
+    req.mad_hdr.class_version = UMAD_SA_CLASS_VERSION;
+    req.mad_hdr.method = txn->method;
+    req.mad_hdr.tid = __cpu_to_be64((uint64_t)txn->tid);
+    req.mad_hdr.attr_id = __cpu_to_be16(txn->attr);
+    sa_mkey = __cpu_to_be64(dev->sa_mkey);
+    memcpy(req.sm_key, &sa_mkey, sizeof(req.sm_key));
+    req.comp_mask = __cpu_to_be64(txn->comp_mask);
+    memcpy(req.data, txn->req_data, txn->req_size);
+
+    if ((ret = dev->transport->send(dev, &req)) < 0) {
+        sr_log_err("%s send failed: %s. attr 0x%x method 0x%x", dev->transport->name, strerror(-ret), txn->attr, txn->method);
+        return ret;
+    }
+
+    SR_STAT_INC(stats_method(dev, txn->method)->sends);
+    if (txn->attempts++)
+        SR_STAT_INC(stats_method(dev, txn->method)->retries);
+
+    txn->sent = 1;
+    txn->hnext = dev->txn_table[SR_SA_TXN_HASH(txn->tid)];
+    dev->txn_table[SR_SA_TXN_HASH(txn->tid)] = txn;
+    txn->timeout = now + dev->fabric_timeout_ms * 1000ULL;
+    if (txn->deadline)
+        txn->timeout = MIN(txn->timeout, txn->deadline);
+    return 0;
+}
+
+/*
+ * Decorrelated jitter: each delay is random between query_sleep and three
+ * times the previous one, capped, so clients that failed together spread out.
+ */
+static uint64_t dev_sa_backoff(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    uint64_t base = dev->query_sleep;
+    uint64_t upper = MIN(MAX(base, (uint64_t)dev->query_sleep_max), (txn->sleep ? txn->sleep : base) * 3);
+
+    txn->sleep = base + (upper > base ? rand_r(&dev->seed) % (upper - base + 1) : 0);
+    return txn->sleep;
+}
+
+/* While the SA is known to be unreachable fail fast, letting one probe through per cooldown */
+static int dev_sa_breaker_admit(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    if (!dev->breaker_threshold || dev->breaker_failures < dev->breaker_threshold)
+        return 0;
+
+    if (dev->breaker_probe || get_time_stamp() < dev->breaker_open_until) {
+        SR_STAT_INC(dev->stats.breaker_rejects);
+        return -EHOSTUNREACH;
+    }
+
+    sr_log_info("Probing SA after %u timed out requests", dev->breaker_failures);
+    dev->breaker_probe = txn;
+    return 0;
+}
+
+static void dev_sa_breaker_done(struct sr_dev* dev, struct sr_sa_txn* txn, int ret)
+{
+    if (dev->breaker_probe == txn)
+        dev->breaker_probe = NULL;
+
+    if (!dev->breaker_threshold)
+        return;
+
+    if (ret == -ETIMEDOUT) {
+        if (++dev->breaker_failures == dev->breaker_threshold)
+            sr_log_warn("SA unreachable, failing requests for %u ms", dev->breaker_cooldown_ms);
+        if (dev->breaker_failures >= dev->breaker_threshold)
+            dev->breaker_open_until = get_time_stamp() + dev->breaker_cooldown_ms * 1000ULL;
+    } else if (ret >= 0) {
+        if (dev->breaker_failures >= dev->breaker_threshold)
+            sr_log_info("SA reachable again");
+        dev->breaker_failures = 0;
+    }
+}
+
+static void dev_sa_complete(struct sr_dev* dev, struct sr_sa_txn* txn, int ret)
+{
+    void (*complete)(struct sr_sa_txn* txn) = txn->complete;
+
+    stats_txn_done(dev, txn, ret);
+
+    /* A waiter on another thread may free the transaction once it sees the status */
+    __atomic_store_n(&txn->status, ret, __ATOMIC_RELEASE);
+    if (complete)
+        complete(txn);
+}
+
+/*
+ * Complete the queries that followed 'leader' with its result. Callers may
+ * compact, keep or hand out the payload, so each gets a copy of its own.
+ */
+static void dev_sa_complete_followers(struct sr_dev* dev, struct sr_sa_txn* leader, int ret)
+{
+    struct sr_sa_txn* txn;
+    int status;
+
+    /* Completions may cancel other followers, take them one at a time */
+    while ((txn = leader->followers)) {
+        leader->followers = txn->next;
+        txn->next = NULL;
+        txn->leader = NULL;
+
+        status = ret;
+        if (ret >= 0 && txn->keep_data && leader->resp_data) {
+            if (txn->resp_buf && leader->resp_size <= txn->resp_buf_size)
+                txn->resp_data = txn->resp_buf;
+            else
+                txn->resp_data = malloc(leader->resp_size);
+
+            if (txn->resp_data) {
+                memcpy(txn->resp_data, leader->resp_data, leader->resp_size);
+                txn->resp_size = leader->resp_size;
+                txn->record_size = leader->record_size;
+            } else {
+                status = -ENOMEM;
+            }
+        }
+        dev_sa_complete(dev, txn, status);
+    }
+}
+
+/*
+ * Account one attempt that ended with 'ret'. Either completes the transaction
+ * or schedules a resend after a backoff delay. Returns 1 if completed.
+ */
+static int dev_sa_attempt_done(struct sr_dev* dev, struct sr_sa_txn* txn, int ret)
+{
+    uint64_t now, delay = 0;
+    int done;
+
+    dev_sa_hash_del(dev, txn);
+    txn->retries--;
+    done = ret > 0 || (txn->allow_zero && ret == 0) || txn->retries <= 0;
+
+    now = get_time_stamp();
+    if (!done) {
+        delay = dev_sa_backoff(dev, txn);
+        if (txn->deadline && now + delay >= txn->deadline) {
+            sr_log_info("Deadline reached with %d retries left", txn->retries);
+            done = 1;
+        }
+    }
+
+    if (done) {
+        sr_log_debug("Found %d service records", ret);
+        dev_sa_unlink(dev, txn);
+        dev_sa_breaker_done(dev, txn, ret);
+        dev_sa_complete_followers(dev, txn, ret);
+        dev_sa_complete(dev, txn, ret);
+        return 1;
+    }
+
+    if (ret == 0) {
+        sr_log_info("sa_query() returned empty set, %d retries left", txn->retries);
+        if (txn->resp_data != txn->resp_buf)
+            free(txn->resp_data);
+        txn->resp_data = NULL;
+    }
+
+    txn->timeout = now + delay;
+    return 0;
+}
+
+/* Acknowledge an unsolicited Report and pass its Notice on */
+static void dev_sa_report(struct sr_dev* dev, struct umad_sa_packet* sa_mad, int len)
+{
+    struct umad_sa_packet resp;
+    int ret;
+
+    if (__be16_to_cpu(sa_mad->mad_hdr.attr_id) != UMAD_ATTR_NOTICE ||
+        len < (int)(offsetof(struct umad_sa_packet, data) + sizeof(struct sr_ib_notice))) {
+        sr_log_info("Ignoring Report with attr 0x%x len %d", __be16_to_cpu(sa_mad->mad_hdr.attr_id), len);
+        return;
+    }
+
+    /* ReportResp echoes the Report, the SA resends until it gets one */
+    SR_STAT_INC(dev->stats.reports);
+    memcpy(&resp, sa_mad, sizeof(resp));
+    resp.mad_hdr.method = UMAD_METHOD_REPORT_RESP;
+    resp.mad_hdr.status = 0;
+    if ((ret = dev->transport->send(dev, &resp)) < 0)
+        sr_log_warn("ReportResp send failed: %s", strerror(-ret));
+
+    if (dev->report)
+        dev->report(dev, sa_mad->data, dev->report_arg);
+}
+
+/* Match a received MAD to its transaction. Returns 1 if a transaction completed or a Report arrived */
+static int dev_sa_dispatch(struct sr_dev* dev, struct umad_sa_packet* sa_mad, int len)
+{
+    struct sr_sa_txn* txn;
+    uint16_t mad_status;
+    size_t data_size;
+    int record_size, num_records, ret;
+    uint32_t mad_tid;
+
+    if (sa_mad->mad_hdr.mgmt_class == UMAD_CLASS_SUBN_ADM && sa_mad->mad_hdr.method == UMAD_METHOD_REPORT) {
+        dev_sa_report(dev, sa_mad, len);
+        return 1;
+    }
+
+    /* Check MAD transaction ID. Cut it to 32 bits. */
+    mad_tid = (uint32_t)__be64_to_cpu(sa_mad->mad_hdr.tid);
+    txn = dev_sa_find(dev, mad_tid);
+    if (!txn) {
+        sr_log_info("Mismatched TID: got 0x%" PRIx32 ", no such request outstanding", mad_tid);
+        SR_STAT_INC(dev->stats.tid_mismatches);
+        return 0;
+    }
+
+    /* Check SubnAdm class */
+    if (sa_mad->mad_hdr.mgmt_class != UMAD_CLASS_SUBN_ADM) {
+        sr_log_warn("Mismatched MAD class: got %d, expected %d", sa_mad->mad_hdr.mgmt_class, UMAD_CLASS_SUBN_ADM);
+        return 0;
+    }
+
+    /* Check MAD method */
+    if ((sa_mad->mad_hdr.method & ~UMAD_METHOD_RESP_MASK) != dev_sa_response_method(txn->method)) {
+        sr_log_info("Mismatched SA method: got 0x%x, expected 0x%x",
+                    sa_mad->mad_hdr.method & ~UMAD_METHOD_RESP_MASK,
+                    dev_sa_response_method(txn->method));
+        return 0;
+    }
+    if (!(sa_mad->mad_hdr.method & UMAD_METHOD_RESP_MASK)) {
+        sr_log_info("Not a Response MAD");
+        return 0;
+    }
+
+    /* Check MAD status */
+    if ((mad_status = __be16_to_cpu(sa_mad->mad_hdr.status))) {
+        SR_STAT_INC(stats_method(dev, txn->method)->sa_errors);
+        ret = report_sa_err(dev, mad_status, txn->hide_errors);
+        /* A rejected query found nothing, a rejected update did not happen */
+        if (txn->method == UMAD_METHOD_GET || txn->method == UMAD_SA_METHOD_GET_TABLE ||
+            (txn->method == UMAD_SA_METHOD_DELETE && ret == -ENOENT))
+            ret = 0;
+        else if (ret != -EAGAIN)
+            txn->retries = 1;
+        return dev_sa_attempt_done(dev, txn, ret);
+    }
+
+    /* Check MAD length */
+    if (len < (int)offsetof(struct umad_sa_packet, data)) {
+        sr_log_err("MAD too short: %d bytes", len);
+        return dev_sa_attempt_done(dev, txn, -EPROTO);
+    }
+    data_size = len - offsetof(struct umad_sa_packet, data);
+
+    /* Calculate record size */
+    record_size = __be16_to_cpu(sa_mad->attr_offset) * 8;
+    if (txn->method == UMAD_SA_METHOD_GET_TABLE) {
+        num_records = record_size ? (data_size / record_size) : 0;
+    } else {
+        num_records = 1;
+    }
+
+    /* Copy data to the caller's buffer if it fits, otherwise to a new one */
+    if (txn->keep_data) {
+        if (txn->resp_buf && data_size <= txn->resp_buf_size) {
+            txn->resp_data = txn->resp_buf;
+        } else if (!(txn->resp_data = malloc(data_size))) {
+            return dev_sa_attempt_done(dev, txn, -ENOMEM);
+        }
+        memcpy(txn->resp_data, sa_mad->data, data_size);
+    }
+    txn->resp_size = data_size;
+    txn->record_size = record_size;
+
+    return dev_sa_attempt_done(dev, txn, num_records);
+}
+
+void dev_sa_txn_init(struct sr_sa_txn* txn, int method, int attr, uint64_t comp_mask, const void* req_data, int req_size)
+{
+    memset(txn, 0, sizeof(*txn));
+    txn->method = method;
+    txn->attr = attr;
+    txn->comp_mask = comp_mask;
+    txn->retries = 1;
+    txn->status = -EINPROGRESS;
+    if (req_data) {
+        txn->req_size = MIN(req_size, (int)sizeof(txn->req_data));
+        memcpy(txn->req_data, req_data, txn->req_size);
+    }
+}
+
+int dev_sa_submit(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    int ret;
+
+    if (txn->req_size > UMAD_LEN_SA_DATA) {
+        return -ENOBUFS;
+    }
+
+    /* check SA method */
+    if ((ret = dev_sa_response_method(txn->method)) < 0) {
+        sr_log_err("Unsupported SA method %d", txn->method);
+        return ret;
+    }
+
+    /* Only the blocking call that set it has a deadline */
+    if (txn->deadline && get_time_stamp() >= txn->deadline)
+        return -ETIMEDOUT;
+
+    txn->status = -EINPROGRESS;
+    txn->resp_data = NULL;
+
+    /* The I/O thread reports start failures through the status */
+    if (!dev_io_direct(dev)) {
+        io_submit(dev, txn);
+        return 0;
+    }
+
+    if ((ret = dev_sa_start(dev, txn)) < 0)
+        txn->status = ret;
+    return ret;
+}
+
+static uint64_t dev_sa_txn_key(const struct sr_sa_txn* txn)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+
+    h = (h ^ txn->method) * 0x100000001b3ULL;
+    h = (h ^ txn->attr) * 0x100000001b3ULL;
+    h = (h ^ txn->comp_mask) * 0x100000001b3ULL;
+    for (i = 0; i < txn->req_size; ++i)
+        h = (h ^ txn->req_data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Pending query that 'txn' can wait on instead of sending the same MAD */
+static struct sr_sa_txn* dev_sa_find_leader(struct sr_dev* dev, const struct sr_sa_txn* txn)
+{
+    struct sr_sa_txn* leader;
+
+    if (!dev_sa_is_query(txn))
+        return NULL;
+
+    /* A follower with a deadline must not wait past it */
+    for (leader = dev->query_table[SR_SA_TXN_HASH(txn->key)]; leader; leader = leader->qnext)
+        if (leader->key == txn->key && leader->method == txn->method && leader->attr == txn->attr &&
+            leader->comp_mask == txn->comp_mask && leader->req_size == txn->req_size &&
+            leader->keep_data == txn->keep_data && leader->allow_zero == txn->allow_zero &&
+            (!txn->deadline || (leader->deadline && leader->deadline <= txn->deadline)) &&
+            !memcmp(leader->req_data, txn->req_data, txn->req_size))
+            return leader;
+
+    return NULL;
+}
+
+/* Send a request admitted by the breaker and put it on the pending list */
+static int dev_sa_lead(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    int ret;
+
+    txn->sleep = 0;
+    txn->attempts = 0;
+    if ((ret = dev_sa_send(dev, txn)) < 0) {
+        if (dev->breaker_probe == txn)
+            dev->breaker_probe = NULL;
+        return ret;
+    }
+
+    txn->next = dev->txns;
+    dev->txns = txn;
+    if (dev_sa_is_query(txn)) {
+        txn->qnext = dev->query_table[SR_SA_TXN_HASH(txn->key)];
+        dev->query_table[SR_SA_TXN_HASH(txn->key)] = txn;
+    }
+    return 0;
+}
+
+/* Send a checked request and put it on the pending list, on the thread that owns the device */
+int dev_sa_start(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    struct sr_sa_txn* leader;
+    int ret;
+
+    txn->key = dev_sa_txn_key(txn);
+    txn->followers = NULL;
+    txn->leader = NULL;
+    txn->attempts = 0;
+    if ((leader = dev_sa_find_leader(dev, txn))) {
+        SR_STAT_INC(stats_method(dev, txn->method)->requests);
+        SR_STAT_INC(dev->stats.coalesced);
+        txn->start = get_time_stamp();
+        txn->leader = leader;
+        txn->next = leader->followers;
+        leader->followers = txn;
+        return 0;
+    }
+
+    if ((ret = dev_sa_breaker_admit(dev, txn)) < 0)
+        return ret;
+
+    SR_STAT_INC(stats_method(dev, txn->method)->requests);
+    txn->start = get_time_stamp();
+    return dev_sa_lead(dev, txn);
+}
+
+void dev_sa_cancel(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    struct sr_sa_txn **p, *follower;
+    int ret;
+
+    if (!dev_io_direct(dev)) {
+        io_call(dev, SR_IO_CANCEL, txn);
+        return;
+    }
+
+    if (txn->status != -EINPROGRESS)
+        return;
+
+    if (txn->leader) {
+        for (p = &txn->leader->followers; *p != txn; p = &(*p)->next)
+            ;
+        *p = txn->next;
+        txn->next = NULL;
+        txn->leader = NULL;
+        txn->status = -ECANCELED;
+        return;
+    }
+
+    dev_sa_hash_del(dev, txn);
+    dev_sa_unlink(dev, txn);
+    if (dev->breaker_probe == txn)
+        dev->breaker_probe = NULL;
+    txn->status = -ECANCELED;
+
+    /* The followers still want an answer, the first one is sent and leads the others */
+    if (!(follower = txn->followers))
+        return;
+    txn->followers = NULL;
+    follower->leader = NULL;
+    follower->followers = follower->next;
+    follower->next = NULL;
+    for (p = &follower->followers; *p; p = &(*p)->next)
+        (*p)->leader = follower;
+
+    if ((ret = dev_sa_breaker_admit(dev, follower)) < 0 || (ret = dev_sa_lead(dev, follower)) < 0) {
+        dev_sa_complete_followers(dev, follower, ret);
+        dev_sa_complete(dev, follower, ret);
+    }
+}
+
+/* The transport moved to another port: resend whatever waits for a response, the SA is worth trying again */
+void dev_sa_restart(struct sr_dev* dev)
+{
+    uint64_t now = get_time_stamp();
+    struct sr_sa_txn* txn;
+
+    for (txn = dev->txns; txn; txn = txn->next) {
+        if (!txn->sent)
+            continue;
+        dev_sa_hash_del(dev, txn);
+        txn->timeout = now;
+    }
+
+    dev->breaker_failures = 0;
+    dev->breaker_open_until = 0;
+}
+
+int dev_sa_progress(struct sr_dev* dev, int timeout_ms)
+{
+    struct umad_sa_packet* sa_mad;
+    struct sr_sa_txn* txn;
+    uint64_t now, until, next;
+    int completed = 0, batch = 0;
+    int len, ret, wait_ms;
+    void (*timer)(struct sr_dev* dev, void* arg);
+    uint64_t timer_next;
+
+    now = get_time_stamp();
+    until = now + (timeout_ms > 0 ? timeout_ms : 0) * 1000ULL;
+
+    do {
+        /* Device timer, it may submit transactions */
+        timer = __atomic_load_n(&dev->timer, __ATOMIC_ACQUIRE);
+        timer_next = __atomic_load_n(&dev->timer_next, __ATOMIC_RELAXED);
+        if (timer && timer_next && timer_next <= now)
+            timer(dev, dev->timer_arg);
+
+        /*
+         * Handle response timeouts and delayed resends. Completion callbacks
+         * may submit or cancel transactions, so rescan after each one.
+         */
+        do {
+            next = until;
+            if ((timer_next = __atomic_load_n(&dev->timer_next, __ATOMIC_RELAXED)))
+                next = MIN(next, timer_next);
+            for (txn = dev->txns; txn; txn = txn->next) {
+                if (txn->timeout <= now)
+                    break;
+                next = MIN(next, txn->timeout);
+            }
+            if (!txn)
+                break;
+
+            if (txn->sent) {
+                sr_log_info("mad recv timedout ");
+                SR_STAT_INC(stats_method(dev, txn->method)->timeouts);
+                completed += dev_sa_attempt_done(dev, txn, -ETIMEDOUT);
+            } else if ((ret = dev_sa_send(dev, txn)) < 0) {
+                completed += dev_sa_attempt_done(dev, txn, ret);
+            }
+        } while (1);
+
+        /* Wait for Reports and the device timer even when nothing is outstanding */
+        if (!dev->txns && !dev->report && !timer_next)
+            break;
+
+        /* Once something completed, only drain what is already there */
+        wait_ms = !completed && next > now ? (next - now) / 1000 : 0;
+        ret = dev->transport->recv(dev, &sa_mad, &len, wait_ms);
+        if (ret == 0) {
+            completed += dev_sa_dispatch(dev, sa_mad, len);
+        } else if (ret != -ETIMEDOUT) {
+            sr_log_info("%s recv returned %d (%s)", dev->transport->name, ret, strerror(-ret));
+            return ret;
+        } else if (completed) {
+            break;
+        } else if (wait_ms) {
+            SR_STAT_INC(dev->stats.recv_timeouts);
+        }
+
+        now = get_time_stamp();
+    } while (completed ? ++batch < SR_SA_RECV_BATCH : now < until);
+
+    return completed;
+}
+
+int dev_sa_wait(struct sr_dev* dev, struct sr_sa_txn* txn)
+{
+    int ret;
+
+    if ((ret = dev_sa_submit(dev, txn)) < 0)
+        return ret;
+
+    if (!dev_io_direct(dev)) {
+        io_wait(dev, txn);
+        return txn->status;
+    }
+
+    while (txn->status == -EINPROGRESS) {
+        ret = dev_sa_progress(dev, dev->fabric_timeout_ms);
+        if (ret < 0) {
+            dev_sa_cancel(dev, txn);
+            return ret;
+        }
+    }
+
+    return txn->status;
+}
+
+/* Wait for already submitted transactions, not submitted ones must not be -EINPROGRESS */
+int dev_sa_wait_all(struct sr_dev* dev, struct sr_sa_txn* txns, int num)
+{
+    int i, ret;
+
+    if (!dev_io_direct(dev)) {
+        for (i = 0; i < num; ++i)
+            io_wait(dev, &txns[i]);
+        return 0;
+    }
+
+    for (i = 0; i < num; ++i) {
+        while (txns[i].status == -EINPROGRESS) {
+            ret = dev_sa_progress(dev, dev->fabric_timeout_ms);
+            if (ret < 0) {
+                for (i = 0; i < num; ++i)
+                    dev_sa_cancel(dev, &txns[i]);
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int dev_sa_next_timeout(struct sr_dev* dev)
+{
+    struct sr_sa_txn* txn;
+    uint64_t now = get_time_stamp(), next = UINT64_MAX;
+    uint64_t timer_next = __atomic_load_n(&dev->timer_next, __ATOMIC_RELAXED);
+
+    for (txn = dev->txns; txn; txn = txn->next)
+        next = MIN(next, txn->timeout);
+    if (timer_next)
+        next = MIN(next, timer_next);
+
+    if (next == UINT64_MAX)
+        return -1;
+
+    return next > now ? (next - now + 999) / 1000 : 0;
+}
@@ -0,0 +1,321 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * Records registered through a device, keyed by service ID and port GID and
+ * kept as sent, key included, so they can be sent again. An open-addressing
+ * table with linear probing: it doubles once half full, and removal shifts the
+ * rest of the probe run back instead of leaving tombstones, so lookups never
+ * get longer as records come and go.
+ *
+ * A record saved after the SA acknowledged it is confirmed for half its lease,
+ * at most SR_SERVICE_CONFIRM_MAX, so registering it again unchanged meanwhile
+ * needs no SA round trip.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <infiniband/umad_sa.h>
+
+#include "service_record.h"
+#include "services.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define SR_SERVICE_CACHE_MIN 16
+#define SR_SERVICE_CONFIRM_MAX 2000 /* sec, also for infinite leases, as the SA may lose records */
+
+struct sr_service_slot
+{
+    uint64_t hash;                    /* 0 for a free slot */
+    uint64_t confirmed_until;         /* usec, 0 if the SA may not hold the record as saved */
+    struct sr_ib_service_record record;
+};
+
+struct sr_service_cache
+{
+    pthread_mutex_t lock;
+    struct sr_service_slot* slots;
+    uint32_t size;                    /* Power of two, 0 until the first save */
+    uint32_t count;
+};
+
+static uint64_t service_cache_hash(__be64 id, const uint8_t* port_gid)
+{
+    uint64_t prefix, guid, h;
+
+    memcpy(&prefix, port_gid, sizeof(prefix));
+    memcpy(&guid, port_gid + sizeof(prefix), sizeof(guid));
+
+    h = id ^ (prefix * 0x9e3779b97f4a7c15ULL) ^ (guid * 0xc2b2ae3d27d4eb4fULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h | 1;
+}
+
+/* Slot holding the record, or the free slot ending its probe run */
+static struct sr_service_slot* service_cache_slot(struct sr_service_cache* cache, uint64_t hash, __be64 id,
+                                                  const uint8_t* port_gid)
+{
+    uint32_t mask = cache->size - 1, i;
+    struct sr_service_slot* slot;
+
+    for (i = hash & mask;; i = (i + 1) & mask) {
+        slot = &cache->slots[i];
+        if (!slot->hash ||
+            (slot->hash == hash && slot->record.service_id == id && !memcmp(slot->record.service_gid, port_gid, 16)))
+            return slot;
+    }
+}
+
+static int service_cache_grow(struct sr_service_cache* cache)
+{
+    uint32_t size = cache->size ? cache->size * 2 : SR_SERVICE_CACHE_MIN;
+    struct sr_service_slot *old = cache->slots, *slot;
+    uint32_t old_size = cache->size, i;
+
+    cache->slots = calloc(size, sizeof(*cache->slots));
+    if (!cache->slots) {
+        cache->slots = old;
+        return -ENOMEM;
+    }
+    cache->size = size;
+
+    for (i = 0; i < old_size; ++i) {
+        if (!old[i].hash)
+            continue;
+        slot = service_cache_slot(cache, old[i].hash, old[i].record.service_id, old[i].record.service_gid);
+        *slot = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+int service_cache_init(struct sr_dev* dev)
+{
+    dev->service_cache = calloc(1, sizeof(*dev->service_cache));
+    if (!dev->service_cache) {
+        sr_log_err("Failed to allocate service cache");
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&dev->service_cache->lock, NULL);
+    return 0;
+}
+
+void service_cache_cleanup(struct sr_dev* dev)
+{
+    struct sr_service_cache* cache = dev->service_cache;
+
+    if (!cache)
+        return;
+
+    if (cache->count)
+        sr_log_debug("%u services left registered until their lease expires", cache->count);
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->slots);
+    free(cache);
+    dev->service_cache = NULL;
+}
+
+/* Insert or replace, the cache must be locked */
+static int service_cache_insert(struct sr_service_cache* cache, const struct sr_ib_service_record* record,
+                                uint64_t confirmed_until)
+{
+    uint64_t hash = service_cache_hash(record->service_id, record->service_gid);
+    struct sr_service_slot* slot;
+
+    if ((cache->count + 1) * 2 > cache->size && service_cache_grow(cache) && cache->count + 1 >= cache->size)
+        return -ENOMEM;
+
+    slot = service_cache_slot(cache, hash, record->service_id, record->service_gid);
+    if (!slot->hash) {
+        slot->hash = hash;
+        cache->count++;
+    }
+    slot->record = *record;
+    slot->confirmed_until = confirmed_until;
+    return 0;
+}
+
+/* Remove the record in 'slot', the cache must be locked */
+static void service_cache_delete(struct sr_service_cache* cache, struct sr_service_slot* slot)
+{
+    uint32_t mask = cache->size - 1, i, j, home;
+
+    /* Move back every later record of the run that may live in the hole */
+    for (i = slot - cache->slots, j = (i + 1) & mask; cache->slots[j].hash; j = (j + 1) & mask) {
+        home = cache->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cache->slots[i] = cache->slots[j];
+            i = j;
+        }
+    }
+    cache->slots[i].hash = 0;
+    cache->count--;
+}
+
+void service_cache_save(struct sr_dev* dev, const struct sr_ib_service_record* record)
+{
+    struct sr_service_cache* cache = dev->service_cache;
+    uint64_t id = __be64_to_cpu(record->service_id);
+    uint32_t lease = MIN(__be32_to_cpu(record->service_lease), SR_SERVICE_CONFIRM_MAX);
+    int ret;
+
+    pthread_mutex_lock(&cache->lock);
+    ret = service_cache_insert(cache, record, get_time_stamp() + lease * 500000ULL);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (ret)
+        sr_log_warn("No room to save service record '%.*s' id 0x%016" PRIx64, (int)sizeof(record->service_name),
+                    record->service_name, id);
+    else
+        sr_log_debug("Service 0x%016" PRIx64 " saved in cache", id);
+}
+
+int service_cache_find(struct sr_dev* dev, uint64_t id, const uint8_t* port_gid, struct sr_ib_service_record* record)
+{
+    struct sr_service_cache* cache = dev->service_cache;
+    __be64 be_id = __cpu_to_be64(id);
+    struct sr_service_slot* slot;
+    int ret = -ENOENT;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->size) {
+        slot = service_cache_slot(cache, service_cache_hash(be_id, port_gid), be_id, port_gid);
+        if (slot->hash) {
+            if (record)
+                *record = slot->record;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+/*
+ * Returns 1 if the SA confirmed 'record' byte for byte lately, 0 if another
+ * record of its ID and port GID was saved, -ENOENT if none was.
+ */
+int service_cache_confirmed(struct sr_dev* dev, const struct sr_ib_service_record* record)
+{
+    struct sr_service_cache* cache = dev->service_cache;
+    uint64_t hash = service_cache_hash(record->service_id, record->service_gid);
+    struct sr_service_slot* slot;
+    int ret = -ENOENT;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->size) {
+        slot = service_cache_slot(cache, hash, record->service_id, record->service_gid);
+        if (slot->hash)
+            ret = get_time_stamp() < slot->confirmed_until && !memcmp(&slot->record, record, sizeof(*record));
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+/* The SA may have lost records, the next registrations must reach it */
+void service_cache_unconfirm(struct sr_dev* dev)
+{
+    struct sr_service_cache* cache = dev->service_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < cache->size; ++i)
+        cache->slots[i].confirmed_until = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int service_cache_remove(struct sr_dev* dev, uint64_t id, const uint8_t* port_gid)
+{
+    struct sr_service_cache* cache = dev->service_cache;
+    __be64 be_id = __cpu_to_be64(id);
+    struct sr_service_slot* slot;
+
+    pthread_mutex_lock(&cache->lock);
+    if (!cache->size || !(slot = service_cache_slot(cache, service_cache_hash(be_id, port_gid), be_id, port_gid))->hash) {
+        pthread_mutex_unlock(&cache->lock);
+        sr_log_debug("No service id 0x%016" PRIx64 " to remove from the cache", id);
+        return -ENOENT;
+    }
+    service_cache_delete(cache, slot);
+    pthread_mutex_unlock(&cache->lock);
+
+    sr_log_info("Service 0x%016" PRIx64 " removed from cache", id);
+    return 0;
+}
+
+/*
+ * Give every record of 'old_gid' the GID 'new_gid'. Returns how many moved and
+ * a malloc()ed copy of them, as they were before the move, in 'moved'.
+ */
+int service_cache_move(struct sr_dev* dev, const uint8_t* old_gid, const uint8_t* new_gid,
+                       struct sr_ib_service_record** moved)
+{
+    struct sr_service_cache* cache = dev->service_cache;
+    struct sr_ib_service_record* records = NULL;
+    struct sr_service_slot* slot;
+    int num = 0, i, ret = 0;
+    uint32_t j;
+
+    *moved = NULL;
+    pthread_mutex_lock(&cache->lock);
+    for (j = 0; j < cache->size; ++j)
+        num += cache->slots[j].hash && !memcmp(cache->slots[j].record.service_gid, old_gid, 16);
+
+    if (num && !(records = malloc(num * sizeof(*records)))) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (j = 0, i = 0; j < cache->size; ++j)
+        if (cache->slots[j].hash && !memcmp(cache->slots[j].record.service_gid, old_gid, 16))
+            records[i++] = cache->slots[j].record;
+
+    /* Deleting shifts records around, so look each one up again */
+    for (i = 0; i < num; ++i) {
+        slot = service_cache_slot(cache, service_cache_hash(records[i].service_id, old_gid), records[i].service_id, old_gid);
+        service_cache_delete(cache, slot);
+    }
+    for (i = 0; i < num; ++i) {
+        struct sr_ib_service_record record = records[i];
+
+        memcpy(record.service_gid, new_gid, sizeof(record.service_gid));
+        service_cache_insert(cache, &record, 0);
+    }
+    *moved = records;
+    ret = num;
+
+out:
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+/*
+ * Call 'cb' for every saved record until it returns non-zero, which is
+ * returned. The cache is locked meanwhile, 'cb' must not call back into it.
+ */
+int service_cache_foreach(struct sr_dev* dev, int (*cb)(const struct sr_ib_service_record* record, void* arg), void* arg)
+{
+    struct sr_service_cache* cache = dev->service_cache;
+    int ret = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < cache->size && !ret; ++i)
+        if (cache->slots[i].hash)
+            ret = cb(&cache->slots[i].record, arg);
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
@@ -12,6 +12,8 @@
 #include <arpa/inet.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -23,98 +25,40 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 #ifndef offsetof
 #define offsetof(type, member) ((size_t)&((type*)0)->member)
 #endif
 
-#define IB_GRH_LEN 40
-struct sr_ib_service_record
-{
-    __be64 service_id;                 /* 0 */
-    __u8 service_gid[16];              /* 1 */
-    __be16 service_pkey;               /* 2 */
-    __be16 resv;                       /* 3 */
-    __be32 service_lease;              /* 4 */
-    __u8 service_key[SR_128_BIT_SIZE]; /* 5 */
-    char service_name[64];             /* 6 */
-    struct
-    {
-        __u8 service_data8[16];   /* 7 */
-        __be16 service_data16[8]; /* 8 */
-        __be32 service_data32[4]; /* 9 */
-        __be64 service_data64[2]; /* 10 */
-    } service_data;
-};
-
 #define SR_DEV_SERVICE_REGISTER_RETRIES 2
 
 sr_log_func log_func;
 
-typedef typeof(((struct umad_port*)0)->port_guid) umad_guid_t;
-
-static int dev_sa_response_method(int method)
+/* Deadline sr_set_deadline() armed for the next blocking call of this thread */
+static __thread struct sr_ctx* deadline_context;
+static __thread uint64_t deadline_armed;
+
+int sr_prepare_ib_service_record(struct sr_ctx* context,
+                                  struct sr_dev_service* sr,
+                                  struct sr_ib_service_record* record,
+                                  uint64_t id,
+                                  const char* name,
+                                  const void* data,
+                                  size_t data_size,
+                                  const uint8_t (*service_key)[SR_128_BIT_SIZE])
 {
-    switch (method) {
-        case UMAD_METHOD_GET:
-        case UMAD_SA_METHOD_GET_TABLE:
-        case UMAD_METHOD_REPORT:
-        case UMAD_METHOD_TRAP:
-        case UMAD_SA_METHOD_GET_TRACE_TABLE:
-        case UMAD_SA_METHOD_GET_MULTI:
-        case UMAD_SA_METHOD_DELETE:
-            return method;
-        case UMAD_METHOD_SET:
-            return UMAD_METHOD_GET;
-        default:
-            return -EINVAL;
+    if (strlen(name) >= sizeof(sr->name)) {
+        sr_log_err("Service name too long: %zu bytes", strlen(name));
+        return -EINVAL;
     }
-}
-
-static inline int report_sa_err(struct sr_dev* dev, uint16_t mad_status, int hide_errors)
-{
-    static const char* mad_invalid_field_errors[] = {[1] = "Bad version or class",
-                                                     [2] = "Method not supported",
-                                                     [3] = "Method/attribute combination not supported",
-                                                     [4] = "Reserved",
-                                                     [5] = "Reserved",
-                                                     [6] = "Reserved",
-                                                     [7] = "Invalid value in one or more fields of attribute or attribute modifier"};
-
-    static const char* sa_errors[] = {
-        [1] = "ERR_NO_RESOURCES",
-        [2] = "ERR_REQ_INVALID",
-        [3] = "ERR_NO_RECORDS",
-        [4] = "ERR_TOO_MANY_RECORDS",
-        [5] = "ERR_REQ_INVALID_GID",
-        [6] = "ERR_REQ_INSUFFICIENT_COMPONENTS",
-        [7] = "ERR_REQ_DENIED",
-    };
-
-    int log_level = (hide_errors) ? 3 : 1;
-
-    sr_log(log_level, "OpenSM request failed with status: 0x%04hx", mad_status);
-
-    uint8_t status = (mad_status >> 2) & 0x7;
-    if (status)
-        sr_log(log_level, "MAD status: %s", mad_invalid_field_errors[status]);
-    uint8_t sa_status = mad_status >> 8;
-    if (sa_status > 0 && sa_status <= 7)
-        sr_log(log_level, "SA status field: %s", sa_errors[sa_status]);
-
-    return EPROTO;
-}
 
-static int sr_prepare_ib_service_record(struct sr_ctx* context,
-                                         struct sr_dev_service* sr,
-                                         struct sr_ib_service_record* record,
-                                         const void* data,
-                                         size_t data_size,
-                                         const uint8_t (*service_key)[SR_128_BIT_SIZE])
-{
-    sr->id = context->service_id;
+    sr->id = id;
     // strncpy(sr->name, context->service_name, sizeof(sr->name) - 1);
     // sr->name[sizeof(sr->name) - 1] = '\0';
-    snprintf(sr->name, sizeof(sr->name), "%s", context->service_name);
+    snprintf(sr->name, sizeof(sr->name), "%s", name);
     sr->lease = context->sr_lease_time;
     memset(sr->data, 0, sizeof(sr->data));
     size_t copy_size = MIN(data_size, sizeof(sr->data));
@@ -132,6 +76,7 @@ static int sr_prepare_ib_service_record(struct sr_ctx* context,
     // record->service_name[sizeof(record->service_name)-1] = '\0';
     snprintf(record->service_name, sizeof(record->service_name), "%s", sr->name);
     memcpy(&record->service_data, sr->data, sizeof(sr->data));
+    memcpy(sr->port_gid, &context->dev->port_gid, sizeof(sr->port_gid));
     memcpy(&record->service_gid, &context->dev->port_gid, sizeof(record->service_gid));
 
     if (service_key) {
@@ -141,833 +86,1305 @@ static int sr_prepare_ib_service_record(struct sr_ctx* context,
     return 0;
 }
 
-static uint64_t get_time_stamp(void)
+static int dev_sa_query_retries(struct sr_dev* dev, struct sr_sa_txn* txn)
 {
-    uint64_t tstamp;
-    struct timeval tv;
+    int ret, dev_updated = 0;
+    uint16_t prev_lid;
+
+retry:
+    ret = dev_sa_wait(dev, txn);
+
+    prev_lid = dev->port_lid;
+    /*
+     * With SR_MULTI_PORT an unreachable SA may mean the port is gone, whatever
+     * the request. Requests failed by the breaker or the rate limit never left.
+     */
+    if (ret < 0 && !dev_updated &&
+        ((txn->method == UMAD_SA_METHOD_GET_TABLE && ret != -EHOSTUNREACH && ret != -EBUSY) ||
+         (dev->failover && (ret == -ETIMEDOUT || ret == -EHOSTUNREACH))) &&
+        (!txn->deadline || get_time_stamp() < txn->deadline) && !dev_update(dev)) {
+        sr_log_info("%s:%d device updated", dev->dev_name, dev->port_num);
+        SR_STAT_INC(dev->stats.dev_updates);
+        if (dev->port_lid != prev_lid){
+            sr_log_warn("%s:%d LID change", dev->dev_name, dev->port_num);
+        }
 
-    gettimeofday(&tv, NULL);
+        /* The update fixes a stale LID or SM LID, one more attempt tells whether it did */
+        txn->retries = 1;
+        dev_updated = 1;
+        goto retry;
+    }
 
-    /* Convert the time of day into a microsecond timestamp. */
-    tstamp = ((uint64_t)tv.tv_sec) * 1000000ULL + (uint64_t)tv.tv_usec;
+    if (ret < 0) {
+        sr_log_err("Failed to query SR: %s", strerror(-ret));
+    }
 
-    return (tstamp);
+    return ret;
 }
 
-static int mad_recv(struct sr_dev* dev, void** buf, int* length)
+void dev_register_txn_init(struct sr_sa_txn* txn, struct sr_ib_service_record* record)
 {
-    struct ibv_wc wc;
-    int i, n;
-    uint64_t time;
+    uint64_t comp_mask = BIT(0) | BIT(1) | BIT(2) | BIT(4) | BIT(6) | BIT(7) | BIT(8) | BIT(9) | BIT(10) | BIT(11) | BIT(12) | BIT(13) |
+                         BIT(14) | BIT(15) | BIT(16) | BIT(17) | BIT(18) | BIT(19) | BIT(19) | BIT(20) | BIT(21) | BIT(22) | BIT(23) |
+                         BIT(24) | BIT(25) | BIT(26) | BIT(27) | BIT(28) | BIT(29) | BIT(30) | BIT(31) | BIT(32) | BIT(33) | BIT(34) |
+                         BIT(35) | BIT(36); /* ServiceID, ServiceGID, ServicePKey, ServiceLease, ServiceName, and all ServiceData fields */
 
-    do {
-        n = ibv_poll_cq(dev->verbs.cq, 1, &wc);
-        if (n < 0) {
-            sr_log_err("ibv_poll_cq failed");
-            return -EINVAL;
-        }
+    if (*(record->service_key)) {
+        comp_mask |= BIT(5);
+    }
 
-        for (i = 0; i < n; i++) {
-            if (wc.status != IBV_WC_SUCCESS) {
-                sr_log_err("ibv_poll_cq failed. status : %s (%d) ", ibv_wc_status_str(wc.status), wc.status);
-            }
-            if (wc.wr_id == 1) {
-                sr_log_info("MAD send completed");
-            } else if (wc.wr_id == (uint64_t)dev->verbs.mad_buf) {
-                sr_log_info("MAD recv completed len:%d ", wc.byte_len);
-                *buf = dev->verbs.mad_buf + 2048 + IB_GRH_LEN;
-                *length = wc.byte_len - IB_GRH_LEN;
-                return 0;
-            }
-        }
+    dev_sa_txn_init(txn, UMAD_METHOD_SET, UMAD_SA_ATTR_SERVICE_REC, comp_mask, record, sizeof(*record));
+    txn->allow_zero = 1;
+    txn->retries = SR_DEV_SERVICE_REGISTER_RETRIES;
+}
 
-        time = get_time_stamp();
+static int dev_register_service(struct sr_dev* dev, struct sr_ib_service_record* record, uint64_t deadline)
+{
+    struct sr_sa_txn txn;
+    int ret;
 
-        if ((time - dev->verbs.mad_start_time) / 1000 > dev->fabric_timeout_ms) {
-            return -ETIMEDOUT;
-        }
-    } while (1);
+    dev_register_txn_init(&txn, record);
+    txn.deadline = deadline;
+    ret = dev_sa_query_retries(dev, &txn);
+    if (ret < 0)
+        return ret;
+
+    return 0;
 }
 
-static int mad_send(struct sr_dev* dev, void* mad_buf, size_t length)
+static void dev_unregister_txn_init(struct sr_dev* dev, struct sr_sa_txn* txn, uint64_t id, uint8_t* port_gid, const uint8_t (*service_key)[16])
 {
-    struct ibv_sge sge;
-    struct ibv_send_wr send_wr, *bad_send_wr;
-    struct ibv_recv_wr recv_wr, *bad_recv_wr;
-    int ret;
+    struct sr_ib_service_record record;
+    uint64_t comp_mask = BIT(0) | BIT(1) | BIT(2);
 
-    struct ibv_sge list = {
-        .addr = (uintptr_t)dev->verbs.mad_buf + 2048,
-        .length = 2048,
-        .lkey = dev->verbs.mad_buf_mr->lkey,
-    };
+    service_cache_remove(dev, id, port_gid ? port_gid : dev->port_gid.raw);
 
-    recv_wr.wr_id = (uint64_t)dev->verbs.mad_buf;
-    recv_wr.sg_list = &list;
-    recv_wr.num_sge = 1;
-    recv_wr.next = NULL;
+    memset(&record, 0, sizeof(record));
+    record.service_id = __cpu_to_be64(id);
+    record.service_pkey = __cpu_to_be16(dev->pkey);
+    if (port_gid)
+        memcpy(&record.service_gid, port_gid, sizeof(record.service_gid));
+    else
+        memcpy(&record.service_gid, &dev->port_gid, sizeof(record.service_gid));
 
-    ret = ibv_post_recv(dev->verbs.qp, &recv_wr, &bad_recv_wr);
-    if (ret) {
-        sr_log_err("post recv failed: %d", ret);
-        return -1;
-    }
-
-    sge.length = length;
-    sge.lkey = dev->verbs.mad_buf_mr->lkey;
-    sge.addr = (uintptr_t)mad_buf;
-
-    send_wr.next = NULL;
-    send_wr.sg_list = &sge;
-    send_wr.num_sge = 1;
-    send_wr.opcode = IBV_WR_SEND;
-    send_wr.send_flags = IBV_SEND_SIGNALED;
-    send_wr.wr_id = (unsigned long)1;
-    send_wr.imm_data = htonl(dev->verbs.qp->qp_num);
-    send_wr.wr.ud.ah = dev->verbs.sa_ah;
-    send_wr.wr.ud.remote_qpn = 1;
-    send_wr.wr.ud.remote_qkey = UMAD_QKEY;
-
-    ret = ibv_post_send(dev->verbs.qp, &send_wr, &bad_send_wr);
-    if (ret) {
-        sr_log_err("post send failed");
-        return 1;
+    if (service_key) {
+        memcpy(&record.service_key, service_key, sizeof(record.service_key));
+        comp_mask |= BIT(5);
     }
 
-    dev->verbs.mad_start_time = get_time_stamp();
+    dev_sa_txn_init(txn, UMAD_SA_METHOD_DELETE, UMAD_SA_ATTR_SERVICE_REC, comp_mask, &record, sizeof(record));
+    txn->allow_zero = 1;
+    txn->retries = SR_DEV_SERVICE_REGISTER_RETRIES;
+}
+
+/* DELETE the records of the list, all in flight together. Returns how many failed */
+static int dev_unregister_burst(struct sr_dev* dev, const struct sr_dev_service* srs, int num, const uint8_t (*service_key)[16],
+                                uint64_t deadline)
+{
+    struct sr_sa_txn* txns;
+    int failures = 0, i, ret;
+
+    if (num <= 0)
+        return 0;
+
+    txns = calloc(num, sizeof(*txns));
+    if (!txns) {
+        sr_log_err("Failed to allocate %d service unregistrations", num);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < num; ++i) {
+        dev_unregister_txn_init(dev, &txns[i], srs[i].id, (uint8_t*)srs[i].port_gid, service_key);
+        txns[i].deadline = deadline;
+        if ((ret = dev_sa_submit(dev, &txns[i])) < 0)
+            txns[i].status = ret;
+    }
+    dev_sa_wait_all(dev, txns, num);
+
+    for (i = 0; i < num; ++i) {
+        if (txns[i].status < 0) {
+            sr_log_warn("Couldn't unregister old SR with id 0x%016" PRIx64 ": %s", srs[i].id, strerror(-txns[i].status));
+            failures++;
+        } else {
+            sr_log_info("Unregistered old service with id 0x%016" PRIx64, srs[i].id);
+        }
+    }
+
+    free(txns);
+    return failures;
+}
+
+struct dev_cached_records
+{
+    struct sr_ib_service_record* records;
+    int num;
+    int max;
+};
 
+static int dev_cached_record(const struct sr_ib_service_record* record, void* arg)
+{
+    struct dev_cached_records* cached = arg;
+    struct sr_ib_service_record* grown;
+
+    if (cached->num == cached->max) {
+        grown = realloc(cached->records, (cached->max ? 2 * cached->max : 16) * sizeof(*grown));
+        if (!grown)
+            return -ENOMEM;
+        cached->records = grown;
+        cached->max = cached->max ? 2 * cached->max : 16;
+    }
+    cached->records[cached->num++] = *record;
     return 0;
 }
 
-static int verbs_dev_sa_query(struct sr_dev* dev,
-                              int method,
-                              int attr,
-                              uint64_t comp_mask,
-                              void* req_data,
-                              int req_size,
-                              void** resp_data,
-                              int* resp_attr_size,
-                              int hide_errors)
-{
-    struct umad_sa_packet *sa_mad, *sa_mad_resp;
-    int record_size, num_records;
-    uint16_t mad_status;
-    size_t data_size;
-    int response_method, match, len, ret;
-    __be64 sa_mkey;
-    uint64_t tid, mad_tid;
-
-    if (req_size > UMAD_LEN_SA_DATA) {
-        return -ENOBUFS;
-    }
-    /* check SA method */
-    if ((ret = dev_sa_response_method(method)) < 0) {
-        sr_log_err("Unsupported SA method %d", method);
-        goto out;
+/*
+ * DELETE every record registered through the context, whatever its ID, all in
+ * flight together and without a lookup: the service cache holds them as sent.
+ * Each is matched on ServiceID, ServiceGID and ServicePKey, as the SA
+ * requires, and on its own key unless one is given. Returns how many failed.
+ */
+static int dev_unregister_bulk(struct sr_ctx* context, const uint8_t (*service_key)[16], uint64_t deadline)
+{
+    struct dev_cached_records cached = {NULL, 0, 0};
+    struct sr_ib_service_record* record;
+    struct sr_sa_txn* txns;
+    int failures = 0, i, ret;
+    uint64_t id;
+
+    if (service_cache_foreach(context->dev, dev_cached_record, &cached) < 0) {
+        sr_log_err("Failed to allocate records to unregister");
+        free(cached.records);
+        return -ENOMEM;
+    }
+    if (!cached.num)
+        return 0;
+
+    txns = calloc(cached.num, sizeof(*txns));
+    if (!txns) {
+        sr_log_err("Failed to allocate %d service unregistrations", cached.num);
+        free(cached.records);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < cached.num; ++i) {
+        record = &cached.records[i];
+        id = __be64_to_cpu(record->service_id);
+        lease_untrack(context, id, record->service_name);
+        dev_unregister_txn_init(context->dev, &txns[i], id, record->service_gid,
+                                service_key ? service_key : *record->service_key ? &record->service_key : NULL);
+        txns[i].deadline = deadline;
+        if ((ret = dev_sa_submit(context->dev, &txns[i])) < 0)
+            txns[i].status = ret;
+    }
+    dev_sa_wait_all(context->dev, txns, cached.num);
+
+    for (i = 0; i < cached.num; ++i) {
+        id = __be64_to_cpu(cached.records[i].service_id);
+        if (txns[i].status < 0) {
+            sr_log_warn("Couldn't unregister service 0x%016" PRIx64 ": %s", id, strerror(-txns[i].status));
+            failures++;
+        } else {
+            sr_log_info("Service 0x%016" PRIx64 " unregistered", id);
+        }
+        query_cache_invalidate(context, id);
     }
-    response_method = ret;
 
-    tid = rand_r(&dev->seed);
+    free(txns);
+    free(cached.records);
+    return failures;
+}
 
-    sa_mad = (struct umad_sa_packet*)dev->verbs.mad_buf;
+/* After a failover, register our records again with the new port GID and delete them under the old one */
+void dev_move_services(struct sr_dev* dev, const uint8_t* old_gid)
+{
+    struct sr_ib_service_record *moved, record;
+    struct sr_sa_txn* txns;
+    int num, i;
 
-    sa_mad->mad_hdr.base_version = 1;
-    sa_mad->mad_hdr.mgmt_class = UMAD_CLASS_SUBN_ADM;
-    sa_mad->mad_hdr.class_version = UMAD_SA_CLASS_VERSION;
-    sa_mad->mad_hdr.method = method;
-    sa_mad->mad_hdr.tid = __cpu_to_be64(tid);
-    sa_mad->mad_hdr.attr_id = __cpu_to_be16(attr);
-    sa_mkey = __cpu_to_be64(dev->sa_mkey);
-    memcpy(sa_mad->sm_key, &sa_mkey, sizeof(sa_mad->sm_key));
-    sa_mad->comp_mask = __cpu_to_be64(comp_mask);
-    if (req_data) {
-        memcpy(sa_mad->data, req_data, req_size);
+    if ((num = service_cache_move(dev, old_gid, dev->port_gid.raw, &moved)) <= 0) {
+        if (num < 0)
+            sr_log_err("Failed to move service records to the new port");
+        return;
     }
 
-    ret = mad_send(dev, sa_mad, sizeof(*sa_mad));
-    if (ret) {
-        sr_log_err("umad_send failed: %s. attr 0x%x method 0x%x", strerror(errno), attr, method);
-        goto out;
+    txns = calloc(2 * num, sizeof(*txns));
+    if (!txns) {
+        sr_log_err("Failed to allocate %d service record moves", num);
+        free(moved);
+        return;
     }
 
-    do {
-        mad_tid = 0;
-        /* Receive one MAD */
-        ret = mad_recv(dev, (void**)&sa_mad_resp, &len);
-        if (ret < 0) {
-            if (ret == -ETIMEDOUT) {
-                sr_log_info("mad recv timedout ");
-            } else {
-                sr_log_info("umad_recv returned %d (%s). attr 0x%x method 0x%x", ret, strerror(errno), attr, method);
-            }
-            goto out;
-        }
+    /* All SETs and DELETEs go out together */
+    for (i = 0; i < num; ++i) {
+        record = moved[i];
+        memcpy(record.service_gid, dev->port_gid.raw, sizeof(record.service_gid));
+        dev_register_txn_init(&txns[i], &record);
+        dev_unregister_txn_init(dev, &txns[num + i], __be64_to_cpu(moved[i].service_id), moved[i].service_gid,
+                                *moved[i].service_key ? &moved[i].service_key : NULL);
+    }
+    for (i = 0; i < 2 * num; ++i)
+        if (dev_sa_submit(dev, &txns[i]) < 0)
+            txns[i].status = -ECANCELED;
+    dev_sa_wait_all(dev, txns, 2 * num);
+
+    for (i = 0; i < num; ++i) {
+        if (txns[i].status < 0)
+            sr_log_err("Couldn't register service 0x%016" PRIx64 " on the new port: %s",
+                       __be64_to_cpu(moved[i].service_id), strerror(-txns[i].status));
+        else if (txns[num + i].status < 0)
+            sr_log_info("Couldn't unregister service 0x%016" PRIx64 " from the old port: %s",
+                        __be64_to_cpu(moved[i].service_id), strerror(-txns[num + i].status));
+    }
+    sr_log_info("Moved %d service records to %s port %d", num, dev->dev_name, dev->port_num);
 
-        match = 1;
-        sa_mad = (struct umad_sa_packet*)sa_mad_resp;
-        /* Check SubnAdm class */
-        if (sa_mad->mad_hdr.mgmt_class != UMAD_CLASS_SUBN_ADM) {
-            sr_log_warn("Mismatched MAD class: got %d, expected %d", sa_mad->mad_hdr.mgmt_class, UMAD_CLASS_SUBN_ADM);
-            match = 0;
-        }
+    free(txns);
+    free(moved);
+}
 
-        /* Check MAD method */
-        if ((sa_mad->mad_hdr.method & ~UMAD_METHOD_RESP_MASK) != response_method) {
-            sr_log_info("Mismatched SA method: got 0x%x, expected 0x%x", sa_mad->mad_hdr.method & ~UMAD_METHOD_RESP_MASK, response_method);
-            match = 0;
-        }
-        if (!(sa_mad->mad_hdr.method & UMAD_METHOD_RESP_MASK)) {
-            sr_log_info("Not a Response MAD");
-            match = 0;
-        }
+void fill_dev_service_from_ib_service_record(struct sr_dev_service* service, struct sr_ib_service_record* record)
+{
+    service->id = __be64_to_cpu(record->service_id);
+    /* The field is NUL padded, copy it whole and cut a name that fills it */
+    memcpy(service->name, record->service_name, sizeof(record->service_name));
+    service->name[sizeof(record->service_name) - 1] = '\0';
+    memcpy(service->data, &record->service_data, sizeof(service->data));
+    memcpy(service->port_gid, record->service_gid, sizeof(service->port_gid));
+}
 
-        /* Check MAD transaction ID. Cut it to 32 bits. */
-        mad_tid = (uint32_t)__be64_to_cpu(sa_mad->mad_hdr.tid);
-        if (mad_tid != tid) {
-            sr_log_info("Mismatched TID: got 0x%" PRIx64 ", expected 0x%" PRIx64, mad_tid, tid);
-            match = 0;
-        }
-    } while (!match);
+/* Build a ServiceRecord query; every field set in the filter becomes a component the SA matches on */
+static void dev_query_txn_init(struct sr_ctx* context, struct sr_sa_txn* txn, const struct sr_query_filter* filter, int retries)
+{
+    // Query for the record of SHARP, so we don't get many records not related to us
+    struct sr_ib_service_record record;
+    uint64_t comp_mask = BIT(0);   // ServiceID
+    memset(&record, 0, sizeof(record));
+    record.service_id = __cpu_to_be64(filter->id ? filter->id : context->service_id);
 
-    /* Check MAD status */
-    if ((mad_status = __be16_to_cpu(sa_mad->mad_hdr.status))) {
-        report_sa_err(dev, mad_status, hide_errors);
-        goto out;
+    if (filter->flags & SR_QUERY_FILTER_NAME) {
+        snprintf(record.service_name, sizeof(record.service_name), "%s", filter->name ? filter->name : context->service_name);
+        comp_mask |= BIT(6);   // ServiceName
+    }
+    if (filter->flags & SR_QUERY_FILTER_GID) {
+        memcpy(record.service_gid, filter->port_gid, sizeof(record.service_gid));
+        comp_mask |= BIT(1);   // ServiceGID
+    }
+    if (filter->flags & SR_QUERY_FILTER_PKEY) {
+        record.service_pkey = __cpu_to_be16(filter->pkey);
+        comp_mask |= BIT(2);   // ServicePKey
+    }
+    if (filter->flags & SR_QUERY_FILTER_KEY) {
+        memcpy(record.service_key, filter->service_key, sizeof(record.service_key));
+        comp_mask |= BIT(5);   // ServiceKey
     }
 
-    /* Check MAD length */
-    if (len < offsetof(struct umad_sa_packet, data)) {
-        sr_log_err("MAD too short: %d bytes", len);
-        ret = -EPROTO;
-        goto out;
+    int method = (context->dev->transport->caps & SR_TRANSPORT_CAP_TABLE ? UMAD_SA_METHOD_GET_TABLE : UMAD_METHOD_GET);
+    dev_sa_txn_init(txn, method, UMAD_SA_ATTR_SERVICE_REC, comp_mask, &record, sizeof(record));
+    txn->retries = retries;
+    txn->hide_errors = context->flags & SR_HIDE_ERRORS;
+    txn->keep_data = 1;
+}
+
+void dev_get_service_txn_init(struct sr_ctx* context, struct sr_sa_txn* txn, uint64_t id, const char* name, int retries)
+{
+    struct sr_query_filter filter = {.flags = SR_QUERY_FILTER_NAME, .id = id, .name = name};
+
+    dev_query_txn_init(context, txn, &filter, retries);
+}
+
+/* Fill 'bitmap' for the 'num' records of a batch, by name or all of them */
+static void dev_match_batch(const char* name, struct sr_sa_txn* txn, int base, int num, int all, uint64_t* bitmap)
+{
+    if (!all) {
+        decode_match_names((char*)txn->resp_data + base * txn->record_size, txn->record_size, num, name, bitmap);
+        return;
     }
-    data_size = len - offsetof(struct umad_sa_packet, data);
 
-    /* Calculate record size */
-    record_size = __be16_to_cpu(sa_mad->attr_offset) * 8;
-    if (method == UMAD_SA_METHOD_GET_TABLE)
-        num_records = record_size ? (data_size / record_size) : 0;
-    else
-        num_records = 1;
+    memset(bitmap, 0xff, (num + 63) / 64 * sizeof(*bitmap));
+    if (num % 64)
+        bitmap[num / 64] = (1ULL << (num % 64)) - 1;
+}
+
+/* Index of the next record set in 'bitmap' at or after 'i', or -1 */
+static int dev_next_match(const uint64_t* bitmap, int num, int i)
+{
+    uint64_t bits;
+
+    for (; i < num; i = (i / 64 + 1) * 64) {
+        bits = bitmap[i / 64] & (~0ULL << (i % 64));
+        if (bits)
+            return i / 64 * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+int dev_decode_services(struct sr_ctx* context,
+                        const char* name,
+                        struct sr_sa_txn* txn,
+                        int num_records,
+                        struct sr_dev_service* services,
+                        int max,
+                        int just_copy)
+{
+    uint64_t bitmap[SR_DECODE_BATCH / 64];
+    struct sr_ib_service_record* response;
+    int base, num, i, j = 0;
+
+    for (base = 0; base < num_records && j < max; base += SR_DECODE_BATCH) {
+        num = MIN(num_records - base, SR_DECODE_BATCH);
+        dev_match_batch(name, txn, base, num, just_copy, bitmap);
 
-    /* Copy data to a new buffer */
-    if (resp_data) {
-        if (!(*resp_data = malloc(data_size))) {
-            ret = -ENOMEM;
-            goto out;
+        for (i = dev_next_match(bitmap, num, 0); i >= 0 && j < max; i = dev_next_match(bitmap, num, i + 1)) {
+            response = (struct sr_ib_service_record*)((char*)txn->resp_data + (base + i) * txn->record_size);
+            fill_dev_service_from_ib_service_record(&services[j], response);
+            services[j].lease = context->sr_lease_time;
+            sr_log_debug("Found SR: (%d) %s 0x%016" PRIx64, j, services[j].name, services[j].id);
+            j++;
         }
-        memcpy(*resp_data, sa_mad->data, data_size);
     }
 
-    if (resp_attr_size)
-        *resp_attr_size = record_size;
+    return j;
+}
 
-    ret = num_records;
+/* Decode matching records one at a time, until 'cb' returns non-zero. Returns the number visited */
+static int dev_foreach_decoded(struct sr_ctx* context, const char* name, struct sr_sa_txn* txn, int num_records, sr_service_cb cb, void* arg)
+{
+    uint64_t bitmap[SR_DECODE_BATCH / 64];
+    struct sr_ib_service_record* response;
+    struct sr_dev_service service;
+    int base, num, i, visited = 0;
+
+    for (base = 0; base < num_records; base += SR_DECODE_BATCH) {
+        num = MIN(num_records - base, SR_DECODE_BATCH);
+        dev_match_batch(name, txn, base, num, 0, bitmap);
+
+        for (i = dev_next_match(bitmap, num, 0); i >= 0; i = dev_next_match(bitmap, num, i + 1)) {
+            response = (struct sr_ib_service_record*)((char*)txn->resp_data + (base + i) * txn->record_size);
+            fill_dev_service_from_ib_service_record(&service, response);
+            service.lease = context->sr_lease_time;
+            visited++;
+            if (cb(&service, arg))
+                return visited;
+        }
+    }
 
-out:
-    return ret;
+    return visited;
 }
 
-static int umad_dev_sa_query(struct sr_dev* dev,
-                             int method,
-                             int attr,
-                             uint64_t comp_mask,
-                             void* req_data,
-                             int req_size,
-                             void** resp_data,
-                             int* resp_attr_size,
-                             int hide_errors)
-{
-    struct ib_user_mad* umad;
-    struct umad_sa_packet* sa_mad;
-    void* newumad;
-    int record_size, num_records;
-    uint16_t mad_status;
-    size_t data_size;
-    int response_method, match, len, ret;
-    __be64 sa_mkey;
-    uint64_t tid;
-    union ibv_gid sa_gid;
-
-    if (req_size > UMAD_LEN_SA_DATA){
-        return -ENOBUFS;
-    }
-
-    /* check SA method */
-    if ((ret = dev_sa_response_method(method)) < 0) {
-        sr_log_err("Unsupported SA method %d", method);
-        goto out;
+/* Let a blocking query use the context arena, unless a callback already is */
+static int dev_arena_get(struct sr_ctx* context, struct sr_sa_txn* txn)
+{
+    if (__atomic_exchange_n(&context->arena_busy, 1, __ATOMIC_ACQUIRE))
+        return 0;
+
+    txn->resp_buf = context->arena;
+    txn->resp_buf_size = context->arena_size;
+    return 1;
+}
+
+/* A response that did not fit in the arena becomes the new arena */
+static void dev_arena_put(struct sr_ctx* context, struct sr_sa_txn* txn)
+{
+    if (txn->resp_data && txn->resp_data != context->arena) {
+        free(context->arena);
+        context->arena = txn->resp_data;
+        context->arena_size = txn->resp_size;
     }
-    response_method = ret;
+    txn->resp_data = NULL;
+    __atomic_store_n(&context->arena_busy, 0, __ATOMIC_RELEASE);
+}
 
-    len = sizeof(*umad) + sizeof(*sa_mad);
-    umad = (struct ib_user_mad*)calloc(1, len);
-    if (!umad) {
-        sr_log_err("Cannot allocate memory for umad: %m");
-        ret = -ENOMEM;
-        goto out;
+int dev_get_service(struct sr_ctx* context, const char* name, struct sr_dev_service* services, int max, int retries, int just_copy,
+                    uint64_t deadline)
+{
+    struct sr_sa_txn txn;
+    unsigned epoch;
+    int ret, arena;
+
+    dev_get_service_txn_init(context, &txn, context->service_id, name, retries);
+    txn.deadline = deadline;
+    arena = dev_arena_get(context, &txn);
+    epoch = query_cache_epoch(context);
+    ret = dev_sa_query_retries(context->dev, &txn);
+    if (ret >= 0) {
+        query_cache_store(context, context->service_id, name, &txn, epoch);
+        ret = dev_decode_services(context, name, &txn, ret, services, max, just_copy);
     }
 
-    tid = rand_r(&dev->seed);
+    if (arena)
+        dev_arena_put(context, &txn);
+    else
+        free(txn.resp_data);
 
-    umad->addr.qpn = __cpu_to_be32(1);
-    umad->addr.qkey = __cpu_to_be32(UMAD_QKEY);
-    umad->addr.pkey_index = dev->pkey_index;
-    umad->addr.lid = __cpu_to_be16(dev->port_smlid);
-    umad->addr.sl = 0;        /* !!! */
-    umad->addr.path_bits = 0; /* !!! */
+    return ret;
+}
 
-    sa_gid.global.subnet_prefix = dev->port_gid.global.subnet_prefix;
-    sa_gid.global.interface_id = __cpu_to_be64(SA_WELL_KNOWN_GUID);
+static int dev_foreach_service(struct sr_ctx* context, const char* name, int retries, sr_service_cb cb, void* arg,
+                               uint64_t deadline)
+{
+    struct sr_sa_txn txn;
+    unsigned epoch;
+    int ret, arena;
+
+    dev_get_service_txn_init(context, &txn, context->service_id, name, retries);
+    txn.deadline = deadline;
+    arena = dev_arena_get(context, &txn);
+    epoch = query_cache_epoch(context);
+    ret = dev_sa_query_retries(context->dev, &txn);
+    if (ret >= 0) {
+        query_cache_store(context, context->service_id, name, &txn, epoch);
+        ret = dev_foreach_decoded(context, name, &txn, ret, cb, arg);
+    }
 
-    umad->addr.grh_present = 1;
-    memcpy(&umad->addr.gid, sa_gid.raw, sizeof(umad->addr.gid));
+    if (arena)
+        dev_arena_put(context, &txn);
+    else
+        free(txn.resp_data);
 
-    sa_mad = (struct umad_sa_packet*)umad->data;
-    sa_mad->mad_hdr.base_version = 1;
-    sa_mad->mad_hdr.mgmt_class = UMAD_CLASS_SUBN_ADM;
-    sa_mad->mad_hdr.class_version = UMAD_SA_CLASS_VERSION;
-    sa_mad->mad_hdr.method = method;
-    sa_mad->mad_hdr.tid = __cpu_to_be64(tid);
-    sa_mad->mad_hdr.attr_id = __cpu_to_be16(attr);
-    sa_mkey = __cpu_to_be64(dev->sa_mkey);
-    memcpy(sa_mad->sm_key, &sa_mkey, sizeof(sa_mad->sm_key));
-    sa_mad->comp_mask = __cpu_to_be64(comp_mask);
-    if (req_data){
-        memcpy(sa_mad->data, req_data, req_size);
+    return ret;
+}
+
+struct dev_stale_scan
+{
+    struct sr_ctx* context;
+    struct sr_service_entry* entry;
+    struct sr_dev_service* service;
+    struct sr_sa_txn* deletes;
+    int* num_deletes;
+};
+
+static int dev_stale_service(const struct sr_dev_service* old_sr, void* arg)
+{
+    struct dev_stale_scan* scan = arg;
+    struct sr_ctx* context = scan->context;
+
+    if (old_sr->id == scan->service->id && !memcmp(&old_sr->port_gid, &context->dev->port_gid, sizeof(old_sr->port_gid)))
+        return 0;
+
+    sr_log_warn("Previous SR (id: 0x%" PRIx64 ") is not the same as new SR (id: 0x%" PRIx64 ")", old_sr->id, scan->service->id);
+    dev_unregister_txn_init(context->dev,
+                            &scan->deletes[(*scan->num_deletes)++],
+                            old_sr->id,
+                            (uint8_t*)old_sr->port_gid,
+                            scan->entry->service_key);
+    return 0;
+}
+
+/* Look up the records of one batch ID and queue DELETEs for those not on our port */
+static int dev_collect_stale_services(struct sr_ctx* context,
+                                      struct sr_sa_txn* scan,
+                                      struct sr_service_entry* entry,
+                                      struct sr_dev_service* service,
+                                      struct sr_sa_txn** deletes,
+                                      int* num_deletes)
+{
+    struct dev_stale_scan stale = {context, entry, service, NULL, num_deletes};
+    struct sr_sa_txn* grown;
+    int count = scan->status;
+
+    if (count > 0) {
+        grown = realloc(*deletes, (*num_deletes + count) * sizeof(**deletes));
+        if (!grown) {
+            free(scan->resp_data);
+            scan->resp_data = NULL;
+            return -ENOMEM;
+        }
+        *deletes = stale.deletes = grown;
+        dev_foreach_decoded(context, service->name, scan, count, dev_stale_service, &stale);
     }
 
-    if ((ret = umad_send(dev->portid, dev->agent, umad, sizeof(*sa_mad), dev->fabric_timeout_ms, 0)) < 0) {
-        sr_log_err("umad_send failed: %s. attr 0x%x method 0x%x", strerror(errno), attr, method);
-        goto out_free_umad;
+    free(scan->resp_data);
+    scan->resp_data = NULL;
+    return 0;
+}
+
+/* Stale records scans after registering a record service_cache_confirmed() found 'known' */
+static int stale_scan_rounds(struct sr_ctx* context, int known)
+{
+    if (known > 0)
+        return 0;
+    return known < 0 ? context->sr_retries : 1;
+}
+
+/*
+ * Remove previous services, whose ID and name match a registered entry but
+ * whose port GID is not ours. Each round has all lookups, then all DELETEs,
+ * in flight together. 'known' is service_cache_confirmed() of each entry:
+ * unchanged records (1) are skipped, and if all others replaced a record of
+ * ours (0) a single round is enough, as their first registration already
+ * looked until no stale records were left.
+ */
+static void dev_remove_stale_services(struct sr_ctx* context, struct sr_service_entry* entries, struct sr_dev_service* services,
+                                      const int* known, int num, uint64_t deadline)
+{
+    struct sr_dev* dev = context->dev;
+    struct sr_sa_txn *scans, *deletes = NULL;
+    int* scan_idx;
+    int num_scans, num_deletes, i, j, ret;
+    int dev_updated = 0, rounds = 1;
+
+    scans = calloc(num, sizeof(*scans));
+    scan_idx = calloc(num, sizeof(*scan_idx));
+    if (!scans || !scan_idx) {
+        sr_log_err("Failed to allocate stale records lookups");
+        goto out;
     }
 
-    /* Receive response */
-    do {
-        uint64_t mad_tid;
-
-        /* Receive one MAD */
-        len = sizeof(*sa_mad);
-        do {
-            if (!(newumad = realloc(umad, sizeof(*umad) + len))) {
-                sr_log_err("Unable to realloc umad");
-                goto out_free_umad;
-            } else {
-                umad = newumad;
-            }
-            ret = umad_recv(dev->portid, umad, &len, dev->fabric_timeout_ms);
-        } while (ret < 0 && errno == ENOSPC);
+    /* One lookup per distinct ID and name */
+    num_scans = 0;
+    for (i = 0; i < num; ++i) {
+        if (entries[i].status < 0 || known[i] > 0)
+            continue;
+        rounds = MAX(rounds, stale_scan_rounds(context, known[i]));
+        for (j = 0; j < num_scans; ++j)
+            if (services[scan_idx[j]].id == services[i].id && !strcmp(services[scan_idx[j]].name, services[i].name))
+                break;
+        if (j == num_scans)
+            scan_idx[num_scans++] = i;
+    }
 
-        if (ret < 0) {
-            sr_log_info("umad_recv returned %d (%s). attr 0x%x method 0x%x", ret, strerror(errno), attr, method);
-            goto out_free_umad;
+    for (int retry = 0, found = 1; retry < rounds && found; ++retry) {
+        for (i = 0; i < num_scans; ++i) {
+            dev_get_service_txn_init(context, &scans[i], services[scan_idx[i]].id, services[scan_idx[i]].name, context->sr_retries);
+            scans[i].deadline = deadline;
+            if ((ret = dev_sa_submit(dev, &scans[i])) < 0)
+                scans[i].status = ret;
         }
+        if (dev_sa_wait_all(dev, scans, num_scans) < 0)
+            break;
 
-        if ((ret = umad_status(umad)) < 0) {
-            ret = -EPROTO;
-            sr_log_err("umad_status failed: %d", ret);
-            goto out_free_umad;
+        /* Like dev_sa_query_retries(), refresh the port once if a lookup failed */
+        for (i = 0; i < num_scans && scans[i].status >= 0; ++i)
+            ;
+        if (i < num_scans && !dev_updated && scans[i].method == UMAD_SA_METHOD_GET_TABLE && !dev_update(dev)) {
+            sr_log_info("%s:%d device updated", dev->dev_name, dev->port_num);
+            SR_STAT_INC(dev->stats.dev_updates);
+            dev_updated = 1;
+            for (; i < num_scans; ++i) {
+                if (scans[i].status >= 0)
+                    continue;
+                dev_get_service_txn_init(context, &scans[i], services[scan_idx[i]].id, services[scan_idx[i]].name, context->sr_retries);
+                scans[i].deadline = deadline;
+                if ((ret = dev_sa_submit(dev, &scans[i])) < 0)
+                    scans[i].status = ret;
+            }
+            if (dev_sa_wait_all(dev, scans, num_scans) < 0)
+                break;
         }
 
-        match = 1;
-        sa_mad = (struct umad_sa_packet*)umad->data;
-        /* Check SubnAdm class */
-        if (sa_mad->mad_hdr.mgmt_class != UMAD_CLASS_SUBN_ADM) {
-            sr_log_warn("Mismatched MAD class: got %d, expected %d", sa_mad->mad_hdr.mgmt_class, UMAD_CLASS_SUBN_ADM);
-            match = 0;
+        num_deletes = 0;
+        for (i = 0; i < num_scans; ++i) {
+            if (dev_collect_stale_services(context, &scans[i], &entries[scan_idx[i]], &services[scan_idx[i]], &deletes, &num_deletes) < 0) {
+                sr_log_err("Failed to allocate stale records");
+                for (j = i + 1; j < num_scans; ++j)
+                    free(scans[j].resp_data);
+                num_deletes = 0;
+                break;
+            }
         }
 
-        /* Check MAD method */
-        if ((sa_mad->mad_hdr.method & ~UMAD_METHOD_RESP_MASK) != response_method) {
-            sr_log_info("Mismatched SA method: got 0x%x, expected 0x%x", sa_mad->mad_hdr.method & ~UMAD_METHOD_RESP_MASK, response_method);
-            match = 0;
-        }
-        if (!(sa_mad->mad_hdr.method & UMAD_METHOD_RESP_MASK)) {
-            sr_log_info("Not a Response MAD");
-            match = 0;
+        for (i = 0; i < num_deletes; ++i) {
+            deletes[i].deadline = deadline;
+            if ((ret = dev_sa_submit(dev, &deletes[i])) < 0)
+                deletes[i].status = ret;
         }
+        dev_sa_wait_all(dev, deletes, num_deletes);
 
-        /* Check MAD transaction ID. Cut it to 32 bits. */
-        mad_tid = (uint32_t)__be64_to_cpu(sa_mad->mad_hdr.tid);
-        if (mad_tid != tid) {
-            sr_log_info("Mismatched TID: got 0x%" PRIx64 ", expected 0x%" PRIx64, mad_tid, tid);
-            match = 0;
+        for (i = 0; i < num_deletes; ++i) {
+            uint64_t id = __be64_to_cpu(((struct sr_ib_service_record*)deletes[i].req_data)->service_id);
+
+            if (deletes[i].status < 0)
+                sr_log_warn("Couldn't unregister old SR with id 0x%016" PRIx64 ": %s", id, strerror(-deletes[i].status));
+            else
+                sr_log_info("Unregistered old service with id 0x%016" PRIx64, id);
         }
+        found = num_deletes;
+    }
 
-    } while (!match);
+out:
+    free(deletes);
+    free(scan_idx);
+    free(scans);
+}
+
+int sr_register_service(struct sr_ctx* context, const void* data, size_t data_size, const uint8_t (*service_key)[SR_128_BIT_SIZE])
+{
+    struct sr_service_entry entry = {.id = context->service_id, .service_key = service_key};
+    struct sr_dev_service service;
+    struct sr_ib_service_record record;
+    uint64_t deadline = call_deadline(context);
+    int ret, known;
 
-    /* Check MAD status */
-    if ((mad_status = __be16_to_cpu(sa_mad->mad_hdr.status))) {
-        report_sa_err(dev, mad_status, hide_errors);
-        goto out_free_umad;
+    ret = sr_prepare_ib_service_record(context, &service, &record, context->service_id, context->service_name, data, data_size, service_key);
+    if (ret < 0) {
+        return ret;
     }
 
-    /* Check MAD length */
-    if (len < offsetof(struct umad_sa_packet, data)) {
-        sr_log_err("MAD too short: %d bytes", len);
-        ret = -EPROTO;
-        goto out_free_umad;
+    /* The SA holds this very record already */
+    if ((known = service_cache_confirmed(context->dev, &record)) > 0) {
+        SR_STAT_INC(context->dev->stats.register_skips);
+        sr_log_debug("Service `%s' id 0x%016" PRIx64 " is already registered", service.name, service.id);
+        return 0;
     }
-    data_size = len - offsetof(struct umad_sa_packet, data);
 
-    /* Calculate record size */
-    record_size = __be16_to_cpu(sa_mad->attr_offset) * 8;
-    if (method == UMAD_SA_METHOD_GET_TABLE) {
-        num_records = record_size ? (data_size / record_size) : 0;
+    /* Register/replace new service */
+    if ((ret = dev_register_service(context->dev, &record, deadline)) < 0) {
+        sr_log_err("Couldn't register new SR (%d)", ret);
+        return ret;
     } else {
-        num_records = 1;
+        sr_log_debug("Registered new service, with id 0x%llx", record.service_id);
+        service_cache_save(context->dev, &record);
+        lease_track(context, &record);
+        query_cache_invalidate(context, service.id);
+        snapshot_expire(context);
+        sr_log_info("Service `%s' id 0x%016" PRIx64 " is registered", service.name, service.id);
     }
 
-    /* Copy data to a new buffer */
-    if (resp_data) {
-        if (!(*resp_data = malloc(data_size))) {
-            ret = -ENOMEM;
-            goto out_free_umad;
-        }
-        memcpy(*resp_data, sa_mad->data, data_size);
-    }
+    /* Remove previous services, whose ID and port GID are not ours */
+    dev_remove_stale_services(context, &entry, &service, &known, 1, deadline);
+
+    return 0;
+}
 
-    if (resp_attr_size) {
-        *resp_attr_size = record_size;
+int sr_register_services(struct sr_ctx* context, struct sr_service_entry* entries, int num)
+{
+    struct sr_dev_service* services;
+    struct sr_sa_txn* txns;
+    struct sr_ib_service_record record;
+    uint64_t deadline = call_deadline(context);
+    int registered = 0;
+    int* known;
+    int i, ret;
+
+    if (num <= 0)
+        return 0;
+
+    services = calloc(num, sizeof(*services));
+    txns = calloc(num, sizeof(*txns));
+    known = calloc(num, sizeof(*known));
+    if (!services || !txns || !known) {
+        sr_log_err("Failed to allocate %d service registrations", num);
+        free(services);
+        free(txns);
+        free(known);
+        return -ENOMEM;
     }
 
-    ret = num_records;
+    /* All SETs go out back to back, responses are matched by TID */
+    for (i = 0; i < num; ++i) {
+        struct sr_service_entry* entry = &entries[i];
+
+        entry->status = sr_prepare_ib_service_record(context,
+                                                     &services[i],
+                                                     &record,
+                                                     entry->id ? entry->id : context->service_id,
+                                                     entry->name ? entry->name : context->service_name,
+                                                     entry->data,
+                                                     entry->data_size,
+                                                     entry->service_key);
+        if (entry->status < 0) {
+            txns[i].status = entry->status;
+            continue;
+        }
 
-out_free_umad:
-    free(umad); /* release UMAD */
-out:
-    return ret;
-}
+        /* Unchanged records stay out of the batch */
+        if ((known[i] = service_cache_confirmed(context->dev, &record)) > 0) {
+            SR_STAT_INC(context->dev->stats.register_skips);
+            continue;
+        }
 
-static int dev_sa_query(struct sr_dev* dev,
-                        int method,
-                        int attr,
-                        uint64_t comp_mask,
-                        void* req_data,
-                        int req_size,
-                        void** resp_data,
-                        int* resp_attr_size,
-                        int hide_errors)
-{
-    if (dev->mad_send_type == SR_MAD_SEND_UMAD) {
-        return umad_dev_sa_query(dev, method, attr, comp_mask, req_data, req_size, resp_data, resp_attr_size, hide_errors);
-    } else {
-        return verbs_dev_sa_query(dev, method, attr, comp_mask, req_data, req_size, resp_data, resp_attr_size, hide_errors);
+        dev_register_txn_init(&txns[i], &record);
+        txns[i].deadline = deadline;
+        if ((ret = dev_sa_submit(context->dev, &txns[i])) < 0)
+            txns[i].status = ret;
     }
-}
 
-static int dev_sa_query_retries(struct sr_dev* dev,
-                                int method,
-                                int attr,
-                                uint64_t comp_mask,
-                                void* req_data,
-                                int req_size,
-                                void** resp_data,
-                                int* resp_attr_size,
-                                int allow_zero,
-                                int retries,
-                                int hide_errors)
-{
-    int retries_orig = retries;
-    int ret, dev_updated = 0;
-    uint16_t prev_lid;
+    if ((ret = dev_sa_wait_all(context->dev, txns, num)) < 0)
+        sr_log_err("Batch registration interrupted: %s", strerror(-ret));
 
-retry:
-    for (;;) {
-        ret = dev_sa_query(dev, method, attr, comp_mask, req_data, req_size, resp_data, resp_attr_size, hide_errors);
-        retries--;
-        if (ret > 0 || (allow_zero && ret == 0) || retries <= 0) {
-            sr_log_debug("Found %d service records", ret);
-            break;
+    for (i = 0; i < num; ++i) {
+        if (entries[i].status < 0)
+            continue;
+
+        if (known[i] > 0) {
+            registered++;
+            continue;
         }
 
-        if (ret == 0) {
-            sr_log_info("sa_query() returned empty set, %d retries left", retries);
-            free(*resp_data);
-            *resp_data = NULL;
-        } else if (retries == 0) {
-            sr_log_err("Unable to query SR: %s, %d retries left", strerror(ret), retries);
+        if (txns[i].status < 0) {
+            sr_log_err("Couldn't register new SR 0x%016" PRIx64 " (%d)", services[i].id, txns[i].status);
+            entries[i].status = txns[i].status;
+            continue;
         }
 
-        usleep(dev->query_sleep);
+        service_cache_save(context->dev, (struct sr_ib_service_record*)txns[i].req_data);
+        lease_track(context, (struct sr_ib_service_record*)txns[i].req_data);
+        query_cache_invalidate(context, services[i].id);
+        snapshot_expire(context);
+        sr_log_info("Service `%s' id 0x%016" PRIx64 " is registered", services[i].name, services[i].id);
+        registered++;
     }
 
-    prev_lid = dev->port_lid;
-    if (ret < 0 && !dev_updated && method == UMAD_SA_METHOD_GET_TABLE && !services_dev_update(dev)) {
-        sr_log_info("%s:%d device updated", dev->dev_name, dev->port_num);
-        if (dev->port_lid != prev_lid){
-            sr_log_warn("%s:%d LID change", dev->dev_name, dev->port_num);
-        }
+    if (registered)
+        dev_remove_stale_services(context, entries, services, known, num, deadline);
 
-        retries = retries_orig;
-        dev_updated = 1;
-        goto retry;
+    free(known);
+    free(txns);
+    free(services);
+    return registered;
+}
+
+struct dev_unregister_scan
+{
+    struct sr_ctx* context;
+    struct sr_dev_service* srs;
+    int num;
+    int max;
+};
+
+static int dev_unregister_collect(const struct sr_dev_service* old_sr, void* arg)
+{
+    struct dev_unregister_scan* scan = arg;
+    struct sr_dev_service* grown;
+
+    if (old_sr->id != scan->context->service_id)
+        return 0;
+
+    if (scan->num == scan->max) {
+        grown = realloc(scan->srs, (scan->max ? 2 * scan->max : 16) * sizeof(*grown));
+        if (!grown) {
+            /* Those found so far are still removed */
+            sr_log_err("Failed to allocate records to unregister");
+            return -ENOMEM;
+        }
+        scan->srs = grown;
+        scan->max = scan->max ? 2 * scan->max : 16;
     }
+    scan->srs[scan->num++] = *old_sr;
+    return 0;
+}
 
-    if (ret < 0) {
-        sr_log_err("Failed to query SR: %s", strerror(-ret));
+int sr_unregister_service(struct sr_ctx* context, const uint8_t (*service_key)[SR_128_BIT_SIZE]) {
+    struct dev_unregister_scan scan = {context, NULL, 0, 0};
+    uint64_t deadline = call_deadline(context);
+    int failures = 0;
+
+    if (context->flags & SR_BULK_UNREGISTER) {
+        failures = dev_unregister_bulk(context, service_key, deadline);
+    } else {
+        lease_untrack(context, context->service_id, context->service_name);
+        dev_foreach_service(context, context->service_name, context->sr_retries, dev_unregister_collect, &scan, deadline);
+        failures = dev_unregister_burst(context->dev, scan.srs, scan.num, service_key, deadline);
+        free(scan.srs);
     }
+    query_cache_invalidate(context, context->service_id);
+    snapshot_expire(context);
 
-    return ret;
+    return failures;
 }
 
-static void save_service(struct sr_dev* dev, struct sr_dev_service* service)
+int sr_unregister_services(struct sr_ctx* context, const struct sr_dev_service* srs, int num, const uint8_t (*service_key)[SR_128_BIT_SIZE])
 {
-    for (int i = 0; i < SR_DEV_MAX_SERVICES; ++i)
-        if (dev->service_cache[i].id == service->id || dev->service_cache[i].id == 0) {
-            dev->service_cache[i] = *service;
-            sr_log_debug("Service 0x%016" PRIx64 " saved in cache %d", service->id, i);
+    int failures, i;
 
-            return;
-        }
+    for (i = 0; i < num; ++i)
+        lease_untrack(context, srs[i].id, srs[i].name);
 
-    sr_log_warn("No room to save service record '%s' id 0x%016" PRIx64, service->name, service->id);
+    failures = dev_unregister_burst(context->dev, srs, num, service_key, call_deadline(context));
+
+    for (i = 0; i < num; ++i)
+        query_cache_invalidate(context, srs[i].id);
+    if (num > 0)
+        snapshot_expire(context);
+
+    return failures;
 }
 
-static void remove_service(struct sr_dev* dev, uint64_t id)
+int sr_query_service_filter(struct sr_ctx* context, const struct sr_query_filter* filter, struct sr_dev_service* srs, int srs_num, int retries)
 {
-    int i, j;
+    const char* name = (filter->flags & SR_QUERY_FILTER_NAME && filter->name) ? filter->name : context->service_name;
+    struct sr_sa_txn txn;
+    int ret, arena;
 
-    for (i = 0; i < SR_DEV_MAX_SERVICES && dev->service_cache[i].id == id; ++i)
-        ;
-    if (i >= SR_DEV_MAX_SERVICES) {
-        sr_log_err("No service id 0x%016" PRIx64 " to remove from the cache", id);
-        return;
+    if (strlen(name) >= SR_DEV_SERVICE_NAME_MAX) {
+        sr_log_err("Service name too long: %zu bytes", strlen(name));
+        return -EINVAL;
     }
 
-    /* Replace index i with last service entry */
-    for (j = i; j < SR_DEV_MAX_SERVICES && dev->service_cache[j].id != 0; ++j)
-        ;
-    if (j < SR_DEV_MAX_SERVICES) {
-        dev->service_cache[i] = dev->service_cache[j];
-        dev->service_cache[j].id = 0;
-    }
-    sr_log_info("Service 0x%016" PRIx64 " removed from cache %d", id, i);
+    dev_query_txn_init(context, &txn, filter, retries < 0 ? SR_DEFAULT_RETRIES : retries);
+    txn.deadline = call_deadline(context);
+    arena = dev_arena_get(context, &txn);
+    ret = dev_sa_query_retries(context->dev, &txn);
+    if (ret >= 0)
+        ret = dev_decode_services(context, name, &txn, ret, srs, srs_num, !(filter->flags & SR_QUERY_FILTER_NAME));
+
+    if (arena)
+        dev_arena_put(context, &txn);
+    else
+        free(txn.resp_data);
+
+    return ret;
 }
 
-static int dev_register_service(struct sr_dev* dev, struct sr_ib_service_record* record)
+int sr_foreach_service(struct sr_ctx* context, int retries, sr_service_cb cb, void* arg)
 {
-    uint64_t comp_mask = BIT(0) | BIT(1) | BIT(2) | BIT(4) | BIT(6) | BIT(7) | BIT(8) | BIT(9) | BIT(10) | BIT(11) | BIT(12) | BIT(13) |
-                         BIT(14) | BIT(15) | BIT(16) | BIT(17) | BIT(18) | BIT(19) | BIT(19) | BIT(20) | BIT(21) | BIT(22) | BIT(23) |
-                         BIT(24) | BIT(25) | BIT(26) | BIT(27) | BIT(28) | BIT(29) | BIT(30) | BIT(31) | BIT(32) | BIT(33) | BIT(34) |
-                         BIT(35) | BIT(36); /* ServiceID, ServiceGID, ServicePKey, ServiceLease, ServiceName, and all ServiceData fields */
+    return dev_foreach_service(context, context->service_name, retries < 0 ? SR_DEFAULT_RETRIES : retries, cb, arg,
+                               call_deadline(context));
+}
 
-    if (*(record->service_key)) {
-        comp_mask |= BIT(5);
-    }
-    int ret;
-    ret = dev_sa_query_retries(dev,
-                               UMAD_METHOD_SET,
-                               UMAD_SA_ATTR_SERVICE_REC,
-                               comp_mask,
-                               record,
-                               sizeof(*record),
-                               NULL,
-                               NULL,
-                               1,
-                               SR_DEV_SERVICE_REGISTER_RETRIES,
-                               0);
-    if (ret < 0)
+int sr_query_service(struct sr_ctx* context, struct sr_dev_service* srs, int srs_num, int retries)
+{
+    uint64_t deadline = call_deadline(context);
+    int try = retries;
+
+    if (retries < 0)
+        try = SR_DEFAULT_RETRIES;
+
+    int ret = query_cache_lookup(context, context->service_id, context->service_name, srs, srs_num);
+    if (ret >= 0)
         return ret;
 
-    return 0;
+    ret = snapshot_lookup(context, srs, srs_num, try, deadline);
+    if (ret != -ENOENT)
+        return ret;
+
+    return dev_get_service(context, context->service_name, srs, srs_num, try, 0, deadline);
 }
 
-static int dev_unregister_service(struct sr_dev* dev, uint64_t id, uint8_t* port_gid, const uint8_t (*service_key)[16])
+/* Drop records of other names, moving the rest down in place */
+static int dev_compact_services(const char* name, struct sr_sa_txn* txn, int num_records)
 {
-    struct sr_ib_service_record record;
-    uint64_t comp_mask = BIT(0) | BIT(1) | BIT(2);
-    int ret;
+    uint64_t bitmap[SR_DECODE_BATCH / 64];
+    int base, num, i, j = 0;
 
-    remove_service(dev, id);
+    for (base = 0; base < num_records; base += SR_DECODE_BATCH) {
+        num = MIN(num_records - base, SR_DECODE_BATCH);
+        dev_match_batch(name, txn, base, num, 0, bitmap);
 
-    memset(&record, 0, sizeof(record));
-    record.service_id = __cpu_to_be64(id);
-    record.service_pkey = __cpu_to_be16(dev->pkey);
-    if (port_gid)
-        memcpy(&record.service_gid, port_gid, sizeof(record.service_gid));
-    else
-        memcpy(&record.service_gid, &dev->port_gid, sizeof(record.service_gid));
+        for (i = dev_next_match(bitmap, num, 0); i >= 0; i = dev_next_match(bitmap, num, i + 1)) {
+            if (base + i != j)
+                memmove((char*)txn->resp_data + j * txn->record_size, (char*)txn->resp_data + (base + i) * txn->record_size,
+                        txn->record_size);
+            j++;
+        }
+    }
 
-    if (service_key) {
-        memcpy(&record.service_key, service_key, sizeof(record.service_key));
-        comp_mask |= BIT(5);
+    return j;
+}
+
+int sr_query_service_view(struct sr_ctx* context, void* buf, size_t buf_size, int retries, struct sr_service_view* view)
+{
+    struct sr_sa_txn txn;
+    int ret, arena = 0;
+
+    memset(view, 0, sizeof(*view));
+    dev_get_service_txn_init(context, &txn, context->service_id, context->service_name, retries < 0 ? SR_DEFAULT_RETRIES : retries);
+    txn.deadline = call_deadline(context);
+    if (buf) {
+        txn.resp_buf = buf;
+        txn.resp_buf_size = buf_size;
+    } else if (!(arena = dev_arena_get(context, &txn))) {
+        return -EBUSY;
     }
 
-    if ((ret = dev_sa_query_retries(dev,
-                                    UMAD_SA_METHOD_DELETE,
-                                    UMAD_SA_ATTR_SERVICE_REC,
-                                    comp_mask,
-                                    &record,
-                                    sizeof(record),
-                                    NULL,
-                                    NULL,
-                                    1,
-                                    SR_DEV_SERVICE_REGISTER_RETRIES,
-                                    0)) < 0)
-        return ret;
+    ret = dev_sa_query_retries(context->dev, &txn);
+    if (ret < 0)
+        goto out;
 
-    sr_log_info("Service 0x%016" PRIx64 " unregistered", id);
+    view->size = txn.resp_size;
+    if (buf && txn.resp_data && txn.resp_data != buf) {
+        free(txn.resp_data);
+        txn.resp_data = NULL;
+        ret = -ENOBUFS;
+        goto out;
+    }
 
-    return 0;
+    view->num = dev_compact_services(context->service_name, &txn, ret);
+    view->record_size = txn.record_size;
+    view->size = view->num * txn.record_size;
+    view->records = txn.resp_data;
+    ret = view->num;
+
+out:
+    if (arena) {
+        dev_arena_put(context, &txn);
+        if (ret >= 0)
+            view->records = context->arena;
+    }
+    return ret;
 }
 
-static void fill_dev_service_from_ib_service_record(struct sr_dev_service* service, struct sr_ib_service_record* record)
+#define SR_VIEW_FIELD(view, i, field) \
+    ((const char*)(view)->records + (i) * (view)->record_size + offsetof(struct sr_ib_service_record, field))
+
+uint64_t sr_view_id(const struct sr_service_view* view, int i)
 {
-    //size_t name_len;
-    service->id = __be64_to_cpu(record->service_id);
-    //name_len = strnlen(record->service_name, sizeof(service->name) - 1);
-    //memcpy(service->name, record->service_name, name_len);
-    //memcpy(record->service_name, service->name, strnlen(service->name, sizeof(record->service_name) - 1));
-    //memcpy(service->name, record->service_name, strnlen(record->service_name, sizeof(service->name) - 1));
-    //strncpy(service->name, record->service_name, sizeof(service->name)-1);
-    //service->name[sizeof(service->name)-1] = '\0';
-    snprintf(service->name, sizeof(service->name), "%s", record->service_name);
-    memcpy(service->data, &record->service_data, sizeof(service->data));
-    memcpy(service->port_gid, record->service_gid, sizeof(service->port_gid));
+    __be64 id;
+
+    memcpy(&id, SR_VIEW_FIELD(view, i, service_id), sizeof(id));
+    return __be64_to_cpu(id);
 }
 
-static int dev_get_service(struct sr_ctx* context, const char* name, struct sr_dev_service* services, int max, int retries, int just_copy)
+const char* sr_view_name(const struct sr_service_view* view, int i, size_t* len)
 {
-    struct sr_ib_service_record* response;
-    void* raw_data = NULL;
-    int record_size = 0;
-    int i, j;
+    const char* name = SR_VIEW_FIELD(view, i, service_name);
 
-    // Query for the record of SHARP, so we don't get many records not related to us
-    struct sr_ib_service_record record;
-    uint64_t comp_mask = BIT(0);   // ServiceID
-    memset(&record, 0, sizeof(record));
-    record.service_id = __cpu_to_be64(context->service_id);
-
-    int method = (context->dev->mad_send_type == SR_MAD_SEND_UMAD ? UMAD_SA_METHOD_GET_TABLE : UMAD_METHOD_GET);
-    int ret = dev_sa_query_retries(context->dev,
-                                   method,
-                                   UMAD_SA_ATTR_SERVICE_REC,
-                                   comp_mask,
-                                   NULL,
-                                   0,
-                                   &raw_data,
-                                   &record_size,
-                                   0,
-                                   retries,
-                                   context->flags & SR_HIDE_ERRORS);
-    if (ret < 0)
-        return ret;
+    if (len)
+        *len = strnlen(name, sizeof(((struct sr_ib_service_record*)0)->service_name));
+    return name;
+}
 
-    for (i = 0, j = 0; i < ret && j < max; ++i) {
-        response = (struct sr_ib_service_record*)((char*)raw_data + i * record_size);
+const uint8_t* sr_view_port_gid(const struct sr_service_view* view, int i)
+{
+    return (const uint8_t*)SR_VIEW_FIELD(view, i, service_gid);
+}
 
-        if (just_copy || (strlen(response->service_name) == strlen(name) && !strcmp(response->service_name, name))) {
-            fill_dev_service_from_ib_service_record(&services[j], response);
-            services[j].lease = context->sr_lease_time;
-            sr_log_debug("Found SR: (%d) %s 0x%016" PRIx64, j, services[j].name, services[j].id);
-            j++;
-        }
-    }
-    free(raw_data);
+const uint8_t* sr_view_data(const struct sr_service_view* view, int i)
+{
+    return (const uint8_t*)SR_VIEW_FIELD(view, i, service_data);
+}
 
-    return j;
+uint32_t sr_view_lease(const struct sr_service_view* view, int i)
+{
+    __be32 lease;
+
+    memcpy(&lease, SR_VIEW_FIELD(view, i, service_lease), sizeof(lease));
+    return __be32_to_cpu(lease);
 }
 
-static int guid2dev(uint64_t guid, char* dev_name, int* port)
+enum
+{
+    SR_REQUEST_REGISTER,
+    SR_REQUEST_UNREGISTER,
+    SR_REQUEST_QUERY,
+};
+
+struct sr_request
+{
+    struct sr_ctx* context;
+    int type;
+    int status;                  /* -EINPROGRESS until completed */
+    int auto_free;               /* No handle was returned to the caller */
+    sr_request_cb cb;
+    void* arg;
+    struct sr_dev_service service;
+    int has_key;
+    uint8_t service_key[SR_128_BIT_SIZE];
+    struct sr_sa_txn txn;        /* SET or GET_TABLE */
+    struct sr_sa_txn* deletes;   /* DELETEs of the current cleanup round */
+    int num_deletes;
+    int pending_deletes;
+    int rounds;                  /* Stale records scans done */
+    int max_rounds;              /* Stale records scans to do, see stale_scan_rounds() */
+    unsigned cache_epoch;        /* Query cache epoch when the scan was sent */
+    int failures;                /* DELETEs that failed */
+    struct sr_dev_service* srs;  /* Query results */
+    int num_srs;
+};
+
+static void request_finish(struct sr_request* req, int status)
 {
-    char ca_names_array[UMAD_MAX_DEVICES][UMAD_CA_NAME_LEN];
-    char dev_name_buf[UMAD_CA_NAME_LEN];
-    umad_guid_t pguids_array[UMAD_CA_MAX_PORTS + 1];
-    umad_guid_t unique_pguids[UMAD_CA_MAX_PORTS + 1];   // unique port guids on device
-    size_t unique_pguids_num[UMAD_CA_MAX_PORTS + 1];    // amount of port guid on device
-    size_t unique_pguids_num_idx[UMAD_CA_MAX_PORTS + 1];
-    int ca_num = 0, pguid_num = 0;
-    int ca_idx, port_num_idx, unique_pguid_idx = 0;
-    umad_ca_t umad_ca;
+    req->status = status;
+    if (req->cb)
+        req->cb(req, status, req->arg);
+    if (req->auto_free)
+        sr_request_free(req);
+}
 
-    if (!dev_name || !port) {
-        sr_log_err("device name or port number parameters were not specified");
-        return -1;
+static void request_scan(struct sr_request* req);
+
+static void request_delete_done(struct sr_sa_txn* txn)
+{
+    struct sr_request* req = txn->arg;
+    uint64_t id = __be64_to_cpu(((struct sr_ib_service_record*)txn->req_data)->service_id);
+
+    if (txn->status < 0) {
+        sr_log_warn("Couldn't unregister old SR with id 0x%016" PRIx64 ": %s", id, strerror(-txn->status));
+        req->failures++;
+    } else {
+        sr_log_info("Unregistered old service with id 0x%016" PRIx64, id);
+        query_cache_invalidate(req->context, id);
+        snapshot_expire(req->context);
     }
 
-    /* if guid is zero, find the first active port */
-    if (!guid) {
-        strcpy(dev_name, "");
-        *port = 0;
-        goto found;
+    if (--req->pending_deletes)
+        return;
+
+    /* Registration keeps scanning until no stale records are left */
+    if (req->type == SR_REQUEST_REGISTER && ++req->rounds < req->max_rounds)
+        request_scan(req);
+    else
+        request_finish(req, req->type == SR_REQUEST_REGISTER ? 0 : req->failures);
+}
+
+static void request_scan_done(struct sr_sa_txn* txn)
+{
+    struct sr_request* req = txn->arg;
+    struct sr_ctx* context = req->context;
+    const uint8_t(*service_key)[SR_128_BIT_SIZE] = req->has_key ? &req->service_key : NULL;
+    struct sr_dev_service* srs = NULL;
+    int count = txn->status;
+
+    if (req->type == SR_REQUEST_QUERY)
+        query_cache_store(context, context->service_id, context->service_name, txn, req->cache_epoch);
+
+    if (count > 0) {
+        srs = calloc(count, sizeof(*srs));
+        if (!srs) {
+            free(txn->resp_data);
+            request_finish(req, -ENOMEM);
+            return;
+        }
+        count = dev_decode_services(context, context->service_name, txn, count, srs, count, 0);
     }
+    free(txn->resp_data);
+    txn->resp_data = NULL;
 
-    /* get all local cas */
-    if ((ca_num = umad_get_cas_names(ca_names_array, UMAD_MAX_DEVICES)) < 0) {
-        sr_log_err("unable to umad_get_cas_names");
-        return 1;
+    if (req->type == SR_REQUEST_QUERY) {
+        req->srs = srs;
+        req->num_srs = count > 0 ? count : 0;
+        request_finish(req, count);
+        return;
     }
 
-    /* check for requested guid */
-    for (ca_idx = 0; ca_idx < ca_num; ca_idx++) {
-        pguid_num = umad_get_ca_portguids(ca_names_array[ca_idx], pguids_array, UMAD_CA_MAX_PORTS + 1);
-        if (pguid_num < 0) {
-            sr_log_err("unable to umad_get_ca_portguids");
-            return 1;
-        }
+    free(req->deletes);
+    req->deletes = count > 0 ? calloc(count, sizeof(*req->deletes)) : NULL;
+    req->num_deletes = 0;
+    for (int i = 0; i < count && req->deletes; ++i) {
+        struct sr_dev_service* old_sr = &srs[i];
 
-        memset(unique_pguids, 0, sizeof(unique_pguids));
-        memset(unique_pguids_num, 0, sizeof(unique_pguids_num));
-        memset(unique_pguids_num_idx, 0, sizeof(unique_pguids_num_idx));
-        unique_pguid_idx = 0;
-        int found_unique_guid = 0;
-        // go over all port guids and count unique guids
-        for (port_num_idx = 0; port_num_idx < UMAD_CA_MAX_PORTS + 1 && port_num_idx < pguid_num; port_num_idx++) {
-            found_unique_guid = 0;
-            for (unique_pguid_idx = 0; unique_pguids[unique_pguid_idx] != 0; unique_pguid_idx++) {
-                if (unique_pguids[unique_pguid_idx] != pguids_array[port_num_idx]) {
-                    continue;
-                }
-                found_unique_guid = 1;
-                unique_pguids_num[unique_pguid_idx] += 1;
-                break;
-            }
-            if (found_unique_guid == 0) {   // if not found add new unique guid to set
-                unique_pguids[unique_pguid_idx] = pguids_array[port_num_idx];
-                unique_pguids_num[unique_pguid_idx] = 1;
-                unique_pguids_num_idx[unique_pguid_idx] = port_num_idx;
-            }
+        if (req->type == SR_REQUEST_REGISTER) {
+            if (old_sr->id == context->service_id && !memcmp(&old_sr->port_gid, &context->dev->port_gid, sizeof(old_sr->port_gid)))
+                continue;
+            sr_log_warn("Previous SR (id: 0x%" PRIx64 ") is not the same as new SR (id: 0x%" PRIx64 ")", old_sr->id, context->service_id);
+        } else if (old_sr->id != context->service_id) {
+            continue;
         }
 
-        // go over unique GUIDs and skip those that occur more than once.
-        for (unique_pguid_idx = 0; unique_pguids[unique_pguid_idx] != 0; unique_pguid_idx++) {
-            if (unique_pguids[unique_pguid_idx] != guid) {
-                continue;
-            }
-            if (unique_pguids_num[unique_pguid_idx] > 1) {
-                sr_log_info("skip %s guid 0x%" PRIx64 ": more than one same port guids", ca_names_array[ca_idx], guid);
-                continue;
-            }
-            strcpy(dev_name, ca_names_array[ca_idx]);
-            *port = unique_pguids_num_idx[unique_pguid_idx];
-            goto found;
+        struct sr_sa_txn* del = &req->deletes[req->num_deletes];
+        dev_unregister_txn_init(context->dev, del, old_sr->id, old_sr->port_gid, service_key);
+        del->complete = request_delete_done;
+        del->arg = req;
+        if (dev_sa_submit(context->dev, del) < 0) {
+            req->failures++;
+            continue;
         }
+        req->num_deletes++;
     }
+    free(srs);
 
-    sr_log_err("unable to find requested guid 0x%" PRIx64 "", guid);
+    if (count > 0 && !req->deletes) {
+        request_finish(req, -ENOMEM);
+        return;
+    }
 
-    return 1;
+    req->pending_deletes = req->num_deletes;
+    if (!req->pending_deletes)
+        request_finish(req, req->type == SR_REQUEST_REGISTER ? 0 : req->failures);
+}
 
-found:
-    /* validate that node is an IB node type */
-    if (strcmp(dev_name, "") == 0) {
-        if (umad_get_ca(NULL, &umad_ca) < 0) {
-            sr_log_err("unable to umad_get_ca");
-            return 1;
-        }
-    } else {
-        //strcpy(dev_name_buf, dev_name);
-        //strncpy(dev_name_buf, dev_name, sizeof(dev_name_buf) -1);
-        // snprintf(dev_name_buf, sizeof(dev_name_buf), "%s", dev_name);
-        // dev_name_buf[sizeof(dev_name_buf) -1] = '\0';
-        snprintf(dev_name_buf, sizeof(dev_name_buf), "%s", dev_name);
-        if (umad_get_ca(dev_name_buf, &umad_ca) < 0) {
-            sr_log_err("unable to umad_get_ca");
-            return 1;
-        }
+static void request_scan(struct sr_request* req)
+{
+    int ret;
+
+    dev_get_service_txn_init(req->context, &req->txn, req->context->service_id, req->context->service_name, req->context->sr_retries);
+    req->txn.complete = request_scan_done;
+    req->txn.arg = req;
+    req->cache_epoch = query_cache_epoch(req->context);
+    if ((ret = dev_sa_submit(req->context->dev, &req->txn)) < 0)
+        request_finish(req, req->type == SR_REQUEST_QUERY ? ret : 0);
+}
+
+static void request_register_done(struct sr_sa_txn* txn)
+{
+    struct sr_request* req = txn->arg;
+
+    if (txn->status < 0) {
+        sr_log_err("Couldn't register new SR (%d)", txn->status);
+        request_finish(req, txn->status);
+        return;
     }
 
-    if (umad_ca.node_type < 1 || umad_ca.node_type > 3) {
-        sr_log_err("Type %d of node \'%s\' is not an IB node type", umad_ca.node_type, umad_ca.ca_name);
-        umad_release_ca(&umad_ca);
-        return 1;
+    service_cache_save(req->context->dev, (struct sr_ib_service_record*)txn->req_data);
+    lease_track(req->context, (struct sr_ib_service_record*)txn->req_data);
+    query_cache_invalidate(req->context, req->service.id);
+    snapshot_expire(req->context);
+    sr_log_info("Service `%s' id 0x%016" PRIx64 " is registered", req->service.name, req->service.id);
+
+    /* Remove previous services, whose ID and port GID are not ours */
+    request_scan(req);
+}
+
+static struct sr_request* request_alloc(struct sr_ctx* context, int type, sr_request_cb cb, void* arg, struct sr_request** request)
+{
+    struct sr_request* req = calloc(1, sizeof(*req));
+
+    if (!req) {
+        sr_log_err("Failed to allocate request");
+        return NULL;
     }
 
-    umad_release_ca(&umad_ca);
+    req->context = context;
+    req->type = type;
+    req->status = -EINPROGRESS;
+    req->cb = cb;
+    req->arg = arg;
+    req->auto_free = !request;
+    if (request)
+        *request = req;
 
-    return 0;
+    return req;
 }
 
-int sr_register_service(struct sr_ctx* context, const void* data, size_t data_size, const uint8_t (*service_key)[SR_128_BIT_SIZE])
+int sr_register_service_async(struct sr_ctx* context,
+                              const void* data,
+                              size_t data_size,
+                              const uint8_t (*service_key)[SR_128_BIT_SIZE],
+                              sr_request_cb cb,
+                              void* arg,
+                              struct sr_request** request)
 {
-    struct sr_dev_service old_srs[SRS_MAX];
-    struct sr_dev_service service;
     struct sr_ib_service_record record;
-    int count;
-    int ret;
+    struct sr_request* req;
+    int ret, known;
 
-    ret = sr_prepare_ib_service_record(context, &service, &record, data, data_size, service_key);
-    if (ret < 0) {
-        return ret;
+    if (context->dev->io)
+        return -ENOTSUP;
+
+    req = request_alloc(context, SR_REQUEST_REGISTER, cb, arg, request);
+    if (!req)
+        return -ENOMEM;
+
+    ret = sr_prepare_ib_service_record(
+        context, &req->service, &record, context->service_id, context->service_name, data, data_size, service_key);
+    if (ret < 0)
+        goto err;
+
+    if (service_key) {
+        memcpy(req->service_key, service_key, sizeof(req->service_key));
+        req->has_key = 1;
     }
 
-    /* Register/replace new service */
-    if ((ret = dev_register_service(context->dev, &record)) < 0) {
-        sr_log_err("Couldn't register new SR (%d)", ret);
-        return ret;
-    } else {
-        sr_log_debug("Registered new service, with id 0x%llx", record.service_id);
-        save_service(context->dev, &service);
-        sr_log_info("Service `%s' id 0x%016" PRIx64 " is registered", service.name, service.id);
+    /* Like sr_register_service(), the SA holds this very record already */
+    if ((known = service_cache_confirmed(context->dev, &record)) > 0) {
+        SR_STAT_INC(context->dev->stats.register_skips);
+        request_finish(req, 0);
+        return 0;
     }
+    req->max_rounds = stale_scan_rounds(context, known);
 
-    /* Remove previous services, whose ID and port GID are not ours */
-    for (int retry = 0, found = 1; retry < context->sr_retries && found; ++retry) {
-        count = dev_get_service(context, context->service_name, old_srs, SRS_MAX, context->sr_retries, 0);
-        found = 0;
-        for (int i = 0; i < count; ++i) {
-            struct sr_dev_service* old_sr = &old_srs[i];
+    dev_register_txn_init(&req->txn, &record);
+    req->txn.complete = request_register_done;
+    req->txn.arg = req;
+    if ((ret = dev_sa_submit(context->dev, &req->txn)) < 0)
+        goto err;
 
-            if (old_sr->id == context->service_id && !memcmp(&old_sr->port_gid, &context->dev->port_gid, sizeof(old_sr->port_gid))) {
-                continue;
-            } else {
-                // Print log message, convert the guids to ipv6 network address before printing
-                // char buf_guid1[INET6_ADDRSTRLEN];
-                // char buf_guid2[INET6_ADDRSTRLEN];
-                // inet_ntop(AF_INET6, (void*)&(old_sr->port_gid), buf_guid1, sizeof(buf_guid1));
-                // inet_ntop(AF_INET6, (void*)&(context->dev->port_gid), buf_guid2, sizeof(buf_guid2));
-
-                sr_log_warn("Previous SR (id: 0x%" PRIx64 ") is not the same as new SR (id: 0x%" PRIx64 ")",
-                            old_sr->id,
-                            context->service_id);
-            }
+    return 0;
 
-            found = 1;
-            if ((ret = dev_unregister_service(context->dev, old_sr->id, old_sr->port_gid, service_key)) < 0) {
-                sr_log_warn("Couldn't unregister old SR with id 0x%016" PRIx64 ": %s", old_sr->id, strerror(ret));
-            } else {
-                sr_log_info("Unregistered old service with id 0x%016" PRIx64, old_sr->id);
-            }
-        }
+err:
+    if (request)
+        *request = NULL;
+    free(req);
+    return ret;
+}
+
+int sr_unregister_service_async(struct sr_ctx* context,
+                                const uint8_t (*service_key)[SR_128_BIT_SIZE],
+                                sr_request_cb cb,
+                                void* arg,
+                                struct sr_request** request)
+{
+    struct sr_request* req;
+
+    if (context->dev->io)
+        return -ENOTSUP;
+
+    lease_untrack(context, context->service_id, context->service_name);
+    req = request_alloc(context, SR_REQUEST_UNREGISTER, cb, arg, request);
+    if (!req)
+        return -ENOMEM;
+
+    if (service_key) {
+        memcpy(req->service_key, service_key, sizeof(req->service_key));
+        req->has_key = 1;
     }
 
+    request_scan(req);
     return 0;
 }
 
-int sr_unregister_service(struct sr_ctx* context, const uint8_t (*service_key)[SR_128_BIT_SIZE]) {
-    struct sr_dev_service old_srs[SRS_MAX];
-    int result = 0;
-
-    int count = dev_get_service(context, context->service_name, old_srs,
-                                SRS_MAX, context->sr_retries, 0);
-
-    for (int i = 0; i < count; ++i) {
-        struct sr_dev_service* old_sr = &old_srs[i];
-
-        if (old_sr->id == context->service_id) {
-            int ret = dev_unregister_service(context->dev, old_sr->id, old_sr->port_gid, service_key);
-            if (ret < 0) {
-                sr_log_warn("Couldn't unregister old SR with id 0x%016" PRIx64 ": %s", old_sr->id, strerror(ret));
-                result++;
-            } else {
-                sr_log_info("Unregistered old service with id 0x%016" PRIx64, old_sr->id);
-            }
-        }
-    }
+int sr_query_service_async(struct sr_ctx* context, sr_request_cb cb, void* arg, struct sr_request** request)
+{
+    struct sr_request* req;
 
-    return result;
+    if (context->dev->io)
+        return -ENOTSUP;
+
+    req = request_alloc(context, SR_REQUEST_QUERY, cb, arg, request);
+    if (!req)
+        return -ENOMEM;
+
+    request_scan(req);
+    return 0;
 }
 
-int sr_query_service(struct sr_ctx* context, struct sr_dev_service* srs, int srs_num, int retries)
+int sr_request_status(struct sr_request* request)
 {
-    int try = retries;
+    return request->status;
+}
 
-    if (retries < 0)
-        try = SR_DEFAULT_RETRIES;
+int sr_request_services(struct sr_request* request, struct sr_dev_service* srs, int srs_num)
+{
+    int num = MIN(srs_num, request->num_srs);
+
+    if (request->status == -EINPROGRESS)
+        return -EINPROGRESS;
+
+    memcpy(srs, request->srs, num * sizeof(*srs));
+    return num;
+}
+
+void sr_request_free(struct sr_request* request)
+{
+    struct sr_dev* dev;
+
+    if (!request)
+        return;
+
+    dev = request->context->dev;
+    dev_sa_cancel(dev, &request->txn);
+    for (int i = 0; i < request->num_deletes; ++i)
+        dev_sa_cancel(dev, &request->deletes[i]);
+
+    free(request->txn.resp_data);
+    free(request->deletes);
+    free(request->srs);
+    free(request);
+}
 
-    return dev_get_service(context, context->service_name, srs, srs_num, try, 0);
+int sr_get_fd(struct sr_ctx* context)
+{
+    struct sr_dev* dev = context->dev;
+
+    if (!dev->transport->get_fd || dev->io)
+        return -ENOTSUP;
+
+    return dev->transport->get_fd(dev);
+}
+
+int sr_get_timeout(struct sr_ctx* context)
+{
+    if (context->dev->io)
+        return -ENOTSUP;
+
+    return dev_sa_next_timeout(context->dev);
+}
+
+int sr_progress(struct sr_ctx* context, int timeout_ms)
+{
+    if (context->dev->io)
+        return -ENOTSUP;
+
+    return dev_sa_progress(context->dev, timeout_ms);
 }
 
 void sr_printout_service(struct sr_dev_service* srs, int srs_num)
@@ -999,6 +1416,13 @@ static inline unsigned long get_timer(void)
     return tv.tv_sec * 1000000ULL + tv.tv_usec;
 }
 
+/* Contexts of other threads may be logging, and most sr_init() calls pass the same function */
+static void log_set(sr_log_func func)
+{
+    if (__atomic_load_n(&log_func, __ATOMIC_RELAXED) != func)
+        __atomic_store_n(&log_func, func, __ATOMIC_RELEASE);
+}
+
 int sr_init(struct sr_ctx** context, const char* dev_name, int port, sr_log_func log_func_in, struct sr_config* conf)
 {
     struct sr_ctx* ctx = NULL;
@@ -1035,16 +1459,20 @@ int sr_init(struct sr_ctx** context, const char* dev_name, int port, sr_log_func
         ret = -EINVAL;
         goto err;
     }
-    log_func = log_func_in;
+    log_set(log_func_in);
 
     /* Set default values */
     ctx->sr_lease_time = SR_DEFAULT_LEASE_TIME;
     ctx->sr_retries = SR_DEFAULT_RETRIES;
     ctx->dev->query_sleep = SR_DEFAULT_QUERY_SLEEP;
+    ctx->dev->query_sleep_max = SR_DEFAULT_QUERY_SLEEP_MAX;
+    ctx->dev->breaker_threshold = SR_DEFAULT_BREAKER_THRESHOLD;
+    ctx->dev->breaker_cooldown_ms = SR_DEFAULT_BREAKER_COOLDOWN;
     ctx->dev->sa_mkey = SR_DEFAULT_MKEY;
     ctx->dev->pkey = SR_DEFAULT_PKEY;
     ctx->dev->fabric_timeout_ms = SR_DEFAULT_FABRIC_TIMEOUT;
     ctx->dev->pkey_index = 0;
+    ctx->dev->completion_spin_us = SR_DEFAULT_COMPLETION_SPIN_US;
     ctx->service_name = strdup(SR_DEFAULT_SERVICE_NAME);
     if (!ctx->service_name) {
       sr_log_err("Failed to allocate default service name");
@@ -1085,6 +1513,9 @@ int sr_init(struct sr_ctx** context, const char* dev_name, int port, sr_log_func
         if (conf->sr_lease_time) ctx->sr_lease_time = conf->sr_lease_time;
         if (conf->sr_retries) ctx->sr_retries = conf->sr_retries;
         if (conf->query_sleep) ctx->dev->query_sleep = conf->query_sleep;
+        if (conf->query_sleep_max) ctx->dev->query_sleep_max = conf->query_sleep_max;
+        if (conf->breaker_threshold) ctx->dev->breaker_threshold = conf->breaker_threshold;
+        if (conf->breaker_cooldown_ms) ctx->dev->breaker_cooldown_ms = conf->breaker_cooldown_ms;
         if (conf->sa_mkey) ctx->dev->sa_mkey = conf->sa_mkey;
         if (conf->pkey) ctx->dev->pkey = conf->pkey;
         if (conf->fabric_timeout_ms) ctx->dev->fabric_timeout_ms = conf->fabric_timeout_ms;
@@ -1099,11 +1530,33 @@ int sr_init(struct sr_ctx** context, const char* dev_name, int port, sr_log_func
             ctx->dev->mad_send_type = conf->mad_send_type;
         }
         if (conf->flags) ctx->flags = conf->flags;
+        if (conf->loopback_latency_us) ctx->dev->loopback_latency_us = conf->loopback_latency_us;
+        if (conf->completion_mode) {
+            if (conf->completion_mode > SR_COMPLETION_LAST) {
+                sr_log_err("Invalid completion mode: %d", conf->completion_mode);
+                ret = -EINVAL;
+                goto err;
+            }
+            ctx->dev->completion_mode = conf->completion_mode;
+        }
+        if (conf->completion_spin_us) ctx->dev->completion_spin_us = conf->completion_spin_us;
+    }
+    if (ctx->flags & SR_NO_CIRCUIT_BREAKER)
+        ctx->dev->breaker_threshold = 0;
+    if (ctx->flags & SR_RATE_LIMIT_REJECT)
+        ctx->dev->rate_limit_reject = 1;
+    ctx->dev->rate_limited = rate_limit_configure(conf);
+    if (ctx->flags & SR_MULTI_PORT) {
+        ctx->dev->failover = 1;
+        snprintf(ctx->dev->failover_ca, sizeof(ctx->dev->failover_ca), "%s", dev_name ? dev_name : "");
     }
 
     /* Initialize device */
     ctx->dev->seed = get_timer();
-    memset(ctx->dev->service_cache, 0, sizeof(ctx->dev->service_cache));
+
+    ret = service_cache_init(ctx->dev);
+    if (ret)
+        goto err;
 
     ret = services_dev_init(ctx->dev, dev_name, port);
     if (ret) {
@@ -1111,6 +1564,17 @@ int sr_init(struct sr_ctx** context, const char* dev_name, int port, sr_log_func
         goto err;
     }
 
+    ret = query_cache_init(ctx, conf);
+    if (ret)
+        goto err;
+
+    ret = snapshot_init(ctx, conf);
+    if (ret)
+        goto err;
+
+    if (ctx->flags & SR_IO_THREAD && (ret = io_thread_start(ctx->dev)))
+        goto err;
+
     *context = ctx;
     return 0;
 
@@ -1124,23 +1588,51 @@ int sr_init_via_guid(struct sr_ctx** context, uint64_t guid, sr_log_func log_fun
     char hca[UMAD_CA_NAME_LEN];
     int port;
 
-    log_func = log_func_in;
-    if (guid2dev(guid, hca, &port))
+    log_set(log_func_in);
+    if (topology_find_guid(guid, hca, &port))
         return 1;
 
     return sr_init(context, hca, port, log_func_in, conf);
 }
 
+void sr_set_deadline(struct sr_ctx* context, unsigned timeout_ms)
+{
+    deadline_context = timeout_ms ? context : NULL;
+    deadline_armed = timeout_ms ? get_time_stamp() + timeout_ms * 1000ULL : 0;
+}
+
+/* Take the deadline armed for the blocking call starting now, it covers none after it */
+uint64_t call_deadline(struct sr_ctx* context)
+{
+    uint64_t deadline = 0;
+
+    if (deadline_context == context) {
+        deadline = deadline_armed;
+        deadline_context = NULL;
+        deadline_armed = 0;
+    }
+    return deadline;
+}
+
 int sr_cleanup(struct sr_ctx* context)
 {
     if (context) {
         if (context->dev) {
+            notice_cleanup(context);
+            query_cache_cleanup(context);
+            snapshot_cleanup(context);
+            io_thread_stop(context->dev);
+            if (context->dev->rate_limited)
+                rate_limit_release();
+            lease_cleanup(context);
             services_dev_cleanup(context->dev);
+            service_cache_cleanup(context->dev);
             free(context->dev);
         }
         if (context->service_name) {
             free(context->service_name);
         }
+        free(context->arena);
 
         free(context);
     }
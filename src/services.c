@@ -5,11 +5,16 @@
  * See file LICENSE for terms.
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 // #include <ib_mlx5_ifc.h>
@@ -25,10 +30,18 @@
 
 #include "services.h"
 
-static int dev_sa_init(struct sr_dev* dev)
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+static int dev_sa_init(struct sr_dev* dev, int port)
 {
+    long method_mask[16 / sizeof(long)];
     int err = 0;
 
+    /* Same as dev->port_num, set by ca_dev_open() */
+    (void)port;
+
     dev->portid = umad_open_port(dev->dev_name, dev->port_num);
     if (dev->portid < 0) {
         sr_log_warn("Unable to get umad ca %s port %d. %m", dev->dev_name, dev->port_num);
@@ -36,11 +49,20 @@ static int dev_sa_init(struct sr_dev* dev)
         goto out;
     }
 
-    if ((dev->agent = umad_register(dev->portid, UMAD_CLASS_SUBN_ADM, UMAD_SA_CLASS_VERSION, UMAD_RMPP_VERSION, NULL)) < 0) {
+    /* Receive unsolicited Reports for sr_subscribe(), unless another agent already does */
+    memset(method_mask, 0, sizeof(method_mask));
+    method_mask[UMAD_METHOD_REPORT / (8 * sizeof(long))] = 1UL << (UMAD_METHOD_REPORT % (8 * sizeof(long)));
+    dev->agent = umad_register(dev->portid, UMAD_CLASS_SUBN_ADM, UMAD_SA_CLASS_VERSION, UMAD_RMPP_VERSION, method_mask);
+    if (dev->agent < 0) {
+        sr_log_info("Unable to receive SA Reports on %s port %d, notifications disabled", dev->dev_name, dev->port_num);
+        dev->agent = umad_register(dev->portid, UMAD_CLASS_SUBN_ADM, UMAD_SA_CLASS_VERSION, UMAD_RMPP_VERSION, NULL);
+    }
+    if (dev->agent < 0) {
         sr_log_err("Unable to register UMAD_CLASS_SUBN_ADM");
         err = -errno;
         goto out_close_port;
     }
+    dev->report_qpn = 1;
 
     sr_log_info("Opened umad port to lid %u on %s port %d", dev->port_smlid, dev->dev_name, dev->port_num);
     goto out;
@@ -148,12 +170,47 @@ static int mad_qp_modify_qp_state(struct ibv_qp* qp, uint32_t port_num, uint16_t
     return 0;
 }
 
+static inline void* verbs_send_slot(struct sr_dev* dev, uint32_t slot)
+{
+    return (char*)dev->verbs.mad_buf + slot * SR_VERBS_MAD_SIZE;
+}
+
+static inline void* verbs_recv_slot(void* mad_buf, uint32_t slot)
+{
+    return (char*)mad_buf + SR_VERBS_SEND_DEPTH * SR_VERBS_MAD_SIZE + slot * SR_VERBS_RECV_SLOT_SIZE;
+}
+
+static int verbs_post_recv(struct ibv_qp* qp, struct ibv_mr* mr, uint32_t slot)
+{
+    struct ibv_recv_wr recv_wr, *bad_recv_wr;
+    int ret;
+
+    struct ibv_sge list = {
+        .addr = (uintptr_t)verbs_recv_slot(mr->addr, slot),
+        .length = SR_VERBS_RECV_SLOT_SIZE,
+        .lkey = mr->lkey,
+    };
+
+    recv_wr.wr_id = slot;
+    recv_wr.sg_list = &list;
+    recv_wr.num_sge = 1;
+    recv_wr.next = NULL;
+
+    ret = ibv_post_recv(qp, &recv_wr, &bad_recv_wr);
+    if (ret) {
+        sr_log_err("post recv failed: %d", ret);
+        return -ret;
+    }
+
+    return 0;
+}
+
 static int ib_open_port(struct sr_dev* dev, int port)
 {
     int i, ret;
-    struct ibv_device **dev_list, *ib_dev;
     struct ibv_context* context = NULL;
     struct ibv_pd* pd = NULL;
+    struct ibv_comp_channel* channel = NULL;
     struct ibv_cq* cq = NULL;
     struct ibv_qp* qp = NULL;
     struct ibv_ah* ah = NULL;
@@ -161,29 +218,13 @@ static int ib_open_port(struct sr_dev* dev, int port)
     struct ibv_qp_init_attr qp_init_attr;
     union ibv_gid sa_gid;
     long page_size = sysconf(_SC_PAGESIZE);
-    size_t mad_buf_size = 4096;
-
-    dev_list = ibv_get_device_list(NULL);
-    if (!dev_list) {
-        sr_log_err("no devices");
-        goto fail;
-    }
-
-    for (i = 0; dev_list[i]; i++) {
-        ib_dev = dev_list[i];
-        if (strcmp(ibv_get_device_name(dev_list[i]), dev->dev_name)) {
-            continue;
-        }
-
-        context = ibv_open_device(ib_dev);
-        break;
-    }
+    size_t mad_buf_size = SR_VERBS_SEND_DEPTH * SR_VERBS_MAD_SIZE + SR_VERBS_RECV_DEPTH * SR_VERBS_RECV_SLOT_SIZE;
 
+    context = topology_open_device(dev->dev_name);
     if (!context) {
         sr_log_err("unable to open device :%s", dev->dev_name);
         goto fail;
     }
-    ibv_free_device_list(dev_list);
 
     pd = ibv_alloc_pd(context);
     if (!pd) {
@@ -191,7 +232,18 @@ static int ib_open_port(struct sr_dev* dev, int port)
         goto fail;
     }
 
-    cq = ibv_create_cq(context, 1024, NULL, NULL, 0);
+    channel = ibv_create_comp_channel(context);
+    if (!channel) {
+        sr_log_err("ibv_create_comp_channel failed :%m");
+        goto fail;
+    }
+
+    if (fcntl(channel->fd, F_SETFL, fcntl(channel->fd, F_GETFL) | O_NONBLOCK) < 0) {
+        sr_log_err("unable to make completion channel non-blocking :%m");
+        goto fail;
+    }
+
+    cq = ibv_create_cq(context, 1024, NULL, channel, 0);
     if (!cq) {
         sr_log_err("ibv_create_cq failed :%m");
         goto fail;
@@ -201,8 +253,8 @@ static int ib_open_port(struct sr_dev* dev, int port)
 
     qp_init_attr.send_cq = cq;
     qp_init_attr.recv_cq = cq;
-    qp_init_attr.cap.max_send_wr = 2;
-    qp_init_attr.cap.max_recv_wr = 2;
+    qp_init_attr.cap.max_send_wr = SR_VERBS_SEND_DEPTH;
+    qp_init_attr.cap.max_recv_wr = SR_VERBS_RECV_DEPTH;
     qp_init_attr.cap.max_inline_data = 128;
     qp_init_attr.cap.max_send_sge = 2;
     qp_init_attr.cap.max_recv_sge = 2;
@@ -239,6 +291,18 @@ static int ib_open_port(struct sr_dev* dev, int port)
         goto fail;
     }
 
+    /* Keep the whole receive queue posted, responses may arrive back to back */
+    for (i = 0; i < SR_VERBS_RECV_DEPTH; i++) {
+        if (verbs_post_recv(qp, dev->verbs.mad_buf_mr, i)) {
+            goto fail;
+        }
+    }
+    dev->verbs.send_posted = 0;
+    dev->verbs.send_completed = 0;
+    dev->verbs.recv_head = 0;
+    dev->verbs.recv_tail = 0;
+    dev->verbs.recv_last = -1;
+
     memset(&ah_attr, 0, sizeof(ah_attr));
     ah_attr.dlid = dev->port_smlid;
     ah_attr.sl = 0;
@@ -259,8 +323,10 @@ static int ib_open_port(struct sr_dev* dev, int port)
 
     dev->verbs.context = context;
     dev->verbs.pd = pd;
+    dev->verbs.channel = channel;
     dev->verbs.cq = cq;
     dev->verbs.qp = qp;
+    dev->report_qpn = qp->qp_num;
     dev->verbs.sa_ah = ah;
 
     return 0;
@@ -281,6 +347,10 @@ fail:
         ibv_destroy_cq(cq);
     }
 
+    if (channel) {
+        ibv_destroy_comp_channel(channel);
+    }
+
     if (pd) {
         ibv_dealloc_pd(pd);
     }
@@ -304,18 +374,21 @@ static int open_port(struct sr_dev* dev, int port)
     if ((ret = umad_get_port(dev_name, port, &umad_port))) {
         dev->port_num = -1;
         sr_log_err("Unable to get umad ca %s port %d. %m", dev->dev_name, port);
+        topology_invalidate();
         return ret;
     }
 
     if (umad_port.state != IBV_PORT_ACTIVE) {
         sr_log_err("Port %d on %s is not active. port.state: %u", umad_port.portnum, dev->dev_name, umad_port.state);
         umad_release_port(&umad_port);
+        topology_invalidate();
         return -ENETDOWN;
     }
 
     if (!umad_port.sm_lid || umad_port.sm_lid > 0xBFFF) {
         sr_log_err("No SM found for port %d on %s", umad_port.portnum, dev->dev_name);
         umad_release_port(&umad_port);
+        topology_invalidate();
         return -ECONNREFUSED;
     }
 
@@ -348,15 +421,27 @@ static int open_port(struct sr_dev* dev, int port)
     return ret;
 }
 
-int services_dev_init(struct sr_dev* dev, const char* dev_name, int port)
+uint64_t get_time_stamp(void)
+{
+    uint64_t tstamp;
+    struct timespec ts;
+
+    /* Monotonic so timeouts survive clock adjustments, served from the vDSO */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    /* Convert into a microsecond timestamp. */
+    tstamp = ((uint64_t)ts.tv_sec) * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+
+    return (tstamp);
+}
+
+static int ca_dev_open(struct sr_dev* dev, const char* dev_name, int port, int (*open_fn)(struct sr_dev* dev, int port))
 {
     char ca_names[UMAD_MAX_DEVICES][UMAD_CA_NAME_LEN];
     int num_devices;
 
-    if ((num_devices = umad_get_cas_names(ca_names, UMAD_MAX_DEVICES)) < 0) {
-        sr_log_err("Unable to get CAs' list. %m");
-        return -errno;
-    }
+    if ((num_devices = topology_get_cas(ca_names, UMAD_MAX_DEVICES)) < 0)
+        return num_devices;
 
     for (int i = 0; i < num_devices; i++) {
         if (!dev_name || !strlen(dev_name) || !strcmp(ca_names[i], dev_name)) {
@@ -367,15 +452,8 @@ int services_dev_init(struct sr_dev* dev, const char* dev_name, int port)
             strcpy(dev->dev_name, "");
           }
 
-            if (!open_port(dev, port)) {
-                if (dev->mad_send_type == SR_MAD_SEND_VERBS || dev->mad_send_type == SR_MAD_SEND_VERBS_DEVX) {
-                    if (!ib_open_port(dev, port))
-                        return 0;
-                } else {
-                    if (!dev_sa_init(dev))
-                        return 0;
-                }
-            }
+            if (!open_port(dev, port) && !open_fn(dev, port))
+                return 0;
         } else
             sr_log_info("Skipping device `%s', expected `%s'", ca_names[i], dev_name);
     }
@@ -384,36 +462,639 @@ int services_dev_init(struct sr_dev* dev, const char* dev_name, int port)
     return -ENODEV;
 }
 
-int services_dev_update(struct sr_dev* dev)
+static int ca_dev_update(struct sr_dev* dev)
 {
     return open_port(dev, dev->port_num);
 }
 
-void services_dev_cleanup(struct sr_dev* dev)
+/* umad transport */
+
+static int umad_dev_open(struct sr_dev* dev, const char* dev_name, int port)
+{
+    return ca_dev_open(dev, dev_name, port, dev_sa_init);
+}
+
+static void umad_dev_close(struct sr_dev* dev)
+{
+    umad_unregister(dev->portid, dev->agent);
+    umad_close_port(dev->portid);
+    free(dev->umad.send_buf);
+    free(dev->umad.recv_buf);
+}
+
+static int umad_dev_send(struct sr_dev* dev, const struct umad_sa_packet* mad)
+{
+    struct ib_user_mad* umad = dev->umad.send_buf;
+    union ibv_gid sa_gid;
+    int ret;
+
+    if (!umad) {
+        umad = dev->umad.send_buf = (struct ib_user_mad*)calloc(1, sizeof(*umad) + sizeof(*mad));
+        if (!umad) {
+            sr_log_err("Cannot allocate memory for umad: %m");
+            return -ENOMEM;
+        }
+    }
+
+    umad->addr.qpn = __cpu_to_be32(1);
+    umad->addr.qkey = __cpu_to_be32(UMAD_QKEY);
+    umad->addr.pkey_index = dev->pkey_index;
+    umad->addr.lid = __cpu_to_be16(dev->port_smlid);
+    umad->addr.sl = 0;        /* !!! */
+    umad->addr.path_bits = 0; /* !!! */
+
+    sa_gid.global.subnet_prefix = dev->port_gid.global.subnet_prefix;
+    sa_gid.global.interface_id = __cpu_to_be64(SA_WELL_KNOWN_GUID);
+
+    umad->addr.grh_present = 1;
+    memcpy(&umad->addr.gid, sa_gid.raw, sizeof(umad->addr.gid));
+    memcpy(umad->data, mad, sizeof(*mad));
+
+    if ((ret = umad_send(dev->portid, dev->agent, umad, sizeof(*mad), dev->fabric_timeout_ms, 0)) < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+
+static int umad_dev_recv(struct sr_dev* dev, struct umad_sa_packet** mad, int* length, int timeout_ms)
+{
+    void* newumad;
+    int len, ret;
+
+    len = sizeof(**mad);
+    do {
+        if (len > dev->umad.recv_buf_len) {
+            if (!(newumad = realloc(dev->umad.recv_buf, sizeof(struct ib_user_mad) + len))) {
+                sr_log_err("Unable to realloc umad");
+                return -ENOMEM;
+            }
+            dev->umad.recv_buf = newumad;
+            dev->umad.recv_buf_len = len;
+        }
+        len = dev->umad.recv_buf_len;
+        ret = umad_recv(dev->portid, dev->umad.recv_buf, &len, timeout_ms);
+    } while (ret < 0 && errno == ENOSPC);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    if ((ret = umad_status(dev->umad.recv_buf)) < 0) {
+        sr_log_err("umad_status failed: %d", ret);
+        return -EPROTO;
+    }
+
+    *mad = (struct umad_sa_packet*)dev->umad.recv_buf->data;
+    *length = len;
+    return 0;
+}
+
+static int umad_dev_get_fd(struct sr_dev* dev)
+{
+    return umad_get_fd(dev->portid);
+}
+
+const struct sr_transport_ops sr_umad_transport = {
+    .name = "umad",
+    .caps = SR_TRANSPORT_CAP_TABLE | SR_TRANSPORT_CAP_PORTS,
+    .open = umad_dev_open,
+    .update = ca_dev_update,
+    .close = umad_dev_close,
+    .send = umad_dev_send,
+    .recv = umad_dev_recv,
+    .get_fd = umad_dev_get_fd,
+};
+
+/* verbs transport */
+
+static int verbs_dev_open(struct sr_dev* dev, const char* dev_name, int port)
+{
+    return ca_dev_open(dev, dev_name, port, ib_open_port);
+}
+
+static void verbs_ack_cq_events(struct sr_dev* dev)
+{
+    struct ibv_cq* ev_cq;
+    void* ev_ctx;
+
+    while (!ibv_get_cq_event(dev->verbs.channel, &ev_cq, &ev_ctx))
+        ibv_ack_cq_events(ev_cq, 1);
+}
+
+/* Reap a batch of completions: release send slots and queue received MADs */
+static int verbs_poll(struct sr_dev* dev)
+{
+    struct ibv_wc wc[SR_VERBS_POLL_BATCH];
+    int i, n;
+
+    n = ibv_poll_cq(dev->verbs.cq, SR_VERBS_POLL_BATCH, wc);
+    if (n < 0) {
+        sr_log_err("ibv_poll_cq failed");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            sr_log_err("ibv_poll_cq failed. status : %s (%d) ", ibv_wc_status_str(wc[i].status), wc[i].status);
+        }
+
+        if (wc[i].wr_id & SR_VERBS_SEND_WRID) {
+            sr_log_debug("MAD send completed");
+            dev->verbs.send_completed++;
+        } else if (wc[i].status != IBV_WC_SUCCESS) {
+            verbs_post_recv(dev->verbs.qp, dev->verbs.mad_buf_mr, wc[i].wr_id);
+        } else {
+            struct sr_ib_recv* recv = &dev->verbs.recv_ready[dev->verbs.recv_tail++ % SR_VERBS_RECV_DEPTH];
+
+            sr_log_debug("MAD recv completed len:%d ", wc[i].byte_len);
+            recv->slot = wc[i].wr_id;
+            recv->length = wc[i].byte_len;
+        }
+    }
+
+    return n;
+}
+
+/* Sleep on the completion channel until a CQ event arrives or timeout_ms passes */
+static int verbs_wait_event(struct sr_dev* dev, int timeout_ms)
+{
+    struct pollfd pfd = {.fd = dev->verbs.channel->fd, .events = POLLIN};
+
+    if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+        sr_log_err("poll on completion channel failed: %m");
+        return -errno;
+    }
+
+    /* Re-arm before the caller polls the CQ again, so no completion is missed */
+    verbs_ack_cq_events(dev);
+    if (ibv_req_notify_cq(dev->verbs.cq, 0)) {
+        sr_log_err("ibv_req_notify_cq failed");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int mad_recv(struct sr_dev* dev, void** buf, int* length, int timeout_ms)
+{
+    struct sr_ib_recv* recv;
+    uint64_t time, deadline, spin_until;
+    int ret;
+
+    /* The slot handed out by the previous call goes back to the receive queue */
+    if (dev->verbs.recv_last >= 0) {
+        verbs_post_recv(dev->verbs.qp, dev->verbs.mad_buf_mr, dev->verbs.recv_last);
+        dev->verbs.recv_last = -1;
+    }
+
+    dev->verbs.mad_start_time = get_time_stamp();
+    deadline = dev->verbs.mad_start_time + timeout_ms * 1000ULL;
+    switch (dev->completion_mode) {
+        case SR_COMPLETION_POLL:
+            spin_until = deadline;
+            break;
+        case SR_COMPLETION_EVENT:
+            spin_until = dev->verbs.mad_start_time;
+            break;
+        default:
+            spin_until = dev->verbs.mad_start_time + dev->completion_spin_us;
+            break;
+    }
+
+    /* Consume pending channel events and re-arm, so the channel fd reports the next completion */
+    verbs_ack_cq_events(dev);
+    if (ibv_req_notify_cq(dev->verbs.cq, 0)) {
+        sr_log_err("ibv_req_notify_cq failed");
+        return -EINVAL;
+    }
+
+    while (dev->verbs.recv_head == dev->verbs.recv_tail) {
+        if ((ret = verbs_poll(dev)) < 0) {
+            return ret;
+        }
+        if (ret) {
+            continue;
+        }
+
+        time = get_time_stamp();
+
+        if (time >= deadline) {
+            return -ETIMEDOUT;
+        }
+
+        if (time >= spin_until && (ret = verbs_wait_event(dev, (deadline - time + 999) / 1000)) < 0) {
+            return ret;
+        }
+    }
+
+    recv = &dev->verbs.recv_ready[dev->verbs.recv_head++ % SR_VERBS_RECV_DEPTH];
+    dev->verbs.recv_last = recv->slot;
+    *buf = (char*)verbs_recv_slot(dev->verbs.mad_buf, recv->slot) + IB_GRH_LEN;
+    *length = recv->length - IB_GRH_LEN;
+    return 0;
+}
+
+static int mad_send(struct sr_dev* dev, const void* mad, size_t length)
 {
-    if (dev->mad_send_type == SR_MAD_SEND_VERBS || dev->mad_send_type == SR_MAD_SEND_VERBS_DEVX) {
-        if (dev->verbs.sa_ah)
-            ibv_destroy_ah(dev->verbs.sa_ah);
+    struct ibv_sge sge;
+    struct ibv_send_wr send_wr, *bad_send_wr;
+    uint32_t slot;
+    int ret;
+
+    /* Wait for a free send slot, UD sends complete at wire speed */
+    while (dev->verbs.send_posted - dev->verbs.send_completed >= SR_VERBS_SEND_DEPTH) {
+        if ((ret = verbs_poll(dev)) < 0) {
+            return ret;
+        }
+    }
 
-        if (dev->verbs.mad_buf_mr)
-            ibv_dereg_mr(dev->verbs.mad_buf_mr);
+    slot = dev->verbs.send_posted % SR_VERBS_SEND_DEPTH;
+    memcpy(verbs_send_slot(dev, slot), mad, length);
+
+    sge.length = length;
+    sge.lkey = dev->verbs.mad_buf_mr->lkey;
+    sge.addr = (uintptr_t)verbs_send_slot(dev, slot);
+
+    send_wr.next = NULL;
+    send_wr.sg_list = &sge;
+    send_wr.num_sge = 1;
+    send_wr.opcode = IBV_WR_SEND;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    send_wr.wr_id = SR_VERBS_SEND_WRID | slot;
+    send_wr.imm_data = htonl(dev->verbs.qp->qp_num);
+    send_wr.wr.ud.ah = dev->verbs.sa_ah;
+    send_wr.wr.ud.remote_qpn = 1;
+    send_wr.wr.ud.remote_qkey = UMAD_QKEY;
+
+    ret = ibv_post_send(dev->verbs.qp, &send_wr, &bad_send_wr);
+    if (ret) {
+        sr_log_err("post send failed");
+        return -ret;
+    }
 
-        if (dev->verbs.mad_buf)
-            free(dev->verbs.mad_buf);
+    dev->verbs.send_posted++;
+    return 0;
+}
 
-        if (dev->verbs.qp)
-            ibv_destroy_qp(dev->verbs.qp);
+static int verbs_dev_send(struct sr_dev* dev, const struct umad_sa_packet* mad)
+{
+    return mad_send(dev, mad, sizeof(*mad));
+}
 
-        if (dev->verbs.cq)
-            ibv_destroy_cq(dev->verbs.cq);
+/*
+ * RMPP receiver for multi-MAD (GET_TABLE) responses, as done by the kernel MAD
+ * layer for umad. Every segment repeats the SA header; the reassembled MAD is
+ * the first segment followed by the SA data of the others.
+ */
+struct sr_rmpp_recv
+{
+    struct sr_rmpp_recv* next;
+    uint64_t tid;
+    uint32_t seg_num;    /* Last segment received in order */
+    uint32_t newwin;     /* Last segment of the granted window */
+    uint64_t last_active; /* usec */
+    size_t size;
+    struct umad_sa_packet* mad;
+};
+
+static void verbs_rmpp_free(struct sr_ib_dev* verbs, struct sr_rmpp_recv* rmpp)
+{
+    struct sr_rmpp_recv** p;
 
-        if (dev->verbs.pd)
-            ibv_dealloc_pd(dev->verbs.pd);
+    for (p = &verbs->rmpp; *p; p = &(*p)->next) {
+        if (*p == rmpp) {
+            *p = rmpp->next;
+            break;
+        }
+    }
+    free(rmpp->mad);
+    free(rmpp);
+}
 
-        if (dev->verbs.context)
-            ibv_close_device(dev->verbs.context);
-    } else {
-        umad_unregister(dev->portid, dev->agent);
-        umad_close_port(dev->portid);
+static void verbs_rmpp_ack(struct sr_dev* dev, const struct umad_sa_packet* seg, uint32_t seg_num, uint32_t newwin)
+{
+    struct umad_sa_packet ack;
+
+    memset(&ack, 0, sizeof(ack));
+    ack.mad_hdr = seg->mad_hdr;
+    ack.mad_hdr.method ^= UMAD_METHOD_RESP_MASK;
+    ack.rmpp_hdr.rmpp_version = UMAD_RMPP_VERSION;
+    ack.rmpp_hdr.rmpp_type = UMAD_RMPP_TYPE_ACK;
+    ack.rmpp_hdr.rmpp_rtime_flags = UMAD_RMPP_FLAG_ACTIVE;
+    ack.rmpp_hdr.seg_num = __cpu_to_be32(seg_num);
+    ack.rmpp_hdr.paylen_newwin = __cpu_to_be32(newwin);
+
+    if (mad_send(dev, &ack, sizeof(ack)) < 0)
+        sr_log_warn("RMPP ACK of segment %u failed", seg_num);
+}
+
+/* Drop reassemblies whose transaction has long timed out */
+static void verbs_rmpp_expire(struct sr_dev* dev, uint64_t now)
+{
+    struct sr_rmpp_recv *rmpp, *next;
+
+    for (rmpp = dev->verbs.rmpp; rmpp; rmpp = next) {
+        next = rmpp->next;
+        if (now - rmpp->last_active > SR_VERBS_RMPP_IDLE_MS * 1000ULL) {
+            sr_log_info("RMPP reassembly of TID 0x%" PRIx64 " timed out at segment %u", rmpp->tid, rmpp->seg_num);
+            verbs_rmpp_free(&dev->verbs, rmpp);
+        }
+    }
+}
+
+/*
+ * Handle one RMPP segment. Returns 1 and the reassembled MAD once the last
+ * segment is in, 0 if more segments are expected.
+ */
+int verbs_rmpp_recv(struct sr_dev* dev, struct umad_sa_packet* seg, int len, struct umad_sa_packet** mad, int* length)
+{
+    const size_t hdr_size = offsetof(struct umad_sa_packet, data);
+    struct umad_rmpp_hdr hdr = seg->rmpp_hdr;
+    uint64_t tid = __be64_to_cpu(seg->mad_hdr.tid);
+    uint64_t now = get_time_stamp();
+    struct sr_rmpp_recv* rmpp;
+    uint32_t seg_num = __be32_to_cpu(hdr.seg_num);
+    size_t need;
+    int pad;
+
+    for (rmpp = dev->verbs.rmpp; rmpp && rmpp->tid != tid; rmpp = rmpp->next)
+        ;
+
+    if (hdr.rmpp_type != UMAD_RMPP_TYPE_DATA) {
+        /* STOP or ABORT from the sender, the transaction will time out and retry */
+        sr_log_info("RMPP %s for TID 0x%" PRIx64 ", status %u", hdr.rmpp_type == UMAD_RMPP_TYPE_ABORT ? "ABORT" : "STOP",
+                    tid, hdr.rmpp_status);
+        if (rmpp)
+            verbs_rmpp_free(&dev->verbs, rmpp);
+        return 0;
+    }
+
+    if (hdr.rmpp_rtime_flags & UMAD_RMPP_FLAG_FIRST) {
+        if (seg_num != 1)
+            return 0;
+        if (rmpp)
+            verbs_rmpp_free(&dev->verbs, rmpp);
+        verbs_rmpp_expire(dev, now);
+
+        rmpp = calloc(1, sizeof(*rmpp));
+        if (!rmpp)
+            return 0;
+        rmpp->tid = tid;
+        rmpp->next = dev->verbs.rmpp;
+        dev->verbs.rmpp = rmpp;
+    } else if (!rmpp) {
+        return 0;
+    } else if (seg_num != rmpp->seg_num + 1) {
+        /* Duplicate or out of order, re-ACK so the sender resends from the right segment */
+        if (seg_num <= rmpp->seg_num)
+            verbs_rmpp_ack(dev, seg, rmpp->seg_num, rmpp->newwin);
+        return 0;
+    }
+
+    need = hdr_size + seg_num * UMAD_LEN_SA_DATA;
+    if (need > rmpp->size) {
+        size_t size = rmpp->size ? 2 * rmpp->size : need;
+        void* buf;
+
+        /* The first segment announces the total payload, in RMPP data units */
+        if (seg_num == 1 && __be32_to_cpu(hdr.paylen_newwin))
+            size = hdr_size + (__be32_to_cpu(hdr.paylen_newwin) + UMAD_LEN_RMPP_DATA - 1) / UMAD_LEN_RMPP_DATA * UMAD_LEN_SA_DATA;
+        if (size < need)
+            size = need;
+        if (!(buf = realloc(rmpp->mad, size))) {
+            verbs_rmpp_free(&dev->verbs, rmpp);
+            return 0;
+        }
+        rmpp->mad = buf;
+        rmpp->size = size;
+    }
+
+    if (seg_num == 1)
+        memcpy(rmpp->mad, seg, MIN((size_t)len, sizeof(*seg)));
+    else
+        memcpy((char*)rmpp->mad + hdr_size + (seg_num - 1) * UMAD_LEN_SA_DATA, seg->data, UMAD_LEN_SA_DATA);
+    rmpp->seg_num = seg_num;
+    rmpp->last_active = now;
+
+    if (!(hdr.rmpp_rtime_flags & UMAD_RMPP_FLAG_LAST)) {
+        if (seg_num >= rmpp->newwin) {
+            rmpp->newwin = seg_num + SR_VERBS_RMPP_WINDOW;
+            verbs_rmpp_ack(dev, seg, seg_num, rmpp->newwin);
+        }
+        return 0;
     }
+
+    verbs_rmpp_ack(dev, seg, seg_num, seg_num + SR_VERBS_RMPP_WINDOW);
+
+    /* The last segment's PayloadLength counts its own bytes, SA header included */
+    pad = UMAD_LEN_RMPP_DATA - (int)__be32_to_cpu(hdr.paylen_newwin);
+    if (pad < 0 || pad > UMAD_LEN_RMPP_DATA)
+        pad = 0;
+
+    *mad = rmpp->mad;
+    *length = hdr_size + seg_num * UMAD_LEN_SA_DATA - pad;
+    rmpp->mad = NULL;
+    verbs_rmpp_free(&dev->verbs, rmpp);
+    dev->verbs.rmpp_last = *mad;
+    return 1;
+}
+
+static int verbs_dev_recv(struct sr_dev* dev, struct umad_sa_packet** mad, int* length, int timeout_ms)
+{
+    uint64_t deadline = get_time_stamp() + timeout_ms * 1000ULL;
+    uint64_t now;
+    int ret;
+
+    free(dev->verbs.rmpp_last);
+    dev->verbs.rmpp_last = NULL;
+
+    do {
+        if ((ret = mad_recv(dev, (void**)mad, length, timeout_ms)) < 0)
+            return ret;
+
+        if (*length >= (int)offsetof(struct umad_sa_packet, data) && ((*mad)->rmpp_hdr.rmpp_rtime_flags & UMAD_RMPP_FLAG_ACTIVE)) {
+            if (!verbs_rmpp_recv(dev, *mad, *length, mad, length)) {
+                now = get_time_stamp();
+                timeout_ms = now < deadline ? (deadline - now) / 1000 : 0;
+                continue;
+            }
+        }
+
+        return 0;
+    } while (timeout_ms > 0 || dev->verbs.recv_head != dev->verbs.recv_tail);
+
+    return -ETIMEDOUT;
+}
+
+static void verbs_dev_close(struct sr_dev* dev)
+{
+    while (dev->verbs.rmpp)
+        verbs_rmpp_free(&dev->verbs, dev->verbs.rmpp);
+    free(dev->verbs.rmpp_last);
+
+    if (dev->verbs.sa_ah)
+        ibv_destroy_ah(dev->verbs.sa_ah);
+
+    if (dev->verbs.mad_buf_mr)
+        ibv_dereg_mr(dev->verbs.mad_buf_mr);
+
+    if (dev->verbs.mad_buf)
+        free(dev->verbs.mad_buf);
+
+    if (dev->verbs.qp)
+        ibv_destroy_qp(dev->verbs.qp);
+
+    if (dev->verbs.cq)
+        ibv_destroy_cq(dev->verbs.cq);
+
+    if (dev->verbs.channel)
+        ibv_destroy_comp_channel(dev->verbs.channel);
+
+    if (dev->verbs.pd)
+        ibv_dealloc_pd(dev->verbs.pd);
+
+    if (dev->verbs.context)
+        ibv_close_device(dev->verbs.context);
+}
+
+static int verbs_dev_get_fd(struct sr_dev* dev)
+{
+    return dev->verbs.channel->fd;
+}
+
+const struct sr_transport_ops sr_verbs_transport = {
+    .name = "verbs",
+    .caps = SR_TRANSPORT_CAP_TABLE | SR_TRANSPORT_CAP_PORTS,
+    .open = verbs_dev_open,
+    .update = ca_dev_update,
+    .close = verbs_dev_close,
+    .send = verbs_dev_send,
+    .recv = verbs_dev_recv,
+    .get_fd = verbs_dev_get_fd,
+};
+
+static const struct sr_transport_ops* sr_transports[] = {
+    [SR_MAD_SEND_UMAD] = &sr_umad_transport,
+    [SR_MAD_SEND_VERBS] = &sr_verbs_transport,
+    [SR_MAD_SEND_VERBS_DEVX] = &sr_verbs_transport,
+    [SR_MAD_SEND_LOOPBACK] = &sr_loopback_transport,
+};
+
+int services_dev_init(struct sr_dev* dev, const char* dev_name, int port)
+{
+    const struct sr_transport_ops* transport = sr_transports[dev->mad_send_type];
+    int ret;
+
+    if ((ret = transport->open(dev, dev_name, port)))
+        return ret;
+
+    dev->transport = transport;
+    sr_log_debug("Using %s SA transport", transport->name);
+    return 0;
+}
+
+/* Open on 'next' the first active port after the current one of 'dev', the current one last */
+static int ca_dev_open_next(struct sr_dev* dev, struct sr_dev* next)
+{
+    char ca_names[UMAD_MAX_DEVICES][UMAD_CA_NAME_LEN];
+    struct { int ca; int port; } ports[UMAD_MAX_DEVICES * 4];
+    int num_devices, num_ports, num = 0, cur = 0, i, p;
+
+    if ((num_devices = topology_get_cas(ca_names, UMAD_MAX_DEVICES)) < 0)
+        return num_devices;
+
+    for (i = 0; i < num_devices; ++i) {
+        if (strlen(dev->failover_ca) && strcmp(ca_names[i], dev->failover_ca))
+            continue;
+        num_ports = topology_ca_num_ports(ca_names[i]);
+        for (p = 1; p <= num_ports && num < (int)(sizeof(ports) / sizeof(ports[0])); ++p, ++num) {
+            ports[num].ca = i;
+            ports[num].port = p;
+            if (!strcmp(ca_names[i], dev->dev_name) && p == dev->port_num)
+                cur = num;
+        }
+    }
+
+    for (i = 1; i <= num; ++i) {
+        p = (cur + i) % num;
+        if (!dev->transport->open(next, ca_names[ports[p].ca], ports[p].port))
+            return 0;
+    }
+
+    return -ENODEV;
+}
+
+/*
+ * Move the device to another port. The new port is opened on the side and
+ * replaces the old one only once it works, so a failed attempt changes nothing.
+ */
+static int services_dev_failover(struct sr_dev* dev)
+{
+    struct sr_dev* next;
+    int ret;
+
+    next = malloc(sizeof(*next));
+    if (!next) {
+        sr_log_err("Failed to allocate device for failover");
+        return -ENOMEM;
+    }
+
+    /* Everything but the port, open() fills that in */
+    *next = *dev;
+    memset(&next->verbs, 0, sizeof(next->verbs));
+    memset(&next->umad, 0, sizeof(next->umad));
+    next->loopback = NULL;
+
+    if (dev->transport->caps & SR_TRANSPORT_CAP_PORTS)
+        ret = ca_dev_open_next(dev, next);
+    else
+        ret = dev->transport->open(next, dev->failover_ca, 0);
+    if (ret) {
+        sr_log_err("No other port to fail over to from %s port %d", dev->dev_name, dev->port_num);
+        free(next);
+        return ret;
+    }
+
+    sr_log_warn("Failing over from %s port %d to %s port %d", dev->dev_name, dev->port_num, next->dev_name, next->port_num);
+    dev->transport->close(dev);
+
+    memcpy(dev->dev_name, next->dev_name, sizeof(dev->dev_name));
+    dev->port_num = next->port_num;
+    dev->port_gid = next->port_gid;
+    dev->port_lid = next->port_lid;
+    dev->port_smlid = next->port_smlid;
+    dev->portid = next->portid;
+    dev->agent = next->agent;
+    dev->verbs = next->verbs;
+    dev->umad = next->umad;
+    dev->loopback = next->loopback;
+    dev->report_qpn = next->report_qpn;
+    free(next);
+
+    SR_STAT_INC(dev->stats.failovers);
+    return 0;
+}
+
+int services_dev_update(struct sr_dev* dev)
+{
+    union ibv_gid old_gid = dev->port_gid;
+    int ret;
+
+    if (!(ret = dev->transport->update(dev)) || !dev->failover)
+        return ret;
+
+    if ((ret = services_dev_failover(dev)))
+        return ret;
+
+    /* Whatever was sent through the old port is lost, and our records point at it */
+    dev_sa_restart(dev);
+    dev_move_services(dev, old_gid.raw);
+    return 0;
+}
+
+void services_dev_cleanup(struct sr_dev* dev)
+{
+    if (dev->transport)
+        dev->transport->close(dev);
 }
@@ -37,16 +37,256 @@
 
 #include "service_record.h"
 
+#include <infiniband/umad_sa.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define LOG_LEVEL 0
 
+#define IB_GRH_LEN 40
+
+#define SR_DECODE_BATCH 1024 /* Records matched per decode_match_names() call */
+
+struct sr_ib_service_record
+{
+    __be64 service_id;                 /* 0 */
+    __u8 service_gid[16];              /* 1 */
+    __be16 service_pkey;               /* 2 */
+    __be16 resv;                       /* 3 */
+    __be32 service_lease;              /* 4 */
+    __u8 service_key[SR_128_BIT_SIZE]; /* 5 */
+    char service_name[64];             /* 6 */
+    struct
+    {
+        __u8 service_data8[16];   /* 7 */
+        __be16 service_data16[8]; /* 8 */
+        __be32 service_data32[4]; /* 9 */
+        __be64 service_data64[2]; /* 10 */
+    } service_data;
+};
+
+/* InformInfo, SA attribute 0x0003, generic form */
+struct sr_ib_inform_info
+{
+    uint8_t gid[16];
+    __be16 lid_range_begin;
+    __be16 lid_range_end;
+    __be16 reserved;
+    uint8_t is_generic;
+    uint8_t subscribe;
+    __be16 type;
+    __be16 trap_num;
+    __be32 qpn_resp_time;  /* QPN [31:8], RespTimeValue [4:0] */
+    __be32 producer_type;  /* ProducerType [23:0] */
+} __attribute__((packed));
+
+/* Notice, the payload of a Report */
+struct sr_ib_notice
+{
+    uint8_t generic_type;  /* IsGeneric [7], Type [6:0] */
+    uint8_t producer_type[3];
+    __be16 trap_num;
+    __be16 issuer_lid;
+    __be16 toggle_count;
+    union
+    {
+        uint8_t raw[54];
+        struct
+        {
+            uint8_t reserved[6];
+            uint8_t gid[16];
+        } __attribute__((packed)) gid_service; /* traps 64 and 65 */
+    } data_details;
+    uint8_t issuer_gid[16];
+} __attribute__((packed));
+
+enum
+{
+    SR_TRANSPORT_CAP_TABLE = 1 << 0, /* Multi-MAD (GET_TABLE) responses are reassembled */
+    SR_TRANSPORT_CAP_PORTS = 1 << 1, /* Opens CA ports found through umad */
+};
+
+/*
+ * SA transport. A transport moves complete SA MADs between the library and the
+ * Subnet Administrator; request building and response matching are common code.
+ */
+struct sr_transport_ops
+{
+    const char* name;
+    uint32_t caps;
+    /* Find and open a port, dev_name/port as given to sr_init() */
+    int (*open)(struct sr_dev* dev, const char* dev_name, int port);
+    /* Refresh port attributes (LID, SM LID) after a fabric change */
+    int (*update)(struct sr_dev* dev);
+    void (*close)(struct sr_dev* dev);
+    /* Send one request MAD */
+    int (*send)(struct sr_dev* dev, const struct umad_sa_packet* mad);
+    /* Receive one MAD; the buffer is owned by the transport and valid until the next recv() */
+    int (*recv)(struct sr_dev* dev, struct umad_sa_packet** mad, int* length, int timeout_ms);
+    /* File descriptor that becomes readable when recv() has something to return */
+    int (*get_fd)(struct sr_dev* dev);
+};
+
+/* One outstanding SA request, see sa.c */
+enum
+{
+    SR_IO_SUBMIT,
+    SR_IO_CANCEL,
+    SR_IO_UPDATE,
+};
+
+/* Operation queued for the I/O thread */
+struct sr_io_op
+{
+    struct sr_io_op* next;
+    int type;                /* SR_IO_* */
+    struct sr_sa_txn* txn;
+    int status;              /* -EINPROGRESS until done */
+};
+
+struct sr_sa_txn
+{
+    struct sr_sa_txn* next;  /* Pending list */
+    struct sr_sa_txn* hnext; /* TID hash chain, while sent */
+    struct sr_sa_txn* qnext; /* Key hash chain, while a pending query */
+    uint32_t tid;
+    int method;
+    int attr;
+    uint64_t comp_mask;
+    int req_size;
+    uint8_t req_data[UMAD_LEN_SA_DATA] __attribute__((aligned(8)));
+    int retries;     /* Attempts left */
+    int allow_zero;  /* An empty response completes the request */
+    int hide_errors;
+    int keep_data;   /* Return the response payload in resp_data */
+    int sent;        /* Waiting for a response, otherwise waiting to be resent */
+    uint64_t timeout; /* Response deadline or resend time, usec */
+    uint64_t deadline; /* Give up after this, usec, 0 for none */
+    uint64_t sleep;  /* Last resend delay, usec */
+    uint64_t start;  /* Submit time, usec */
+    int attempts;    /* MADs sent */
+    uint64_t key;    /* Hash of what is sent, to find identical queries */
+    struct sr_sa_txn* leader;    /* Identical query this one waits on, not on the pending list meanwhile */
+    struct sr_sa_txn* followers; /* Queries waiting on this one, linked by 'next' */
+    struct sr_io_op op; /* Submission to the I/O thread */
+    int status;      /* -EINPROGRESS, number of records or -errno */
+    void* resp_data; /* resp_buf or malloc()ed, owned by the caller once completed */
+    size_t resp_size;
+    void* resp_buf;  /* Optional buffer for the payload, used if it fits */
+    size_t resp_buf_size;
+    int record_size;
+    void (*complete)(struct sr_sa_txn* txn);
+    void* arg;
+};
+
+extern const struct sr_transport_ops sr_umad_transport;
+extern const struct sr_transport_ops sr_verbs_transport;
+extern const struct sr_transport_ops sr_loopback_transport;
+
+int verbs_rmpp_recv(struct sr_dev* dev, struct umad_sa_packet* seg, int len, struct umad_sa_packet** mad, int* length);
+
+uint64_t get_time_stamp(void);
+
+void dev_sa_txn_init(struct sr_sa_txn* txn, int method, int attr, uint64_t comp_mask, const void* req_data, int req_size);
+int dev_sa_submit(struct sr_dev* dev, struct sr_sa_txn* txn);
+int dev_sa_start(struct sr_dev* dev, struct sr_sa_txn* txn);
+void dev_sa_cancel(struct sr_dev* dev, struct sr_sa_txn* txn);
+void dev_sa_restart(struct sr_dev* dev);
+int dev_sa_progress(struct sr_dev* dev, int timeout_ms);
+int dev_sa_wait(struct sr_dev* dev, struct sr_sa_txn* txn);
+int dev_sa_wait_all(struct sr_dev* dev, struct sr_sa_txn* txns, int num);
+int dev_sa_next_timeout(struct sr_dev* dev);
+
+void notice_cleanup(struct sr_ctx* context);
+
+int io_thread_start(struct sr_dev* dev);
+void io_thread_stop(struct sr_dev* dev);
+int dev_io_direct(struct sr_dev* dev);
+void io_submit(struct sr_dev* dev, struct sr_sa_txn* txn);
+void io_wait(struct sr_dev* dev, struct sr_sa_txn* txn);
+int io_call(struct sr_dev* dev, int type, struct sr_sa_txn* txn);
+int dev_update(struct sr_dev* dev);
+void dev_wake(struct sr_dev* dev);
+
+void dev_register_txn_init(struct sr_sa_txn* txn, struct sr_ib_service_record* record);
+void dev_move_services(struct sr_dev* dev, const uint8_t* old_gid);
+void lease_track(struct sr_ctx* context, const struct sr_ib_service_record* record);
+void lease_untrack(struct sr_ctx* context, uint64_t id, const char* name);
+void lease_kick(struct sr_ctx* context);
+void lease_cleanup(struct sr_ctx* context);
+
+#define SR_STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define SR_STAT_INC(counter)    SR_STAT_ADD(counter, 1)
+
+struct sr_method_stats* stats_method(struct sr_dev* dev, int method);
+void stats_txn_done(struct sr_dev* dev, struct sr_sa_txn* txn, int status);
+
+struct ibv_context;
+void topology_invalidate(void);
+int topology_get_cas(char (*names)[UMAD_CA_NAME_LEN], int max);
+int topology_ca_num_ports(const char* ca_name);
+int rate_limit_configure(const struct sr_config* conf);
+void rate_limit_release(void);
+uint64_t rate_limit_take(int method, uint64_t now);
+
+int topology_find_guid(uint64_t guid, char* ca_name, int* port);
+struct ibv_context* topology_open_device(const char* ca_name);
+
 int services_dev_init(struct sr_dev* dev, const char* dev_name, int port);
 int services_dev_update(struct sr_dev* dev);
 void services_dev_cleanup(struct sr_dev* dev);
 
+int sr_prepare_ib_service_record(struct sr_ctx* context,
+                                  struct sr_dev_service* sr,
+                                  struct sr_ib_service_record* record,
+                                  uint64_t id,
+                                  const char* name,
+                                  const void* data,
+                                  size_t data_size,
+                                  const uint8_t (*service_key)[SR_128_BIT_SIZE]);
+void fill_dev_service_from_ib_service_record(struct sr_dev_service* service, struct sr_ib_service_record* record);
+void dev_get_service_txn_init(struct sr_ctx* context, struct sr_sa_txn* txn, uint64_t id, const char* name, int retries);
+int dev_decode_services(struct sr_ctx* context,
+                        const char* name,
+                        struct sr_sa_txn* txn,
+                        int num_records,
+                        struct sr_dev_service* services,
+                        int max,
+                        int just_copy);
+int dev_get_service(struct sr_ctx* context, const char* name, struct sr_dev_service* services, int max, int retries, int just_copy,
+                    uint64_t deadline);
+uint64_t call_deadline(struct sr_ctx* context);
+
+int service_cache_init(struct sr_dev* dev);
+void service_cache_cleanup(struct sr_dev* dev);
+void service_cache_save(struct sr_dev* dev, const struct sr_ib_service_record* record);
+int service_cache_find(struct sr_dev* dev, uint64_t id, const uint8_t* port_gid, struct sr_ib_service_record* record);
+int service_cache_confirmed(struct sr_dev* dev, const struct sr_ib_service_record* record);
+void service_cache_unconfirm(struct sr_dev* dev);
+int service_cache_remove(struct sr_dev* dev, uint64_t id, const uint8_t* port_gid);
+int service_cache_move(struct sr_dev* dev, const uint8_t* old_gid, const uint8_t* new_gid,
+                       struct sr_ib_service_record** moved);
+int service_cache_foreach(struct sr_dev* dev, int (*cb)(const struct sr_ib_service_record* record, void* arg), void* arg);
+
+int query_cache_init(struct sr_ctx* context, const struct sr_config* conf);
+void query_cache_cleanup(struct sr_ctx* context);
+int query_cache_lookup(struct sr_ctx* context, uint64_t id, const char* name, struct sr_dev_service* srs, int max);
+unsigned query_cache_epoch(struct sr_ctx* context);
+void query_cache_store(struct sr_ctx* context, uint64_t id, const char* name, struct sr_sa_txn* txn, unsigned epoch);
+void query_cache_invalidate(struct sr_ctx* context, uint64_t id);
+void query_cache_expire(struct sr_ctx* context);
+
+int snapshot_init(struct sr_ctx* context, const struct sr_config* conf);
+void snapshot_cleanup(struct sr_ctx* context);
+int snapshot_lookup(struct sr_ctx* context, struct sr_dev_service* srs, int max, int retries, uint64_t deadline);
+void snapshot_expire(struct sr_ctx* context);
+
+int decode_match_names(const void* records, int record_size, int num, const char* name, uint64_t* bitmap);
+int decode_match_names_scalar(const void* records, int record_size, int num, const char* name, uint64_t* bitmap);
+uint32_t decode_min_lease(const void* records, int record_size, int num);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,412 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * Node-wide snapshot of sr_query_service() results in POSIX shared memory, so
+ * that the processes of a node querying the same service send one GET_TABLE
+ * between them instead of one each. The segment is named after the subnet,
+ * service ID, P_Key and service name. A lookup finding the snapshot stale
+ * claims the refresh with a compare-and-swap on the segment; the winner
+ * queries the SA and publishes the records, and the others keep serving the
+ * stale records meanwhile, or wait for them if there are none yet. Records are
+ * published under a sequence counter, odd while being written, so readers copy
+ * them without locks or system calls and retry the rare copy that overlapped
+ * a write. A failed refresh is published too, and lookups fail with it for the
+ * resend delay instead of all asking the SA again.
+ *
+ * Every attached context holds a shared flock on the segment. Leaving, it is
+ * removed by whoever then gets the lock exclusively, which no other context
+ * holds; the kernel drops the locks of a process that died. A context that
+ * locked a segment just removed opens the name again.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <infiniband/umad_sa.h>
+
+#include "service_record.h"
+#include "services.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define SR_SNAPSHOT_MAGIC        0x5352534e41503032ULL /* "SRSNAP02", changes with the layout */
+#define SR_SNAPSHOT_ATTACH_TRIES 100   /* 1 ms apart, for the creator to size the segment */
+#define SR_SNAPSHOT_READ_TRIES   1000  /* Copies overlapping a write before giving up */
+#define SR_SNAPSHOT_POLL_US      1000  /* While waiting for another process to refresh */
+#define SR_SNAPSHOT_OPEN_TRIES   10    /* Each racing the removal of the segment by its last user */
+
+struct sr_snapshot_shm
+{
+    uint64_t magic;          /* Stored last by the creator */
+    uint32_t max_records;
+    uint32_t epoch;          /* Bumped by snapshot_expire() */
+    uint64_t claim_until;    /* usec, a refresh is in progress until then */
+    uint32_t seq;            /* Odd while the fields below are written */
+    int32_t status;          /* Of the last refresh, 0 or negative errno */
+    int32_t num_records;     /* -1 before the first successful refresh */
+    uint32_t data_epoch;     /* 'epoch' when the records were queried */
+    uint64_t fresh_until;    /* usec */
+    uint64_t retry_after;    /* usec, lookups fail with 'status' until then */
+    struct sr_dev_service records[];
+};
+
+struct sr_snapshot
+{
+    char name[NAME_MAX];
+    int fd;                           /* Holds the shared lock */
+    struct sr_snapshot_shm* shm;
+    size_t size;
+    uint64_t ttl;                     /* usec */
+    pthread_mutex_t lock;             /* Serializes refreshes of this process */
+    struct sr_dev_service* buf;       /* Refresh results, shm->max_records */
+};
+
+/* What a lookup copied out of the segment */
+struct sr_snapshot_view
+{
+    uint32_t seq;
+    int32_t status;
+    int32_t num_records;
+    int fresh;
+    uint64_t retry_after;
+};
+
+static uint32_t snapshot_name_hash(const char* name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h;
+}
+
+/* Open and share-lock the segment, creating it if needed. Returns the fd or -errno */
+static int snapshot_open(const char* name, int* created)
+{
+    struct stat st;
+    int fd, i, ret;
+
+    for (i = 0; i < SR_SNAPSHOT_OPEN_TRIES; ++i) {
+        *created = 1;
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            *created = 0;
+            fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+        }
+        if (fd < 0) {
+            /* Removed between the two opens */
+            if (errno == ENOENT)
+                continue;
+            return -errno;
+        }
+
+        if (flock(fd, LOCK_SH) || fstat(fd, &st)) {
+            ret = -errno;
+            close(fd);
+            return ret;
+        }
+
+        /* The last user removed it before we got the lock */
+        if (st.st_nlink)
+            return fd;
+        close(fd);
+    }
+
+    return -EAGAIN;
+}
+
+static int snapshot_attach(struct sr_snapshot* snap, uint32_t max_records)
+{
+    struct sr_snapshot_shm* shm;
+    struct stat st;
+    int fd, created, i, ret;
+
+    if ((fd = snapshot_open(snap->name, &created)) < 0)
+        return fd;
+
+    if (created) {
+        st.st_size = sizeof(*shm) + (size_t)max_records * sizeof(shm->records[0]);
+        if (ftruncate(fd, st.st_size)) {
+            ret = -errno;
+            shm_unlink(snap->name);
+            close(fd);
+            return ret;
+        }
+    } else {
+        /* The creator sizes the segment right after creating it */
+        for (i = 0; !fstat(fd, &st) && (size_t)st.st_size < sizeof(*shm) && i < SR_SNAPSHOT_ATTACH_TRIES; ++i)
+            usleep(1000);
+        if ((size_t)st.st_size < sizeof(*shm)) {
+            close(fd);
+            return -EAGAIN;
+        }
+    }
+
+    shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    if (created) {
+        shm->max_records = max_records;
+        shm->num_records = -1;
+        __atomic_store_n(&shm->magic, SR_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        for (i = 0; __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SR_SNAPSHOT_MAGIC && i < SR_SNAPSHOT_ATTACH_TRIES; ++i)
+            usleep(1000);
+        if (shm->magic != SR_SNAPSHOT_MAGIC ||
+            sizeof(*shm) + (size_t)shm->max_records * sizeof(shm->records[0]) > (size_t)st.st_size) {
+            munmap(shm, st.st_size);
+            close(fd);
+            return -EPROTO;
+        }
+    }
+
+    snap->fd = fd;
+    snap->shm = shm;
+    snap->size = st.st_size;
+    return 0;
+}
+
+int snapshot_init(struct sr_ctx* context, const struct sr_config* conf)
+{
+    struct sr_snapshot* snap;
+    int ret;
+
+    if (!conf || !conf->snapshot_ttl_ms)
+        return 0;
+
+    snap = calloc(1, sizeof(*snap));
+    if (!snap) {
+        sr_log_err("Failed to allocate snapshot");
+        return -ENOMEM;
+    }
+
+    snprintf(snap->name, sizeof(snap->name), "/sr-snapshot-%016" PRIx64 "-%016" PRIx64 "-%04x-%08x",
+             (uint64_t)__be64_to_cpu(context->dev->port_gid.global.subnet_prefix), context->service_id, context->dev->pkey,
+             snapshot_name_hash(context->service_name));
+    snap->ttl = conf->snapshot_ttl_ms * 1000ULL;
+    pthread_mutex_init(&snap->lock, NULL);
+
+    ret = snapshot_attach(snap, conf->snapshot_max_records ? conf->snapshot_max_records : SR_DEFAULT_SNAPSHOT_RECORDS);
+    if (!ret && !(snap->buf = calloc(snap->shm->max_records, sizeof(*snap->buf))))
+        ret = -ENOMEM;
+    if (ret) {
+        /* Queries still work, each process just asks the SA itself */
+        sr_log_warn("No node snapshot %s, querying the SA directly: %s", snap->name, strerror(-ret));
+        if (snap->shm) {
+            munmap(snap->shm, snap->size);
+            close(snap->fd);
+        }
+        pthread_mutex_destroy(&snap->lock);
+        free(snap);
+        return 0;
+    }
+
+    sr_log_debug("Attached to node snapshot %s, %u records", snap->name, snap->shm->max_records);
+    context->snapshot = snap;
+    return 0;
+}
+
+void snapshot_cleanup(struct sr_ctx* context)
+{
+    struct sr_snapshot* snap = context->snapshot;
+
+    if (!snap)
+        return;
+
+    munmap(snap->shm, snap->size);
+    /* Exclusive only if no other context is attached, and none can attach until it is gone */
+    if (!flock(snap->fd, LOCK_EX | LOCK_NB))
+        shm_unlink(snap->name);
+    close(snap->fd);
+    pthread_mutex_destroy(&snap->lock);
+    free(snap->buf);
+    free(snap);
+    context->snapshot = NULL;
+}
+
+/*
+ * Copy the records into 'srs'. Returns how many, or -EAGAIN when every copy
+ * overlapped a write, which only lasts if a process died while publishing.
+ */
+static int snapshot_read(struct sr_snapshot_shm* shm, struct sr_dev_service* srs, int max, uint64_t now,
+                         struct sr_snapshot_view* view)
+{
+    uint32_t seq;
+    int num, i;
+
+    for (i = 0; i < SR_SNAPSHOT_READ_TRIES; ++i) {
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        view->seq = seq;
+        view->status = __atomic_load_n(&shm->status, __ATOMIC_RELAXED);
+        view->num_records = __atomic_load_n(&shm->num_records, __ATOMIC_RELAXED);
+        view->retry_after = __atomic_load_n(&shm->retry_after, __ATOMIC_RELAXED);
+        view->fresh = view->num_records >= 0 && now < __atomic_load_n(&shm->fresh_until, __ATOMIC_RELAXED) &&
+                      __atomic_load_n(&shm->data_epoch, __ATOMIC_RELAXED) ==
+                          __atomic_load_n(&shm->epoch, __ATOMIC_RELAXED);
+
+        num = MIN(MIN(view->num_records, max), (int)shm->max_records);
+        if (num > 0)
+            memcpy(srs, shm->records, num * sizeof(*srs));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+            return num > 0 ? num : 0;
+    }
+
+    return -EAGAIN;
+}
+
+/* Publish a refresh result valid for 'hold' usec, 'srs' NULL keeps the previous records */
+static void snapshot_publish(struct sr_snapshot* snap, uint32_t epoch, uint64_t hold, int status,
+                             const struct sr_dev_service* srs, int num)
+{
+    struct sr_snapshot_shm* shm = snap->shm;
+    uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+    uint64_t now = get_time_stamp();
+
+    /* A refresh that outlived its claim may race the next one, the first to publish wins */
+    if ((seq & 1) || !__atomic_compare_exchange_n(&shm->seq, &seq, seq + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&shm->status, status, __ATOMIC_RELAXED);
+    if (srs) {
+        num = MIN(num, (int)shm->max_records);
+        memcpy(shm->records, srs, num * sizeof(*srs));
+        __atomic_store_n(&shm->num_records, num, __ATOMIC_RELAXED);
+        __atomic_store_n(&shm->data_epoch, epoch, __ATOMIC_RELAXED);
+        __atomic_store_n(&shm->fresh_until, now + hold, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&shm->retry_after, now + hold, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static int snapshot_claim(struct sr_snapshot_shm* shm, uint64_t now, uint64_t hold)
+{
+    uint64_t until = __atomic_load_n(&shm->claim_until, __ATOMIC_RELAXED);
+    uint32_t seq;
+
+    if (until > now ||
+        !__atomic_compare_exchange_n(&shm->claim_until, &until, now + hold, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    /* Only a dead publisher leaves the counter odd past its claim */
+    seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) && until && __atomic_compare_exchange_n(&shm->seq, &seq, seq + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        sr_log_warn("Recovered node snapshot left mid-write");
+
+    return 1;
+}
+
+static int snapshot_refresh(struct sr_ctx* context, struct sr_dev_service* srs, int max, int retries, uint64_t deadline)
+{
+    struct sr_snapshot* snap = context->snapshot;
+    uint32_t epoch = __atomic_load_n(&snap->shm->epoch, __ATOMIC_RELAXED);
+    int ret;
+
+    pthread_mutex_lock(&snap->lock);
+    ret = dev_get_service(context, context->service_name, snap->buf, snap->shm->max_records, retries, 0, deadline);
+    if (ret >= 0) {
+        snapshot_publish(snap, epoch, snap->ttl, 0, snap->buf, ret);
+        ret = MIN(ret, max);
+        if (ret > 0)
+            memcpy(srs, snap->buf, ret * sizeof(*srs));
+    } else {
+        snapshot_publish(snap, epoch, context->dev->query_sleep, ret, NULL, 0);
+    }
+    pthread_mutex_unlock(&snap->lock);
+
+    __atomic_store_n(&snap->shm->claim_until, 0, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/*
+ * Answer sr_query_service() from the node snapshot, refreshing it if stale and
+ * no other process does. Returns -ENOENT if the caller should ask the SA.
+ */
+int snapshot_lookup(struct sr_ctx* context, struct sr_dev_service* srs, int max, int retries, uint64_t deadline)
+{
+    struct sr_snapshot* snap = context->snapshot;
+    struct sr_dev* dev = context->dev;
+    struct sr_snapshot_view view;
+    uint64_t now, hold;
+    uint32_t waited_seq = 0;
+    int waiting = 0, ret;
+
+    if (!snap)
+        return -ENOENT;
+
+    /* Long enough for the whole query with its resends, after that anyone may take over */
+    hold = (retries + 1ULL) * (dev->fabric_timeout_ms * 1000ULL + dev->query_sleep_max);
+
+    for (;;) {
+        now = get_time_stamp();
+        if ((ret = snapshot_read(snap->shm, srs, max, now, &view)) < 0)
+            return -ENOENT;
+
+        /* Whatever got published while waiting is the answer */
+        if (view.fresh || (waiting && view.seq != waited_seq))
+            break;
+        if (view.status && now < view.retry_after)
+            return view.status;
+
+        if (snapshot_claim(snap->shm, now, hold))
+            return snapshot_refresh(context, srs, max, retries, deadline);
+
+        /* Another process is refreshing, serve the stale records meanwhile */
+        if (view.num_records >= 0)
+            break;
+
+        if (deadline && now >= deadline)
+            return -ETIMEDOUT;
+        if (!waiting) {
+            waiting = 1;
+            waited_seq = view.seq;
+        }
+        usleep(SR_SNAPSHOT_POLL_US);
+    }
+
+    if (view.status && view.num_records < 0)
+        return view.status;
+
+    SR_STAT_INC(dev->stats.snapshot_hits);
+    return ret;
+}
+
+/* Make the next lookup of any process refresh the snapshot */
+void snapshot_expire(struct sr_ctx* context)
+{
+    struct sr_snapshot* snap = context->snapshot;
+
+    if (snap)
+        __atomic_fetch_add(&snap->shm->epoch, 1, __ATOMIC_RELAXED);
+}
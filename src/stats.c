@@ -0,0 +1,200 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * SA transaction counters. The SA engine bumps them with relaxed atomics as
+ * requests are sent and completed; readers take a snapshot with
+ * sr_get_stats() or dump it in Prometheus text format with sr_dump_stats().
+ */
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <infiniband/umad_sa.h>
+#include <infiniband/umad_types.h>
+
+#include "service_record.h"
+#include "services.h"
+
+static const char* stats_method_names[SR_STATS_METHOD_NUM] = {
+    [SR_STATS_SET] = "set",
+    [SR_STATS_GET] = "get",
+    [SR_STATS_GET_TABLE] = "get_table",
+    [SR_STATS_DELETE] = "delete",
+    [SR_STATS_OTHER] = "other",
+};
+
+static const char* stats_mad_status_names[8] = {
+    [1] = "bad_version", [2] = "method_unsupported", [3] = "method_attr_unsupported", [7] = "invalid_field",
+};
+
+static const char* stats_sa_status_names[8] = {
+    [1] = "no_resources", [2] = "req_invalid", [3] = "no_records", [4] = "too_many_records",
+    [5] = "req_invalid_gid", [6] = "req_insufficient_components", [7] = "req_denied",
+};
+
+struct sr_method_stats* stats_method(struct sr_dev* dev, int method)
+{
+    switch (method) {
+        case UMAD_METHOD_SET:
+            return &dev->stats.methods[SR_STATS_SET];
+        case UMAD_METHOD_GET:
+            return &dev->stats.methods[SR_STATS_GET];
+        case UMAD_SA_METHOD_GET_TABLE:
+            return &dev->stats.methods[SR_STATS_GET_TABLE];
+        case UMAD_SA_METHOD_DELETE:
+            return &dev->stats.methods[SR_STATS_DELETE];
+        default:
+            return &dev->stats.methods[SR_STATS_OTHER];
+    }
+}
+
+void stats_txn_done(struct sr_dev* dev, struct sr_sa_txn* txn, int status)
+{
+    struct sr_method_stats* stats = stats_method(dev, txn->method);
+    uint64_t latency = get_time_stamp() - txn->start;
+    int bucket = latency ? 64 - __builtin_clzll(latency) : 0;
+
+    if (bucket >= SR_STATS_LATENCY_BUCKETS)
+        bucket = SR_STATS_LATENCY_BUCKETS - 1;
+
+    if (status > 0)
+        SR_STAT_INC(stats->found);
+    else if (status == 0)
+        SR_STAT_INC(stats->empty);
+    else
+        SR_STAT_INC(stats->failed);
+
+    SR_STAT_ADD(stats->latency_sum_us, latency);
+    SR_STAT_INC(stats->latency[bucket]);
+}
+
+void sr_get_stats(struct sr_ctx* context, struct sr_stats* stats)
+{
+    /* Every field is a uint64_t counter */
+    const uint64_t* src = (const uint64_t*)&context->dev->stats;
+    uint64_t* dst = (uint64_t*)stats;
+
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); ++i)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+struct stats_buf
+{
+    char* buf;
+    size_t size;
+    size_t len;
+};
+
+static void __check_format(2, 3) stats_printf(struct stats_buf* out, const char* format, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = vsnprintf(out->len < out->size ? out->buf + out->len : NULL, out->len < out->size ? out->size - out->len : 0,
+                    format, ap);
+    va_end(ap);
+    if (ret > 0)
+        out->len += ret;
+}
+
+static void stats_header(struct stats_buf* out, const char* name, const char* type, const char* help)
+{
+    stats_printf(out, "# HELP sr_%s %s\n# TYPE sr_%s %s\n", name, help, name, type);
+}
+
+/* One counter family labelled by method, 'offset' locates the counter in struct sr_method_stats */
+static void stats_method_counter(struct stats_buf* out, const struct sr_stats* stats, const char* transport,
+                                 const char* name, const char* help, size_t offset)
+{
+    stats_header(out, name, "counter", help);
+    for (int m = 0; m < SR_STATS_METHOD_NUM; ++m)
+        stats_printf(out, "sr_%s{transport=\"%s\",method=\"%s\"} %" PRIu64 "\n", name, transport, stats_method_names[m],
+                     *(const uint64_t*)((const char*)&stats->methods[m] + offset));
+}
+
+int sr_dump_stats(struct sr_ctx* context, char* buf, size_t size)
+{
+    struct stats_buf out = {.buf = buf, .size = size};
+    const char* transport = context->dev->transport->name;
+    const struct sr_method_stats* ms;
+    struct sr_stats stats;
+    uint64_t count;
+    int i, m;
+
+    sr_get_stats(context, &stats);
+
+#define SR_STATS_METHOD_COUNTER(field, name, help) \
+    stats_method_counter(&out, &stats, transport, name, help, offsetof(struct sr_method_stats, field))
+
+    SR_STATS_METHOD_COUNTER(requests, "sa_requests_total", "SA transactions submitted");
+    SR_STATS_METHOD_COUNTER(sends, "sa_sends_total", "SA MADs sent, resends included");
+    SR_STATS_METHOD_COUNTER(retries, "sa_retries_total", "SA MADs resent");
+    SR_STATS_METHOD_COUNTER(timeouts, "sa_timeouts_total", "SA responses that did not arrive in time");
+    SR_STATS_METHOD_COUNTER(sa_errors, "sa_errors_total", "SA responses with a non-zero MAD status");
+    SR_STATS_METHOD_COUNTER(found, "sa_found_total", "SA transactions completed with records");
+    SR_STATS_METHOD_COUNTER(empty, "sa_empty_total", "SA transactions completed without records");
+    SR_STATS_METHOD_COUNTER(failed, "sa_failed_total", "SA transactions completed with an error");
+
+#undef SR_STATS_METHOD_COUNTER
+
+    stats_header(&out, "sa_latency_seconds", "histogram", "SA transaction latency, submit to completion");
+    for (m = 0; m < SR_STATS_METHOD_NUM; ++m) {
+        ms = &stats.methods[m];
+        for (i = 0, count = 0; i < SR_STATS_LATENCY_BUCKETS - 1; ++i) {
+            count += ms->latency[i];
+            stats_printf(&out, "sr_sa_latency_seconds_bucket{transport=\"%s\",method=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+                         transport, stats_method_names[m], (double)(1ULL << i) / 1e6, count);
+        }
+        count += ms->latency[i];
+        stats_printf(&out, "sr_sa_latency_seconds_bucket{transport=\"%s\",method=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+                     transport, stats_method_names[m], count);
+        stats_printf(&out, "sr_sa_latency_seconds_sum{transport=\"%s\",method=\"%s\"} %g\n", transport,
+                     stats_method_names[m], ms->latency_sum_us / 1e6);
+        stats_printf(&out, "sr_sa_latency_seconds_count{transport=\"%s\",method=\"%s\"} %" PRIu64 "\n", transport,
+                     stats_method_names[m], count);
+    }
+
+    stats_header(&out, "sa_status_total", "counter", "SA responses by decoded MAD and SA status");
+    for (i = 0; i < 8; ++i) {
+        if (stats_mad_status_names[i])
+            stats_printf(&out, "sr_sa_status_total{transport=\"%s\",field=\"mad\",status=\"%s\"} %" PRIu64 "\n",
+                         transport, stats_mad_status_names[i], stats.mad_status[i]);
+    }
+    for (i = 0; i < 8; ++i) {
+        if (stats_sa_status_names[i])
+            stats_printf(&out, "sr_sa_status_total{transport=\"%s\",field=\"sa\",status=\"%s\"} %" PRIu64 "\n",
+                         transport, stats_sa_status_names[i], stats.sa_status[i]);
+    }
+
+    stats_header(&out, "tid_mismatches_total", "counter", "Responses to no outstanding request");
+    stats_printf(&out, "sr_tid_mismatches_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.tid_mismatches);
+    stats_header(&out, "recv_timeouts_total", "counter", "Receive waits that expired");
+    stats_printf(&out, "sr_recv_timeouts_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.recv_timeouts);
+    stats_header(&out, "reports_total", "counter", "Unsolicited SA Reports");
+    stats_printf(&out, "sr_reports_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.reports);
+    stats_header(&out, "breaker_rejects_total", "counter", "Requests failed fast while the SA was unreachable");
+    stats_printf(&out, "sr_breaker_rejects_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.breaker_rejects);
+    stats_header(&out, "dev_updates_total", "counter", "Port re-reads after a failed query");
+    stats_printf(&out, "sr_dev_updates_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.dev_updates);
+    stats_header(&out, "failovers_total", "counter", "Moves to another port");
+    stats_printf(&out, "sr_failovers_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.failovers);
+    stats_header(&out, "coalesced_total", "counter", "Queries answered by an identical pending one");
+    stats_printf(&out, "sr_coalesced_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.coalesced);
+    stats_header(&out, "throttled_total", "counter", "Sends delayed or rejected by the rate limit");
+    stats_printf(&out, "sr_throttled_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.throttled);
+    stats_header(&out, "register_skips_total", "counter", "Registrations the SA already held unchanged");
+    stats_printf(&out, "sr_register_skips_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.register_skips);
+    stats_header(&out, "snapshot_hits_total", "counter", "Queries answered from the node snapshot");
+    stats_printf(&out, "sr_snapshot_hits_total{transport=\"%s\"} %" PRIu64 "\n", transport, stats.snapshot_hits);
+
+    return out.len;
+}
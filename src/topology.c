@@ -0,0 +1,271 @@
+/**
+ * SPDX-FileCopyrightText: NVIDIA CORPORATION & AFFILIATES
+ * Copyright (c) 2016-2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ *
+ * See file LICENSE for terms.
+ */
+
+/*
+ * Process-wide index of the local CAs, their ports and port GUIDs, and the
+ * verbs device list. It is built by the first lookup, so that later sr_init()
+ * and sr_init_via_guid() calls skip the sysfs walks. The index is dropped
+ * when the kernel announces an InfiniBand device coming or going, or when a
+ * port it led to turns out unusable, and the next lookup builds it again.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/netlink.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/verbs.h>
+
+#include "service_record.h"
+#include "services.h"
+
+#define SR_TOPOLOGY_EVENT_SIZE 2048
+
+typedef typeof(((struct umad_port*)0)->port_guid) umad_guid_t;
+
+struct topology_ca
+{
+    char name[UMAD_CA_NAME_LEN];
+    unsigned node_type;
+    int num_ports;
+    int num_guids;
+    umad_guid_t guids[UMAD_CA_MAX_PORTS + 1]; /* By port number, as umad_get_ca_portguids() */
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    int valid;
+    int event_fd;                     /* Kernel uevents, -1 if unavailable, -2 before the first try */
+    int num_cas;
+    struct topology_ca cas[UMAD_MAX_DEVICES];
+    struct ibv_device** ibv_devices;  /* Kept so devices open without another scan */
+} topology = {.lock = PTHREAD_MUTEX_INITIALIZER, .event_fd = -2};
+
+/* Listen to kernel device events, so added or removed CAs drop the index */
+static void topology_events_open(void)
+{
+    struct sockaddr_nl addr = {.nl_family = AF_NETLINK, .nl_groups = 1};
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd >= 0 && bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0)
+        sr_log_info("No kernel device events, the CA index is only refreshed when a port fails: %m");
+
+    topology.event_fd = fd;
+}
+
+/* Returns non-zero if an InfiniBand device came or went since the last call */
+static int topology_events_changed(void)
+{
+    char buf[SR_TOPOLOGY_EVENT_SIZE];
+    ssize_t len;
+    int changed = 0;
+
+    if (topology.event_fd < 0)
+        return 0;
+
+    /* The header is "action@devpath", which names the class of the device */
+    while ((len = recv(topology.event_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) != 0) {
+        if (len < 0) {
+            /* Events were dropped while nobody looked, assume the worst */
+            if (errno == ENOBUFS)
+                changed = 1;
+            else if (errno != EINTR)
+                break;
+            continue;
+        }
+        buf[len] = '\0';
+        if (strstr(buf, "/infiniband"))
+            changed = 1;
+    }
+
+    return changed;
+}
+
+static void topology_drop(void)
+{
+    if (topology.ibv_devices)
+        ibv_free_device_list(topology.ibv_devices);
+    topology.ibv_devices = NULL;
+    topology.num_cas = 0;
+    topology.valid = 0;
+}
+
+static int topology_build(void)
+{
+    char names[UMAD_MAX_DEVICES][UMAD_CA_NAME_LEN];
+    struct topology_ca* ca;
+    umad_ca_t umad_ca;
+    int num, i;
+
+    if ((num = umad_get_cas_names(names, UMAD_MAX_DEVICES)) < 0) {
+        sr_log_err("Unable to get CAs' list. %m");
+        return -errno;
+    }
+
+    topology.num_cas = 0;
+    for (i = 0; i < num; ++i) {
+        ca = &topology.cas[topology.num_cas];
+        memset(ca, 0, sizeof(*ca));
+        memcpy(ca->name, names[i], sizeof(ca->name));
+
+        if (umad_get_ca(ca->name, &umad_ca) < 0) {
+            sr_log_info("Skipping CA %s: unable to umad_get_ca", ca->name);
+            continue;
+        }
+        ca->node_type = umad_ca.node_type;
+        ca->num_ports = umad_ca.numports;
+        umad_release_ca(&umad_ca);
+
+        ca->num_guids = umad_get_ca_portguids(ca->name, ca->guids, UMAD_CA_MAX_PORTS + 1);
+        if (ca->num_guids < 0) {
+            sr_log_info("Skipping CA %s: unable to umad_get_ca_portguids", ca->name);
+            continue;
+        }
+        topology.num_cas++;
+    }
+
+    topology.valid = 1;
+    sr_log_debug("Indexed %d CAs", topology.num_cas);
+    return 0;
+}
+
+/* Make the index current, called with the lock held */
+static int topology_refresh(void)
+{
+    if (topology.event_fd == -2)
+        topology_events_open();
+
+    if (topology_events_changed() && topology.valid) {
+        sr_log_info("InfiniBand devices changed, rebuilding the CA index");
+        topology_drop();
+    }
+
+    return topology.valid ? 0 : topology_build();
+}
+
+void topology_invalidate(void)
+{
+    pthread_mutex_lock(&topology.lock);
+    topology_drop();
+    pthread_mutex_unlock(&topology.lock);
+}
+
+int topology_get_cas(char (*names)[UMAD_CA_NAME_LEN], int max)
+{
+    int ret, i;
+
+    pthread_mutex_lock(&topology.lock);
+    if (!(ret = topology_refresh())) {
+        for (i = 0; i < topology.num_cas && i < max; ++i)
+            memcpy(names[i], topology.cas[i].name, UMAD_CA_NAME_LEN);
+        ret = i;
+    }
+    pthread_mutex_unlock(&topology.lock);
+
+    return ret;
+}
+
+int topology_ca_num_ports(const char* ca_name)
+{
+    int ret, i;
+
+    pthread_mutex_lock(&topology.lock);
+    if (!(ret = topology_refresh())) {
+        ret = -ENODEV;
+        for (i = 0; i < topology.num_cas; ++i)
+            if (!strcmp(topology.cas[i].name, ca_name))
+                ret = topology.cas[i].num_ports;
+    }
+    pthread_mutex_unlock(&topology.lock);
+
+    return ret;
+}
+
+/*
+ * Find the CA and port of a port GUID, in network order. A GUID shared by
+ * several ports of one CA does not identify a port and is skipped. An empty
+ * name and port 0 are returned for GUID 0, meaning the first active port.
+ */
+int topology_find_guid(uint64_t guid, char* ca_name, int* port)
+{
+    const struct topology_ca *ca, *found = NULL;
+    int ret, i, j, k, dups;
+
+    pthread_mutex_lock(&topology.lock);
+    if ((ret = topology_refresh()))
+        goto out;
+
+    if (!guid) {
+        found = topology.num_cas ? &topology.cas[0] : NULL;
+        *ca_name = '\0';
+        *port = 0;
+    }
+
+    for (i = 0; guid && !found && i < topology.num_cas; ++i) {
+        ca = &topology.cas[i];
+        for (j = 0; j < ca->num_guids; ++j) {
+            if (ca->guids[j] != guid)
+                continue;
+
+            for (k = 0, dups = 0; k < ca->num_guids; ++k)
+                dups += ca->guids[k] == guid;
+            if (dups > 1) {
+                sr_log_info("skip %s guid 0x%" PRIx64 ": more than one same port guids", ca->name, guid);
+                break;
+            }
+
+            found = ca;
+            snprintf(ca_name, UMAD_CA_NAME_LEN, "%s", ca->name);
+            *port = j;
+            break;
+        }
+    }
+
+    if (!found) {
+        sr_log_err("unable to find requested guid 0x%" PRIx64 "", guid);
+        ret = -ENODEV;
+    } else if (found->node_type < 1 || found->node_type > 3) {
+        sr_log_err("Type %d of node \'%s\' is not an IB node type", found->node_type, found->name);
+        ret = -ENODEV;
+    }
+
+out:
+    pthread_mutex_unlock(&topology.lock);
+    return ret;
+}
+
+/* Open the verbs device of a CA, without listing the devices again */
+struct ibv_context* topology_open_device(const char* ca_name)
+{
+    struct ibv_context* context = NULL;
+    int i;
+
+    pthread_mutex_lock(&topology.lock);
+    if (!topology_refresh() && !topology.ibv_devices && !(topology.ibv_devices = ibv_get_device_list(NULL)))
+        sr_log_err("no devices");
+
+    for (i = 0; topology.ibv_devices && topology.ibv_devices[i]; ++i) {
+        if (!strcmp(ibv_get_device_name(topology.ibv_devices[i]), ca_name)) {
+            context = ibv_open_device(topology.ibv_devices[i]);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&topology.lock);
+
+    return context;
+}
@@ -0,0 +1,147 @@
+// std
+#include <cerrno>
+#include <chrono>
+// 3rd party
+#include <doctest/doctest.h>
+#include <poll.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+#include "services.h"
+
+namespace {
+
+struct completion {
+  int calls = 0;
+  int status = -EINPROGRESS;
+};
+
+void complete(struct sr_request*, int status, void* arg) {
+  auto* done = static_cast<completion*>(arg);
+  done->calls++;
+  done->status = status;
+}
+
+// Drive the context the way an event loop would, until 'done' completed
+void poll_until(struct sr_ctx* context, const completion& done) {
+  struct pollfd pfd = {sr_get_fd(context), POLLIN, 0};
+  auto until = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+
+  while (!done.calls && std::chrono::steady_clock::now() < until) {
+    poll(&pfd, 1, sr_get_timeout(context));
+    sr_progress(context, 0);
+  }
+}
+
+uint64_t lookups(struct sr_ctx* context) {
+  return sent(context, SR_STATS_GET) + sent(context, SR_STATS_GET_TABLE);
+}
+
+// A record of the context service as another port would have registered it
+void register_foreign(struct sr_ctx* context) {
+  struct sr_dev_service service;
+  struct sr_ib_service_record record;
+  REQUIRE(sr_prepare_ib_service_record(context, &service, &record, context->service_id, context->service_name, "f", 1,
+                                       nullptr) == 0);
+  record.service_gid[0] = 0xaa;
+
+  struct sr_sa_txn txn;
+  dev_register_txn_init(&txn, &record);
+  REQUIRE(dev_sa_wait(context->dev, &txn) == 1);
+}
+
+}  // namespace
+
+TEST_CASE("asynchronous requests complete from sr_progress()") {
+  struct sr_config conf = loopback_config(0x1700, "async");
+  conf.loopback_latency_us = 20000;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+  REQUIRE(sr_get_fd(context) >= 0);
+  CHECK(sr_get_timeout(context) == -1);
+
+  completion registered;
+  struct sr_request* request;
+  REQUIRE(sr_register_service_async(context, "a", 1, nullptr, complete, &registered, &request) == 0);
+  CHECK(sr_request_status(request) == -EINPROGRESS);
+  CHECK(sr_get_timeout(context) >= 0);
+  poll_until(context, registered);
+  CHECK(registered.calls == 1);
+  CHECK(registered.status == 0);
+  CHECK(sr_request_status(request) == 0);
+  sr_request_free(request);
+
+  completion queried;
+  REQUIRE(sr_query_service_async(context, complete, &queried, &request) == 0);
+  struct sr_dev_service srs[2];
+  CHECK(sr_request_services(request, srs, 2) == -EINPROGRESS);
+  poll_until(context, queried);
+  CHECK(queried.status == 1);
+  REQUIRE(sr_request_services(request, srs, 2) == 1);
+  CHECK(srs[0].id == 0x1700);
+  CHECK(srs[0].data[0] == 'a');
+  sr_request_free(request);
+
+  // Without a handle the request is released after its callback
+  completion unregistered;
+  REQUIRE(sr_unregister_service_async(context, nullptr, complete, &unregistered, nullptr) == 0);
+  poll_until(context, unregistered);
+  CHECK(unregistered.status == 0);
+  CHECK(sr_get_timeout(context) == -1);
+  CHECK(sr_query_service(context, srs, 2, 1) == 0);
+}
+
+TEST_CASE("a pending asynchronous request can be released") {
+  struct sr_config conf = loopback_config(0x1710, "async-free");
+  conf.loopback_latency_us = 20000;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+
+  completion queried;
+  struct sr_request* request;
+  REQUIRE(sr_query_service_async(context, complete, &queried, &request) == 0);
+  sr_request_free(request);
+  sr_progress(context, 50);
+  CHECK(queried.calls == 0);
+}
+
+TEST_CASE("asynchronous registration shares the service cache fast path") {
+  struct sr_config conf = loopback_config(0x1720, "async-cache");
+  conf.sr_retries = 3;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+
+  // First registration: scans until no stale record is left
+  register_foreign(context);
+  completion first;
+  REQUIRE(sr_register_service_async(context, "a", 1, nullptr, complete, &first, nullptr) == 0);
+  poll_until(context, first);
+  CHECK(first.status == 0);
+  CHECK(lookups(context) == 2);
+  uint64_t sets = sent(context, SR_STATS_SET);
+
+  // Unchanged: completes at once without the SA
+  completion unchanged;
+  REQUIRE(sr_register_service_async(context, "a", 1, nullptr, complete, &unchanged, nullptr) == 0);
+  CHECK(unchanged.calls == 1);
+  CHECK(unchanged.status == 0);
+  CHECK(sent(context, SR_STATS_SET) == sets);
+  CHECK(lookups(context) == 2);
+  struct sr_stats stats;
+  sr_get_stats(context, &stats);
+  CHECK(stats.register_skips == 1);
+
+  // Replacing a record of ours: a single scan
+  register_foreign(context);
+  completion changed;
+  REQUIRE(sr_register_service_async(context, "b", 1, nullptr, complete, &changed, nullptr) == 0);
+  poll_until(context, changed);
+  CHECK(changed.status == 0);
+  CHECK(sent(context, SR_STATS_SET) == sets + 2);
+  CHECK(lookups(context) == 3);
+
+  struct sr_dev_service srs[2];
+  REQUIRE(sr_query_service(context, srs, 2, 1) == 1);
+  CHECK(srs[0].data[0] == 'b');
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+}
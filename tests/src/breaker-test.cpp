@@ -0,0 +1,118 @@
+// std
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <vector>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+#include "services.h"
+
+// The loopback SA answering after fabric_timeout_ms is an SA that does not answer.
+
+namespace {
+
+struct sr_config unreachable_config(uint64_t service_id, const char* service_name) {
+  struct sr_config conf = loopback_config(service_id, service_name);
+  conf.fabric_timeout_ms = 20;
+  conf.loopback_latency_us = 100000;
+  return conf;
+}
+
+struct sr_stats stats_of(struct sr_ctx* context) {
+  struct sr_stats stats;
+  sr_get_stats(context, &stats);
+  return stats;
+}
+
+void sleep_ms(int ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+}  // namespace
+
+TEST_CASE("resend delays stay within the decorrelated jitter bounds") {
+  struct sr_config conf = unreachable_config(0x1900, "jitter");
+  conf.flags = SR_NO_CIRCUIT_BREAKER;
+  conf.fabric_timeout_ms = 5;
+  conf.loopback_latency_us = 1000000;
+  conf.query_sleep = 1000;
+  conf.query_sleep_max = 20000;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+
+  struct sr_sa_txn txn;
+  dev_get_service_txn_init(context, &txn, 0x1900, "jitter", 10);
+  REQUIRE(dev_sa_submit(context->dev, &txn) == 0);
+
+  // The delay before each resend is chosen when the attempt before it timed out
+  std::vector<uint64_t> delays;
+  for (int attempts = 1; txn.status == -EINPROGRESS;) {
+    dev_sa_progress(context->dev, 1);
+    if (txn.attempts != attempts) {
+      attempts = txn.attempts;
+      delays.push_back(txn.sleep);
+    }
+  }
+  CHECK(txn.status == -ETIMEDOUT);
+  REQUIRE(delays.size() == 9);
+
+  uint64_t prev = 1000;
+  for (uint64_t delay : delays) {
+    CAPTURE(delay);
+    CHECK(delay >= 1000);
+    CHECK(delay <= std::min<uint64_t>(20000, prev * 3));
+    prev = delay;
+  }
+}
+
+TEST_CASE("a timed out lookup is tried once more after a port update") {
+  struct sr_config conf = unreachable_config(0x1910, "update-retry");
+  conf.flags = SR_NO_CIRCUIT_BREAKER;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+  struct sr_dev_service srs[2];
+
+  CHECK(sr_query_service(context, srs, 2, 2) == -ETIMEDOUT);
+  struct sr_stats stats = stats_of(context);
+  CHECK(stats.methods[SR_STATS_GET_TABLE].sends == 3);
+  CHECK(stats.methods[SR_STATS_GET_TABLE].timeouts == 3);
+  CHECK(stats.dev_updates == 1);
+}
+
+TEST_CASE("the breaker fails fast once open and closes after a successful probe") {
+  struct sr_config conf = unreachable_config(0x1920, "breaker");
+  conf.breaker_threshold = 2;
+  conf.breaker_cooldown_ms = 200;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+  struct sr_dev_service srs[2];
+
+  // The lookup and its retry after the update time out: open
+  CHECK(sr_query_service(context, srs, 2, 1) == -ETIMEDOUT);
+  uint64_t sends = stats_of(context).methods[SR_STATS_GET_TABLE].sends;
+  CHECK(sends == 2);
+
+  auto start = std::chrono::steady_clock::now();
+  CHECK(sr_query_service(context, srs, 2, 1) == -EHOSTUNREACH);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20));
+  CHECK(stats_of(context).methods[SR_STATS_GET_TABLE].sends == sends);
+  CHECK(stats_of(context).breaker_rejects == 1);
+
+  // After the cooldown one probe goes out; it times out too and the breaker opens again
+  sleep_ms(250);
+  CHECK(sr_query_service(context, srs, 2, 1) < 0);
+  CHECK(stats_of(context).methods[SR_STATS_GET_TABLE].sends == sends + 1);
+  CHECK(sr_query_service(context, srs, 2, 1) == -EHOSTUNREACH);
+
+  // A probe that gets an answer closes it
+  context->dev->loopback_latency_us = 0;
+  sleep_ms(250);
+  CHECK(sr_query_service(context, srs, 2, 1) == 0);
+  CHECK(sr_query_service(context, srs, 2, 1) == 0);
+  CHECK(stats_of(context).methods[SR_STATS_GET_TABLE].sends == sends + 3);
+  CHECK(context->dev->breaker_failures == 0);
+}
@@ -0,0 +1,100 @@
+// std
+#include <cerrno>
+#include <chrono>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+
+namespace {
+
+uint64_t sends(struct sr_ctx* context) {
+  struct sr_stats stats;
+  sr_get_stats(context, &stats);
+  return stats.methods[SR_STATS_GET].sends + stats.methods[SR_STATS_GET_TABLE].sends;
+}
+
+uint64_t coalesced(struct sr_ctx* context) {
+  struct sr_stats stats;
+  sr_get_stats(context, &stats);
+  return stats.coalesced;
+}
+
+void wait_for(struct sr_ctx* context, struct sr_request* request) {
+  auto until = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (sr_request_status(request) == -EINPROGRESS && std::chrono::steady_clock::now() < until)
+    sr_progress(context, 20);
+}
+
+}  // namespace
+
+TEST_CASE("identical queries in flight share one MAD") {
+  loopback_context publisher(0x1500, "coalesce");
+  REQUIRE(publisher.status() == 0);
+  REQUIRE(sr_register_service(publisher, "1", 1, nullptr) == 0);
+
+  struct sr_config conf = loopback_config(0x1500, "coalesce");
+  conf.loopback_latency_us = 100000;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+
+  struct sr_request* requests[3];
+  for (auto& request : requests)
+    REQUIRE(sr_query_service_async(context, nullptr, nullptr, &request) == 0);
+  CHECK(sends(context) == 1);
+  CHECK(coalesced(context) == 2);
+
+  for (auto* request : requests)
+    wait_for(context, request);
+
+  // Each follower got a copy of its own, still there once the leader is gone
+  sr_request_free(requests[0]);
+  for (int i = 1; i < 3; ++i) {
+    struct sr_dev_service srs[2];
+    CHECK(sr_request_status(requests[i]) == 1);
+    REQUIRE(sr_request_services(requests[i], srs, 2) == 1);
+    CHECK(srs[0].data[0] == '1');
+    sr_request_free(requests[i]);
+  }
+  CHECK(sends(context) == 1);
+
+  CHECK(sr_unregister_service(publisher, nullptr) == 0);
+}
+
+TEST_CASE("cancelling the leader sends the query for its first follower") {
+  loopback_context publisher(0x1510, "coalesce-cancel");
+  REQUIRE(publisher.status() == 0);
+  REQUIRE(sr_register_service(publisher, "1", 1, nullptr) == 0);
+
+  struct sr_config conf = loopback_config(0x1510, "coalesce-cancel");
+  conf.loopback_latency_us = 100000;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+
+  struct sr_request* requests[3];
+  for (auto& request : requests)
+    REQUIRE(sr_query_service_async(context, nullptr, nullptr, &request) == 0);
+  CHECK(sends(context) == 1);
+
+  sr_request_free(requests[0]);
+  CHECK(sends(context) == 2);
+
+  // A later identical query follows the new leader
+  struct sr_request* late;
+  REQUIRE(sr_query_service_async(context, nullptr, nullptr, &late) == 0);
+  CHECK(sends(context) == 2);
+  CHECK(coalesced(context) == 3);
+
+  for (auto* request : {requests[1], requests[2], late}) {
+    struct sr_dev_service srs[2];
+    wait_for(context, request);
+    CHECK(sr_request_status(request) == 1);
+    REQUIRE(sr_request_services(request, srs, 2) == 1);
+    CHECK(srs[0].data[0] == '1');
+    sr_request_free(request);
+  }
+  CHECK(sends(context) == 2);
+
+  CHECK(sr_unregister_service(publisher, nullptr) == 0);
+}
@@ -0,0 +1,32 @@
+// std
+#include <cerrno>
+#include <thread>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+
+TEST_CASE("a deadline covers the next blocking call only") {
+  struct sr_config conf = loopback_config(0x1200, "deadline");
+  conf.loopback_latency_us = 100000;
+  conf.fabric_timeout_ms = 1000;
+  conf.sr_retries = 1;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+  struct sr_dev_service srs[2];
+
+  sr_set_deadline(context, 20);
+  CHECK(sr_query_service(context, srs, 2, 1) == -ETIMEDOUT);
+  // Long expired, it no longer applies
+  CHECK(sr_query_service(context, srs, 2, 1) == 0);
+
+  // Armed by another thread, it bounds that thread's call only
+  std::thread([&] { sr_set_deadline(context, 20); }).join();
+  CHECK(sr_query_service(context, srs, 2, 1) == 0);
+
+  // Disarmed before the call
+  sr_set_deadline(context, 20);
+  sr_set_deadline(context, 0);
+  CHECK(sr_query_service(context, srs, 2, 1) == 0);
+}
@@ -0,0 +1,103 @@
+// std
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "services.h"
+
+namespace {
+
+constexpr int kNameSize = sizeof(((struct sr_ib_service_record*)nullptr)->service_name);
+
+// Records around 'name': equal, equal with junk after the NUL, longer, one
+// character off (equal for the empty name), and random, with every other
+// field random too
+std::vector<struct sr_ib_service_record> make_records(int num, const std::string& name, std::mt19937& rng) {
+  std::vector<struct sr_ib_service_record> records(num);
+
+  for (int i = 0; i < num; ++i) {
+    struct sr_ib_service_record& record = records[i];
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(&record);
+    for (size_t j = 0; j < sizeof(record); ++j)
+      bytes[j] = static_cast<uint8_t>(rng());
+
+    std::string field = name;
+    switch (i % 5) {
+    case 0:
+      break;
+    case 1:
+      field.push_back('\0');
+      break;
+    case 2:
+      field.push_back('x');
+      break;
+    case 3:
+      if (!field.empty())
+        field.back() ^= 1;
+      break;
+    default:
+      continue;
+    }
+    field.resize(kNameSize, '\0');
+    if (i % 5 == 1 && name.size() + 1 < static_cast<size_t>(kNameSize))
+      std::memset(&record.service_name[name.size() + 1], 'j', kNameSize - name.size() - 1);
+    std::memcpy(record.service_name, field.data(), kNameSize);
+  }
+  return records;
+}
+
+}  // namespace
+
+TEST_CASE("vector name matching agrees with the scalar matcher") {
+  std::mt19937 rng(2025);
+  const int num = 333;  // Not a multiple of 64
+
+  for (int len : {0, 31, 32, 63, 64}) {
+    CAPTURE(len);
+    std::string name(len, 'n');
+    for (int i = 0; i < len; ++i)
+      name[i] = static_cast<char>('a' + rng() % 26);
+
+    auto records = make_records(num, name, rng);
+    std::vector<uint64_t> vector_bits((num + 63) / 64, ~0ULL);
+    std::vector<uint64_t> scalar_bits((num + 63) / 64, ~0ULL);
+
+    int matches = decode_match_names(records.data(), sizeof(records[0]), num, name.c_str(), vector_bits.data());
+    CHECK(matches == decode_match_names_scalar(records.data(), sizeof(records[0]), num, name.c_str(), scalar_bits.data()));
+    CHECK(vector_bits == scalar_bits);
+
+    // Equal names match with anything after the NUL, longer ones only when the name fills the field
+    for (int i = 0; i < num; ++i) {
+      bool expected = i % 5 == 0 || i % 5 == 1 || (i % 5 == 2 && len == kNameSize) || (i % 5 == 3 && !len);
+      if (i % 5 == 4)
+        continue;
+      CAPTURE(i);
+      CHECK(((scalar_bits[i / 64] >> (i % 64)) & 1) == expected);
+    }
+  }
+
+  // No record holds a name longer than the field
+  std::string too_long(kNameSize + 1, 'a');
+  auto records = make_records(num, too_long.substr(0, kNameSize), rng);
+  std::vector<uint64_t> bits((num + 63) / 64);
+  CHECK(decode_match_names(records.data(), sizeof(records[0]), num, too_long.c_str(), bits.data()) == 0);
+  CHECK(decode_match_names_scalar(records.data(), sizeof(records[0]), num, too_long.c_str(), bits.data()) == 0);
+}
+
+TEST_CASE("minimum lease of a batch") {
+  std::mt19937 rng(7);
+  std::vector<struct sr_ib_service_record> records(37);
+  uint32_t min = UINT32_MAX;
+
+  for (auto& record : records) {
+    uint32_t lease = rng();
+    record.service_lease = __cpu_to_be32(lease);
+    min = lease < min ? lease : min;
+  }
+  CHECK(decode_min_lease(records.data(), sizeof(records[0]), static_cast<int>(records.size())) == min);
+  CHECK(decode_min_lease(records.data(), sizeof(records[0]), 0) == UINT32_MAX);
+}
@@ -0,0 +1,125 @@
+// std
+#include <cerrno>
+#include <cstring>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+#include "services.h"
+
+// With SR_MULTI_PORT a port that cannot be updated anymore is replaced by
+// another one, here a new port of the loopback SA.
+
+namespace {
+
+constexpr int kEntries = 3;
+
+// The port is gone; the fabric behind the next one answers again
+int port_gone(struct sr_dev* dev) {
+  dev->loopback_latency_us = 0;
+  return -ENETDOWN;
+}
+
+// Have the port of 'context' go down at its next update
+void take_port_down(struct sr_ctx* context, struct sr_transport_ops* ops) {
+  *ops = *context->dev->transport;
+  ops->update = port_gone;
+  __atomic_store_n(&context->dev->transport, ops, __ATOMIC_RELEASE);
+}
+
+void register_entries(struct sr_ctx* context, uint64_t id, const char* name) {
+  static const uint8_t key[SR_128_BIT_SIZE] = {0x17, 0x01};
+  struct sr_service_entry entries[kEntries] = {};
+
+  for (int i = 0; i < kEntries; ++i) {
+    entries[i].id = id + i;
+    entries[i].name = name;
+    entries[i].data = "m";
+    entries[i].data_size = 1;
+  }
+  entries[1].service_key = &key;
+  REQUIRE(sr_register_services(context, entries, kEntries) == kEntries);
+}
+
+// The records of service 'id' with the name of 'observer'
+int records_of(struct sr_ctx* observer, uint64_t id, struct sr_dev_service* srs, int max) {
+  struct sr_query_filter filter = {};
+  filter.flags = SR_QUERY_FILTER_NAME;
+  filter.id = id;
+  return sr_query_service_filter(observer, &filter, srs, max, 1);
+}
+
+// Every record is on the new port and none is left on the old one
+void check_moved(struct sr_ctx* context, struct sr_ctx* observer, const uint8_t* old_gid, uint64_t id) {
+  const uint8_t* new_gid = context->dev->port_gid.raw;
+  struct sr_dev_service srs[2];
+
+  CHECK(memcmp(old_gid, new_gid, 16) != 0);
+  for (int i = 0; i < kEntries; ++i) {
+    CAPTURE(i);
+    REQUIRE(records_of(observer, id + i, srs, 2) == 1);
+    CHECK(!memcmp(srs[0].port_gid, new_gid, sizeof(srs[0].port_gid)));
+    CHECK(srs[0].data[0] == 'm');
+  }
+
+  struct sr_stats stats;
+  sr_get_stats(context, &stats);
+  CHECK(stats.failovers == 1);
+  CHECK(stats.methods[SR_STATS_DELETE].requests == kEntries);
+}
+
+}  // namespace
+
+TEST_CASE("a lookup timing out fails over and moves the records") {
+  struct sr_config conf = loopback_config(0x1b10, "failover");
+  conf.flags = SR_MULTI_PORT;
+  conf.fabric_timeout_ms = 20;
+  struct sr_transport_ops ops;
+  loopback_context context(conf);
+  loopback_context observer(0x1b10, "failover");
+  REQUIRE(context.status() == 0);
+  REQUIRE(observer.status() == 0);
+
+  register_entries(context, 0x1b10, "failover");
+  uint8_t old_gid[16];
+  memcpy(old_gid, context->dev->port_gid.raw, sizeof(old_gid));
+
+  // The SA stops answering: the update after the timeout fails over and the
+  // lookup is retried on the new port
+  context->dev->loopback_latency_us = 1000000;
+  take_port_down(context, &ops);
+  struct sr_dev_service srs[2];
+  CHECK(sr_query_service(context, srs, 2, 1) == 1);
+  CHECK(!memcmp(srs[0].port_gid, context->dev->port_gid.raw, sizeof(srs[0].port_gid)));
+  check_moved(context, observer, old_gid, 0x1b10);
+}
+
+TEST_CASE("the I/O thread fails over and moves the records") {
+  struct sr_config conf = loopback_config(0x1b20, "failover-io");
+  conf.flags = SR_MULTI_PORT | SR_IO_THREAD;
+  struct sr_transport_ops ops;
+  loopback_context context(conf);
+  loopback_context observer(0x1b20, "failover-io");
+  REQUIRE(context.status() == 0);
+  REQUIRE(observer.status() == 0);
+
+  register_entries(context, 0x1b20, "failover-io");
+  uint8_t old_gid[16];
+  memcpy(old_gid, context->dev->port_gid.raw, sizeof(old_gid));
+
+  take_port_down(context, &ops);
+  CHECK(dev_update(context->dev) == 0);
+  check_moved(context, observer, old_gid, 0x1b20);
+
+  // Unregistering now deletes the records on the new port
+  struct sr_dev_service srs[kEntries] = {};
+  for (int i = 0; i < kEntries; ++i) {
+    srs[i].id = 0x1b20 + i;
+    strcpy(srs[i].name, "failover-io");
+    memcpy(srs[i].port_gid, context->dev->port_gid.raw, sizeof(srs[i].port_gid));
+  }
+  CHECK(sr_unregister_services(context, srs, kEntries, nullptr) == 0);
+  for (int i = 0; i < kEntries; ++i)
+    CHECK(records_of(observer, 0x1b20 + i, srs, kEntries) == 0);
+}
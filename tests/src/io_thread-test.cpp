@@ -0,0 +1,116 @@
+// std
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+#include "services.h"
+
+namespace {
+
+struct sr_config io_thread_config(uint64_t service_id, const char* service_name) {
+  struct sr_config conf = loopback_config(service_id, service_name);
+  conf.flags = SR_IO_THREAD;
+  conf.loopback_latency_us = 2000;
+  return conf;
+}
+
+int wait_status(const struct sr_sa_txn& txn) {
+  auto until = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  int status;
+  while ((status = __atomic_load_n(&txn.status, __ATOMIC_ACQUIRE)) == -EINPROGRESS &&
+         std::chrono::steady_clock::now() < until)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  return status;
+}
+
+}  // namespace
+
+TEST_CASE("threads register and query through one I/O thread") {
+  constexpr int kThreads = 8;
+  constexpr int kQueries = 20;
+  loopback_context context(io_thread_config(0x1a00, "io-thread"));
+  REQUIRE(context.status() == 0);
+  REQUIRE(sr_register_service(context, "a", 1, nullptr) == 0);
+
+  // Every thread pushes onto the queue while the others do
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      struct sr_service_entry entry = {};
+      entry.id = 0x1a10 + t;
+      entry.name = "io-thread-entry";
+      entry.data = "e";
+      entry.data_size = 1;
+      if (sr_register_services(context, &entry, 1) != 1 || entry.status < 0)
+        failures++;
+
+      struct sr_dev_service srs[2];
+      for (int i = 0; i < kQueries; ++i)
+        if (sr_query_service(context, srs, 2, 1) != 1 || srs[0].data[0] != 'a')
+          failures++;
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  CHECK(failures == 0);
+
+  // Each query was sent or followed one that was
+  struct sr_stats stats;
+  sr_get_stats(context, &stats);
+  CHECK(stats.methods[SR_STATS_GET_TABLE].requests >= kThreads * kQueries);
+  CHECK(stats.methods[SR_STATS_GET_TABLE].found >= kThreads * kQueries);
+
+  struct sr_dev_service entries[kThreads] = {};
+  for (int t = 0; t < kThreads; ++t) {
+    entries[t].id = 0x1a10 + t;
+    strcpy(entries[t].name, "io-thread-entry");
+    memcpy(entries[t].port_gid, &context->dev->port_gid, sizeof(entries[t].port_gid));
+  }
+  CHECK(sr_unregister_services(context, entries, kThreads, nullptr) == 0);
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+}
+
+TEST_CASE("operations of other threads run on the I/O thread") {
+  struct sr_config conf = io_thread_config(0x1a20, "io-call");
+  conf.loopback_latency_us = 1000000;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+  struct sr_dev* dev = context->dev;
+  CHECK(!dev_io_direct(dev));
+
+  // The update is done by the I/O thread and waited for
+  CHECK(dev_update(dev) == 0);
+
+  // So is the cancel of a pending transaction
+  struct sr_sa_txn txn;
+  dev_get_service_txn_init(context, &txn, 0x1a20, "io-call", 1);
+  REQUIRE(dev_sa_submit(dev, &txn) == 0);
+  dev_sa_cancel(dev, &txn);
+  CHECK(txn.status == -ECANCELED);
+}
+
+TEST_CASE("stopping the I/O thread cancels outstanding transactions") {
+  struct sr_config conf = io_thread_config(0x1a30, "io-stop");
+  conf.loopback_latency_us = 1000000;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+  struct sr_dev* dev = context->dev;
+
+  struct sr_sa_txn txn;
+  dev_get_service_txn_init(context, &txn, 0x1a30, "io-stop", 1);
+  REQUIRE(dev_sa_submit(dev, &txn) == 0);
+  while (sent(context, SR_STATS_GET_TABLE) == 0)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  io_thread_stop(dev);
+  CHECK(wait_status(txn) == -ECANCELED);
+  CHECK(dev->io == nullptr);
+}
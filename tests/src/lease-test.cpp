@@ -0,0 +1,153 @@
+// std
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+#include "services.h"
+
+namespace {
+
+struct renewal_failures {
+  int num = 0;
+  uint64_t id = 0;
+  std::string name;
+  int status = 0;
+};
+
+void count_failure(struct sr_ctx*, uint64_t id, const char* name, int status, void* arg) {
+  auto* failures = static_cast<renewal_failures*>(arg);
+  failures->num++;
+  failures->id = id;
+  failures->name = name;
+  failures->status = status;
+}
+
+void ignore_notice(struct sr_ctx*, const struct sr_notice*, void*) {}
+
+// Progress the context until 'ms' after 'start'
+void progress_until(struct sr_ctx* context, std::chrono::steady_clock::time_point start, int ms) {
+  while (std::chrono::steady_clock::now() < start + std::chrono::milliseconds(ms))
+    sr_progress(context, 20);
+}
+
+struct sr_config lease_config(uint64_t service_id, const char* service_name, int lease_time) {
+  struct sr_config conf = loopback_config(service_id, service_name);
+  conf.sr_lease_time = lease_time;
+  return conf;
+}
+
+}  // namespace
+
+TEST_CASE("leases are renewed a margin before they run out") {
+  loopback_context context(lease_config(0x1300, "lease-timing", 3));
+  REQUIRE(context.status() == 0);
+  renewal_failures failures;
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(sr_enable_renewal(context, 1000, count_failure, &failures) == 0);
+  REQUIRE(sr_register_service(context, "a", 1, nullptr) == 0);
+  CHECK(sent(context, SR_STATS_SET) == 1);
+  CHECK(sr_get_timeout(context) > 1000);
+
+  // 3 s leases with a 1 s margin are SET again every 2 s
+  progress_until(context, start, 1500);
+  CHECK(sent(context, SR_STATS_SET) == 1);
+  progress_until(context, start, 2500);
+  CHECK(sent(context, SR_STATS_SET) == 2);
+  progress_until(context, start, 3500);
+  CHECK(sent(context, SR_STATS_SET) == 2);
+  progress_until(context, start, 4500);
+  CHECK(sent(context, SR_STATS_SET) == 3);
+  CHECK(failures.num == 0);
+
+  REQUIRE(sr_unregister_service(context, nullptr) == 0);
+  progress_until(context, start, 6500);
+  CHECK(sent(context, SR_STATS_SET) == 3);
+  CHECK(sr_get_timeout(context) == -1);
+}
+
+TEST_CASE("a port event renews every lease on the next tick") {
+  loopback_context context(lease_config(0x1310, "lease-kick", 60));
+  REQUIRE(context.status() == 0);
+  REQUIRE(sr_enable_renewal(context, 1000, nullptr, nullptr) == 0);
+  REQUIRE(sr_register_service(context, "a", 1, nullptr) == 0);
+  REQUIRE(sr_subscribe(context, ignore_notice, nullptr) == 0);
+  uint64_t sets = sent(context, SR_STATS_SET);
+
+  // Another port coming up is reported as a GID in service trap
+  { loopback_context other(0x1311, "lease-kick-other"); REQUIRE(other.status() == 0); }
+  auto start = std::chrono::steady_clock::now();
+  progress_until(context, start, 1500);
+  CHECK(sent(context, SR_STATS_SET) == sets + 1);
+
+  // The renewal put it back on its 59 s interval
+  CHECK(sr_get_timeout(context) > 5000);
+
+  // Without a trap, a kick is the same
+  lease_kick(context);
+  start = std::chrono::steady_clock::now();
+  progress_until(context, start, 1500);
+  CHECK(sent(context, SR_STATS_SET) == sets + 2);
+
+  CHECK(sr_unsubscribe(context) == 0);
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+}
+
+TEST_CASE("a lease unregistered while it is renewed goes when the SET completes") {
+  loopback_context context(lease_config(0x1320, "lease-untrack", 3));
+  REQUIRE(context.status() == 0);
+  renewal_failures failures;
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(sr_enable_renewal(context, 1000, count_failure, &failures) == 0);
+  REQUIRE(sr_register_service(context, "a", 1, nullptr) == 0);
+
+  // Hold the renewal in flight, then unregister under it
+  context->dev->loopback_latency_us = 300000;
+  while (sent(context, SR_STATS_SET) < 2 && std::chrono::steady_clock::now() < start + std::chrono::seconds(4))
+    sr_progress(context, 20);
+  REQUIRE(sent(context, SR_STATS_SET) == 2);
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+
+  // The renewal completed and was freed, nothing is renewed anymore
+  progress_until(context, start, 5500);
+  CHECK(sent(context, SR_STATS_SET) == 2);
+  CHECK(failures.num == 0);
+  CHECK(sr_get_timeout(context) == -1);
+}
+
+TEST_CASE("a failed renewal is reported and tried again later") {
+  struct sr_config conf = lease_config(0x1330, "lease-fail", 3);
+  conf.fabric_timeout_ms = 100;
+  conf.sr_retries = 1;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+  renewal_failures failures;
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(sr_enable_renewal(context, 1000, count_failure, &failures) == 0);
+  REQUIRE(sr_register_service(context, "a", 1, nullptr) == 0);
+
+  // Responses now come after the renewal gave up on them
+  context->dev->loopback_latency_us = 400000;
+  progress_until(context, start, 3000);
+  REQUIRE(failures.num == 1);
+  CHECK(failures.id == 0x1330);
+  CHECK(failures.name == "lease-fail");
+  CHECK(failures.status == -ETIMEDOUT);
+  uint64_t sets = sent(context, SR_STATS_SET);
+
+  // The retry waits much longer than the usual 2 s interval
+  CHECK(sr_get_timeout(context) > 5000);
+  progress_until(context, start, 5000);
+  CHECK(sent(context, SR_STATS_SET) == sets);
+
+  // 10 s after the failure it goes through
+  context->dev->loopback_latency_us = 0;
+  progress_until(context, start, 13500);
+  CHECK(sent(context, SR_STATS_SET) == sets + 1);
+  CHECK(failures.num == 1);
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+// std
+#include <cstdint>
+// project
+#include <service_record/service_record.h>
+
+// Contexts on the in-process SA of SR_MAD_SEND_LOOPBACK, whose records are
+// shared by the whole process: give each test case its own service IDs.
+
+inline void quiet_log(const char*, int, const char*, int, const char*, ...) {}
+
+inline struct sr_config loopback_config(uint64_t service_id, const char* service_name) {
+  struct sr_config conf = {};
+  conf.mad_send_type = SR_MAD_SEND_LOOPBACK;
+  conf.service_id = service_id;
+  conf.service_name = const_cast<char*>(service_name);
+  conf.sr_retries = 2;
+  conf.query_sleep = 1000;
+  return conf;
+}
+
+// Context released at the end of the scope
+class loopback_context {
+public:
+  explicit loopback_context(struct sr_config conf) { status_ = sr_init(&context_, "", 0, quiet_log, &conf); }
+  loopback_context(uint64_t service_id, const char* service_name)
+      : loopback_context(loopback_config(service_id, service_name)) {}
+  ~loopback_context() {
+    if (context_)
+      sr_cleanup(context_);
+  }
+  loopback_context(const loopback_context&) = delete;
+  loopback_context& operator=(const loopback_context&) = delete;
+
+  int status() const { return status_; }
+  operator struct sr_ctx*() const { return context_; }
+  struct sr_ctx* operator->() const { return context_; }
+
+private:
+  struct sr_ctx* context_ = nullptr;
+  int status_;
+};
+
+inline uint64_t sent(struct sr_ctx* context, int method) {
+  struct sr_stats stats;
+  sr_get_stats(context, &stats);
+  return stats.methods[method].requests;
+}
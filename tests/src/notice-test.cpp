@@ -0,0 +1,68 @@
+// std
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <vector>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+
+namespace {
+
+void record_notice(struct sr_ctx*, const struct sr_notice* notice, void* arg) {
+  static_cast<std::vector<struct sr_notice>*>(arg)->push_back(*notice);
+}
+
+void progress_until(struct sr_ctx* context, const std::vector<struct sr_notice>& notices, size_t num) {
+  auto until = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (notices.size() < num && std::chrono::steady_clock::now() < until)
+    sr_progress(context, 20);
+}
+
+uint64_t lookups(struct sr_ctx* context) {
+  return sent(context, SR_STATS_GET) + sent(context, SR_STATS_GET_TABLE);
+}
+
+}  // namespace
+
+TEST_CASE("ports coming and going are reported and expire the query cache") {
+  struct sr_config conf = loopback_config(0x1800, "notice");
+  conf.query_cache_ttl_ms = 60000;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+  std::vector<struct sr_notice> notices;
+  REQUIRE(sr_subscribe(context, record_notice, &notices) == 0);
+
+  struct sr_dev_service srs[2];
+  REQUIRE(sr_query_service(context, srs, 2, 1) == 0);
+  REQUIRE(sr_query_service(context, srs, 2, 1) == 0);
+  uint64_t before = lookups(context);
+
+  auto other = std::make_unique<loopback_context>(0x1810, "notice-other");
+  REQUIRE(other->status() == 0);
+  uint8_t gid[16];
+  memcpy(gid, &(*other)->dev->port_gid, sizeof(gid));
+
+  progress_until(context, notices, 1);
+  REQUIRE(notices.size() == 1);
+  CHECK(notices[0].trap_num == SR_TRAP_GID_IN_SERVICE);
+  CHECK(!memcmp(notices[0].gid, gid, sizeof(gid)));
+  REQUIRE(sr_query_service(context, srs, 2, 1) == 0);
+  CHECK(lookups(context) == before + 1);
+
+  other.reset();
+  progress_until(context, notices, 2);
+  REQUIRE(notices.size() == 2);
+  CHECK(notices[1].trap_num == SR_TRAP_GID_OUT_OF_SERVICE);
+  CHECK(!memcmp(notices[1].gid, gid, sizeof(gid)));
+  REQUIRE(sr_query_service(context, srs, 2, 1) == 0);
+  CHECK(lookups(context) == before + 2);
+
+  // Not reported anymore once unsubscribed
+  CHECK(sr_unsubscribe(context) == 0);
+  { loopback_context again(0x1820, "notice-again"); REQUIRE(again.status() == 0); }
+  sr_progress(context, 100);
+  CHECK(notices.size() == 2);
+}
@@ -0,0 +1,93 @@
+// std
+#include <chrono>
+#include <thread>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+#include "services.h"
+
+namespace {
+
+uint64_t queries(struct sr_ctx* context) {
+  return sent(context, SR_STATS_GET) + sent(context, SR_STATS_GET_TABLE);
+}
+
+void sleep_ms(int ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+}  // namespace
+
+TEST_CASE("query cache serves fresh, then stale, then asks the SA again") {
+  // Registered from another context, which does not invalidate the cache of 'context'
+  loopback_context publisher(0x600, "cached");
+  struct sr_config conf = loopback_config(0x600, "cached");
+  conf.query_cache_ttl_ms = 200;
+  conf.query_cache_stale_ms = 200;
+  loopback_context context(conf);
+  REQUIRE(publisher.status() == 0);
+  REQUIRE(context.status() == 0);
+
+  struct sr_dev_service srs[4];
+  REQUIRE(sr_register_service(publisher, "1", 1, nullptr) == 0);
+  REQUIRE(sr_query_service(context, srs, 4, 1) == 1);
+  uint64_t before = queries(context);
+
+  // Fresh: answered from the cache, changes are not seen
+  REQUIRE(sr_register_service(publisher, "2", 1, nullptr) == 0);
+  REQUIRE(sr_query_service(context, srs, 4, 1) == 1);
+  CHECK(srs[0].data[0] == '1');
+  CHECK(queries(context) == before);
+
+  // Stale: still answered from the cache while a refresh goes out
+  sleep_ms(250);
+  REQUIRE(sr_query_service(context, srs, 4, 1) == 1);
+  CHECK(srs[0].data[0] == '1');
+  CHECK(queries(context) == before + 1);
+
+  // The next lookup completes the refresh itself, without sr_progress()
+  REQUIRE(sr_query_service(context, srs, 4, 1) == 1);
+  CHECK(srs[0].data[0] == '2');
+  CHECK(queries(context) == before + 1);
+
+  // Expired: past the stale window the SA is asked before answering
+  CHECK(sr_unregister_service(publisher, nullptr) == 0);
+  sleep_ms(450);
+  CHECK(sr_query_service(context, srs, 4, 1) == 0);
+  CHECK(queries(context) == before + 2);
+}
+
+TEST_CASE("a refresh sent before the cache expired is not taken in") {
+  loopback_context publisher(0x610, "refresh-epoch");
+  struct sr_config conf = loopback_config(0x610, "refresh-epoch");
+  conf.query_cache_ttl_ms = 100;
+  conf.query_cache_stale_ms = 1000;
+  loopback_context context(conf);
+  REQUIRE(publisher.status() == 0);
+  REQUIRE(context.status() == 0);
+
+  struct sr_dev_service srs[4];
+  REQUIRE(sr_register_service(publisher, "1", 1, nullptr) == 0);
+  REQUIRE(sr_query_service(context, srs, 4, 1) == 1);
+  uint64_t before = queries(context);
+
+  // Stale: the refresh goes out and is answered with what the SA has now
+  sleep_ms(150);
+  REQUIRE(sr_query_service(context, srs, 4, 1) == 1);
+  CHECK(queries(context) == before + 1);
+
+  // A trap expires the cache while the refresh is in flight, its answer is outdated
+  REQUIRE(sr_register_service(publisher, "2", 1, nullptr) == 0);
+  query_cache_expire(context);
+  REQUIRE(sr_query_service(context, srs, 4, 1) == 1);
+  CHECK(srs[0].data[0] == '2');
+  CHECK(queries(context) == before + 2);
+
+  // The fresh answer is cached
+  REQUIRE(sr_query_service(context, srs, 4, 1) == 1);
+  CHECK(srs[0].data[0] == '2');
+  CHECK(queries(context) == before + 2);
+  CHECK(sr_unregister_service(publisher, nullptr) == 0);
+}
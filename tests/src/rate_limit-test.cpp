@@ -0,0 +1,86 @@
+// std
+#include <cerrno>
+#include <chrono>
+#include <memory>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+
+// The limits are process-wide: every context asking for some is gone by the
+// end of each test case, which lifts them for the next one.
+
+namespace {
+
+uint64_t throttled(struct sr_ctx* context) {
+  struct sr_stats stats;
+  sr_get_stats(context, &stats);
+  return stats.throttled;
+}
+
+struct sr_config limited_config(uint64_t service_id, unsigned queries, unsigned burst, uint32_t flags) {
+  struct sr_config conf = loopback_config(service_id, "rate-limit");
+  conf.rate_limit_queries = queries;
+  conf.rate_limit_burst = burst;
+  conf.flags = flags;
+  return conf;
+}
+
+}  // namespace
+
+TEST_CASE("queries past the burst wait for their turn") {
+  loopback_context context(limited_config(0x1600, 20, 2, 0));
+  REQUIRE(context.status() == 0);
+  struct sr_dev_service srs[2];
+
+  // Updates are not limited
+  REQUIRE(sr_register_service(context, "a", 1, nullptr) == 0);
+  CHECK(throttled(context) == 0);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 5; ++i)
+    REQUIRE(sr_query_service(context, srs, 2, 1) == 1);
+  // Two back to back, then one every 50 ms
+  CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(140));
+  CHECK(throttled(context) >= 3);
+
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+}
+
+TEST_CASE("with SR_RATE_LIMIT_REJECT queries past the burst fail") {
+  loopback_context context(limited_config(0x1610, 5, 1, SR_RATE_LIMIT_REJECT));
+  REQUIRE(context.status() == 0);
+  struct sr_dev_service srs[2];
+
+  auto start = std::chrono::steady_clock::now();
+  CHECK(sr_query_service(context, srs, 2, 1) == 0);
+  CHECK(sr_query_service(context, srs, 2, 1) == -EBUSY);
+  CHECK(sr_query_service(context, srs, 2, 1) == -EBUSY);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100));
+  CHECK(throttled(context) == 2);
+}
+
+TEST_CASE("the strictest limit applies until the last context asking for one goes") {
+  auto strict = std::make_unique<loopback_context>(limited_config(0x1620, 5, 1, SR_RATE_LIMIT_REJECT));
+  auto loose = std::make_unique<loopback_context>(limited_config(0x1620, 1000, 100, SR_RATE_LIMIT_REJECT));
+  loopback_context unlimited(limited_config(0x1620, 0, 0, SR_RATE_LIMIT_REJECT));
+  REQUIRE(strict->status() == 0);
+  REQUIRE(loose->status() == 0);
+  REQUIRE(unlimited.status() == 0);
+  struct sr_dev_service srs[2];
+
+  // Neither a looser limit nor none at all relaxes it
+  CHECK(sr_query_service(*loose, srs, 2, 1) == 0);
+  CHECK(sr_query_service(unlimited, srs, 2, 1) == -EBUSY);
+  CHECK(sr_query_service(*loose, srs, 2, 1) == -EBUSY);
+
+  // Still in force while one of them is left
+  strict.reset();
+  CHECK(sr_query_service(unlimited, srs, 2, 1) == -EBUSY);
+
+  loose.reset();
+  for (int i = 0; i < 5; ++i)
+    CHECK(sr_query_service(unlimited, srs, 2, 1) == 0);
+  CHECK(throttled(unlimited) == 2);
+}
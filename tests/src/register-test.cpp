@@ -0,0 +1,66 @@
+// std
+#include <cerrno>
+#include <cstring>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+
+namespace {
+
+int query_id(struct sr_ctx* context, uint64_t id, struct sr_dev_service* srs, int num) {
+  struct sr_query_filter filter = {};
+  filter.id = id;
+  return sr_query_service_filter(context, &filter, srs, num, 1);
+}
+
+}  // namespace
+
+TEST_CASE("batch registration reports each entry") {
+  loopback_context context(0x500, "batch");
+  loopback_context other(0x500, "batch");
+  REQUIRE(context.status() == 0);
+  REQUIRE(other.status() == 0);
+
+  // A record of another port the batch must replace
+  struct sr_service_entry stale = {};
+  stale.id = 0x501;
+  stale.data = "old";
+  stale.data_size = 3;
+  REQUIRE(sr_register_services(other, &stale, 1) == 1);
+  CHECK(stale.status == 0);
+
+  char too_long[SR_DEV_SERVICE_DATA_MAX + 1] = {};
+  struct sr_service_entry entries[4] = {};
+  entries[0].data = "a";  // Context ID and name
+  entries[0].data_size = 1;
+  entries[1].id = 0x501;
+  entries[1].data = "b";
+  entries[1].data_size = 1;
+  entries[2].id = 0x502;
+  entries[2].data = too_long;
+  entries[2].data_size = sizeof(too_long);
+  entries[3].id = 0x503;
+  entries[3].name = "named";
+  entries[3].data = "d";
+  entries[3].data_size = 1;
+
+  CHECK(sr_register_services(context, entries, 4) == 3);
+  CHECK(entries[0].status == 0);
+  CHECK(entries[1].status == 0);
+  CHECK(entries[2].status == -EINVAL);
+  CHECK(entries[3].status == 0);
+
+  struct sr_dev_service srs[4];
+  REQUIRE(query_id(context, 0x500, srs, 4) == 1);
+  CHECK(std::strcmp(srs[0].name, "batch") == 0);
+  REQUIRE(query_id(context, 0x501, srs, 4) == 1);
+  CHECK(srs[0].data[0] == 'b');
+  CHECK(query_id(context, 0x502, srs, 4) == 0);
+  REQUIRE(query_id(context, 0x503, srs, 4) == 1);
+  CHECK(std::strcmp(srs[0].name, "named") == 0);
+  CHECK(srs[0].data[0] == 'd');
+
+  CHECK(sr_register_services(context, entries, 0) == 0);
+}
@@ -0,0 +1,222 @@
+// std
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "services.h"
+
+// Synthetic GET_TABLE responses fed to the verbs RMPP receiver; the ACKs it
+// sends are caught at ibv_post_send() instead of going to a QP.
+
+namespace {
+
+constexpr int kRecordSize = 176;
+constexpr int kHeaderSize = offsetof(struct umad_sa_packet, data);
+constexpr uint64_t kTid = 0x1b00;
+
+struct rmpp_ack {
+  uint32_t seg_num;
+  uint32_t newwin;
+};
+
+struct rmpp_dev {
+  struct sr_dev dev = {};
+  struct ibv_context ctx = {};
+  struct ibv_qp qp = {};
+  struct ibv_mr mr = {};
+  std::vector<char> mad_buf = std::vector<char>(SR_VERBS_SEND_DEPTH * SR_VERBS_MAD_SIZE);
+  std::vector<rmpp_ack> acks;
+
+  rmpp_dev() {
+    ctx.ops.post_send = post_send;
+    qp.context = &ctx;
+    dev.verbs.qp = &qp;
+    dev.verbs.mad_buf = mad_buf.data();
+    dev.verbs.mad_buf_mr = &mr;
+    current = this;
+  }
+
+  ~rmpp_dev() {
+    struct umad_sa_packet seg = {};
+    struct umad_sa_packet* mad;
+    int length;
+
+    // An ABORT drops whatever is still being reassembled
+    seg.mad_hdr.tid = __cpu_to_be64(kTid);
+    seg.rmpp_hdr.rmpp_type = UMAD_RMPP_TYPE_ABORT;
+    verbs_rmpp_recv(&dev, &seg, sizeof(seg), &mad, &length);
+    free(dev.verbs.rmpp_last);
+    current = nullptr;
+  }
+
+  static int post_send(struct ibv_qp*, struct ibv_send_wr* wr, struct ibv_send_wr**) {
+    auto* ack = reinterpret_cast<struct umad_sa_packet*>(static_cast<uintptr_t>(wr->sg_list->addr));
+    CHECK(ack->rmpp_hdr.rmpp_type == UMAD_RMPP_TYPE_ACK);
+    CHECK(ack->mad_hdr.tid == __cpu_to_be64(kTid));
+    current->acks.push_back({__be32_to_cpu(ack->rmpp_hdr.seg_num), __be32_to_cpu(ack->rmpp_hdr.paylen_newwin)});
+    current->dev.verbs.send_completed++;
+    return 0;
+  }
+
+  static rmpp_dev* current;
+};
+
+rmpp_dev* rmpp_dev::current;
+
+uint8_t payload_byte(int i) {
+  return static_cast<uint8_t>(i * 7 + 3);
+}
+
+// Segment 'seg_num' of a response carrying 'records' records
+struct umad_sa_packet segment(int records, int seg_num) {
+  int data_len = records * kRecordSize;
+  int num_segs = (data_len + UMAD_LEN_SA_DATA - 1) / UMAD_LEN_SA_DATA;
+  int pad = num_segs * UMAD_LEN_SA_DATA - data_len;
+  struct umad_sa_packet seg = {};
+
+  seg.mad_hdr.tid = __cpu_to_be64(kTid);
+  seg.mad_hdr.method = UMAD_SA_METHOD_GET_TABLE_RESP;
+  seg.attr_offset = __cpu_to_be16(kRecordSize / 8);
+  seg.rmpp_hdr.rmpp_version = UMAD_RMPP_VERSION;
+  seg.rmpp_hdr.rmpp_type = UMAD_RMPP_TYPE_DATA;
+  seg.rmpp_hdr.rmpp_rtime_flags = UMAD_RMPP_FLAG_ACTIVE;
+  if (seg_num == 1)
+    seg.rmpp_hdr.rmpp_rtime_flags |= UMAD_RMPP_FLAG_FIRST;
+  if (seg_num == num_segs)
+    seg.rmpp_hdr.rmpp_rtime_flags |= UMAD_RMPP_FLAG_LAST;
+  seg.rmpp_hdr.seg_num = __cpu_to_be32(seg_num);
+
+  // The first segment announces the whole payload, the last counts its own bytes
+  if (seg_num == 1)
+    seg.rmpp_hdr.paylen_newwin = __cpu_to_be32(num_segs * UMAD_LEN_RMPP_DATA - pad);
+  else if (seg_num == num_segs)
+    seg.rmpp_hdr.paylen_newwin = __cpu_to_be32(UMAD_LEN_RMPP_DATA - pad);
+
+  for (int i = 0; i < UMAD_LEN_SA_DATA; ++i) {
+    int offset = (seg_num - 1) * UMAD_LEN_SA_DATA + i;
+    if (offset < data_len)
+      seg.data[i] = payload_byte(offset);
+  }
+  return seg;
+}
+
+int feed(rmpp_dev& rmpp, int records, int seg_num, struct umad_sa_packet** mad, int* length) {
+  struct umad_sa_packet seg = segment(records, seg_num);
+  return verbs_rmpp_recv(&rmpp.dev, &seg, sizeof(seg), mad, length);
+}
+
+void check_payload(const struct umad_sa_packet* mad, int records) {
+  const auto* data = reinterpret_cast<const uint8_t*>(mad) + kHeaderSize;
+  int mismatches = 0;
+  for (int i = 0; i < records * kRecordSize; ++i)
+    if (data[i] != payload_byte(i))
+      mismatches++;
+  CHECK(mismatches == 0);
+}
+
+}  // namespace
+
+TEST_CASE("RMPP segments are reassembled and ACKed once per window") {
+  // 79 records take 70 segments, the last one padded with 96 bytes
+  constexpr int kRecords = 79;
+  constexpr int kSegments = 70;
+  rmpp_dev rmpp;
+  struct umad_sa_packet* mad = nullptr;
+  int length = 0;
+
+  for (int seg_num = 1; seg_num < kSegments; ++seg_num)
+    REQUIRE(feed(rmpp, kRecords, seg_num, &mad, &length) == 0);
+  REQUIRE(feed(rmpp, kRecords, kSegments, &mad, &length) == 1);
+
+  CHECK(length == kHeaderSize + kRecords * kRecordSize);
+  CHECK(mad->mad_hdr.tid == __cpu_to_be64(kTid));
+  CHECK(__be16_to_cpu(mad->attr_offset) == kRecordSize / 8);
+  check_payload(mad, kRecords);
+  CHECK(rmpp.dev.verbs.rmpp == nullptr);
+  CHECK(rmpp.dev.verbs.rmpp_last == mad);
+
+  // The first segment and each one ending a window, then the last
+  REQUIRE(rmpp.acks.size() == 4);
+  CHECK(rmpp.acks[0].seg_num == 1);
+  CHECK(rmpp.acks[0].newwin == 1 + SR_VERBS_RMPP_WINDOW);
+  CHECK(rmpp.acks[1].seg_num == 1 + SR_VERBS_RMPP_WINDOW);
+  CHECK(rmpp.acks[1].newwin == 1 + 2 * SR_VERBS_RMPP_WINDOW);
+  CHECK(rmpp.acks[2].seg_num == 1 + 2 * SR_VERBS_RMPP_WINDOW);
+  CHECK(rmpp.acks[3].seg_num == kSegments);
+}
+
+TEST_CASE("the last RMPP segment's padding is not part of the response") {
+  rmpp_dev rmpp;
+  struct umad_sa_packet* mad = nullptr;
+  int length = 0;
+
+  // A single segment, 24 bytes of it padding
+  REQUIRE(feed(rmpp, 1, 1, &mad, &length) == 1);
+  CHECK(length == kHeaderSize + kRecordSize);
+  check_payload(mad, 1);
+  free(rmpp.dev.verbs.rmpp_last);
+  rmpp.dev.verbs.rmpp_last = nullptr;
+
+  // Records filling the last segment exactly: no padding
+  constexpr int kRecords = 25;
+  static_assert(kRecords * kRecordSize % UMAD_LEN_SA_DATA == 0, "unpadded response");
+  for (int seg_num = 1; seg_num < kRecords * kRecordSize / UMAD_LEN_SA_DATA; ++seg_num)
+    REQUIRE(feed(rmpp, kRecords, seg_num, &mad, &length) == 0);
+  REQUIRE(feed(rmpp, kRecords, kRecords * kRecordSize / UMAD_LEN_SA_DATA, &mad, &length) == 1);
+  CHECK(length == kHeaderSize + kRecords * kRecordSize);
+  check_payload(mad, kRecords);
+}
+
+TEST_CASE("a duplicate RMPP segment is ACKed again, one out of order dropped") {
+  constexpr int kRecords = 7;
+  rmpp_dev rmpp;
+  struct umad_sa_packet* mad = nullptr;
+  int length = 0;
+
+  REQUIRE(feed(rmpp, kRecords, 1, &mad, &length) == 0);
+  REQUIRE(feed(rmpp, kRecords, 2, &mad, &length) == 0);
+  REQUIRE(feed(rmpp, kRecords, 3, &mad, &length) == 0);
+  REQUIRE(rmpp.acks.size() == 1);
+
+  // The sender missed our ACK: tell it again where we are
+  CHECK(feed(rmpp, kRecords, 2, &mad, &length) == 0);
+  REQUIRE(rmpp.acks.size() == 2);
+  CHECK(rmpp.acks[1].seg_num == 3);
+  CHECK(rmpp.acks[1].newwin == 1 + SR_VERBS_RMPP_WINDOW);
+
+  // A gap is neither stored nor ACKed, the sender's timeout resends from 4
+  CHECK(feed(rmpp, kRecords, 5, &mad, &length) == 0);
+  CHECK(rmpp.acks.size() == 2);
+  for (int seg_num = 4; seg_num < 7; ++seg_num)
+    REQUIRE(feed(rmpp, kRecords, seg_num, &mad, &length) == 0);
+  REQUIRE(feed(rmpp, kRecords, 7, &mad, &length) == 1);
+  CHECK(length == kHeaderSize + kRecords * kRecordSize);
+  check_payload(mad, kRecords);
+}
+
+TEST_CASE("an RMPP ABORT drops the partial response") {
+  constexpr int kRecords = 7;
+  rmpp_dev rmpp;
+  struct umad_sa_packet* mad = nullptr;
+  int length = 0;
+
+  REQUIRE(feed(rmpp, kRecords, 1, &mad, &length) == 0);
+  REQUIRE(rmpp.dev.verbs.rmpp != nullptr);
+
+  struct umad_sa_packet abort = segment(kRecords, 2);
+  abort.rmpp_hdr.rmpp_type = UMAD_RMPP_TYPE_ABORT;
+  CHECK(verbs_rmpp_recv(&rmpp.dev, &abort, sizeof(abort), &mad, &length) == 0);
+  CHECK(rmpp.dev.verbs.rmpp == nullptr);
+
+  // Later segments of it are ignored, a new first segment starts over
+  CHECK(feed(rmpp, kRecords, 2, &mad, &length) == 0);
+  CHECK(rmpp.dev.verbs.rmpp == nullptr);
+  for (int seg_num = 1; seg_num < 7; ++seg_num)
+    REQUIRE(feed(rmpp, kRecords, seg_num, &mad, &length) == 0);
+  REQUIRE(feed(rmpp, kRecords, 7, &mad, &length) == 1);
+  check_payload(mad, kRecords);
+}
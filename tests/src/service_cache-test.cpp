@@ -0,0 +1,139 @@
+// std
+#include <cerrno>
+#include <cstring>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+#include "services.h"
+
+namespace {
+
+constexpr int kColliding = 6;
+
+// Records whose hashes are all equal: the cache mixes the raw service ID with
+// the port GUID times this constant, so flipping the ID by the same product
+// cancels out a different GUID
+constexpr uint64_t kGuidMul = 0xc2b2ae3d27d4eb4fULL;
+
+struct sr_ib_service_record colliding_record(int k) {
+  struct sr_ib_service_record record;
+  uint64_t guid = k, raw_id = 0x1234 ^ (guid * kGuidMul);
+
+  std::memset(&record, 0, sizeof(record));
+  std::memcpy(&record.service_id, &raw_id, sizeof(raw_id));
+  std::memcpy(&record.service_gid[8], &guid, sizeof(guid));
+  record.service_lease = __cpu_to_be32(60);
+  record.service_name[0] = static_cast<char>('a' + k);
+  return record;
+}
+
+bool found(struct sr_dev* dev, const struct sr_ib_service_record& record) {
+  struct sr_ib_service_record out;
+  return service_cache_find(dev, __be64_to_cpu(record.service_id), record.service_gid, &out) == 0 &&
+         out.service_name[0] == record.service_name[0];
+}
+
+}  // namespace
+
+TEST_CASE("service cache probes and deletes colliding records") {
+  struct sr_dev dev;
+  std::memset(&dev, 0, sizeof(dev));
+  REQUIRE(service_cache_init(&dev) == 0);
+
+  struct sr_ib_service_record records[kColliding];
+  for (int k = 0; k < kColliding; ++k) {
+    records[k] = colliding_record(k);
+    service_cache_save(&dev, &records[k]);
+  }
+  for (int k = 0; k < kColliding; ++k) {
+    CHECK(found(&dev, records[k]));
+    CHECK(service_cache_confirmed(&dev, &records[k]) == 1);
+  }
+
+  // A record of the same ID and port GID that differs is known but not confirmed
+  struct sr_ib_service_record changed = records[2];
+  changed.service_data.service_data8[0] = 1;
+  CHECK(service_cache_confirmed(&dev, &changed) == 0);
+  struct sr_ib_service_record absent = colliding_record(kColliding);
+  CHECK(service_cache_confirmed(&dev, &absent) == -ENOENT);
+  CHECK(service_cache_find(&dev, __be64_to_cpu(absent.service_id), absent.service_gid, nullptr) == -ENOENT);
+
+  // Deleting from the head and middle of the run keeps the rest reachable
+  for (int k : {0, 3}) {
+    CHECK(service_cache_remove(&dev, __be64_to_cpu(records[k].service_id), records[k].service_gid) == 0);
+    CHECK(service_cache_remove(&dev, __be64_to_cpu(records[k].service_id), records[k].service_gid) == -ENOENT);
+    CHECK(service_cache_confirmed(&dev, &records[k]) == -ENOENT);
+  }
+  for (int k = 0; k < kColliding; ++k) {
+    CAPTURE(k);
+    CHECK(found(&dev, records[k]) == (k != 0 && k != 3));
+  }
+
+  // Saved again, the run is whole
+  service_cache_save(&dev, &records[3]);
+  CHECK(found(&dev, records[3]));
+  CHECK(found(&dev, records[5]));
+
+  service_cache_unconfirm(&dev);
+  for (int k = 1; k < kColliding; ++k)
+    CHECK(service_cache_confirmed(&dev, &records[k]) == 0);
+
+  service_cache_cleanup(&dev);
+}
+
+TEST_CASE("unchanged registrations skip the SA, changed ones are set") {
+  loopback_context context(0x700, "skip");
+  REQUIRE(context.status() == 0);
+  struct sr_stats stats;
+
+  REQUIRE(sr_register_service(context, "a", 1, nullptr) == 0);
+  CHECK(sent(context, SR_STATS_SET) == 1);
+  uint64_t lookups = sent(context, SR_STATS_GET) + sent(context, SR_STATS_GET_TABLE);
+
+  for (int i = 0; i < 3; ++i)
+    CHECK(sr_register_service(context, "a", 1, nullptr) == 0);
+  CHECK(sent(context, SR_STATS_SET) == 1);
+  CHECK(sent(context, SR_STATS_GET) + sent(context, SR_STATS_GET_TABLE) == lookups);
+  sr_get_stats(context, &stats);
+  CHECK(stats.register_skips == 3);
+
+  // Changed data is set and followed by one lookup for stale records
+  CHECK(sr_register_service(context, "b", 1, nullptr) == 0);
+  CHECK(sent(context, SR_STATS_SET) == 2);
+  CHECK(sent(context, SR_STATS_GET) + sent(context, SR_STATS_GET_TABLE) == lookups + 1);
+
+  struct sr_dev_service srs[2];
+  REQUIRE(sr_query_service(context, srs, 2, 1) == 1);
+  CHECK(srs[0].data[0] == 'b');
+
+  // Once the SA may have lost records, the same record is set again
+  service_cache_unconfirm(context->dev);
+  CHECK(sr_register_service(context, "b", 1, nullptr) == 0);
+  CHECK(sent(context, SR_STATS_SET) == 3);
+
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+}
+
+TEST_CASE("updates the SA rejects fail") {
+  loopback_context context(0x710, "rejected");
+  REQUIRE(context.status() == 0);
+
+  struct sr_dev_service service;
+  struct sr_ib_service_record record;
+  REQUIRE(sr_prepare_ib_service_record(context, &service, &record, 0x710, "rejected", "r", 1, nullptr) == 0);
+
+  // The SA wants the service GID of a SET
+  struct sr_sa_txn txn;
+  dev_register_txn_init(&txn, &record);
+  txn.comp_mask &= ~BIT(1);
+  CHECK(dev_sa_wait(context->dev, &txn) == -EINVAL);
+  CHECK(service_cache_confirmed(context->dev, &record) == -ENOENT);
+
+  struct sr_dev_service srs[2];
+  CHECK(sr_query_service(context, srs, 2, 1) == 0);
+
+  // Deleting what is already gone is no failure
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+}
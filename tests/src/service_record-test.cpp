@@ -1,7 +1,10 @@
+// std
+#include <cstring>
 // 3rd party
 #include <doctest/doctest.h>
 // project
 #include <service_record/service_record.h>
+#include "loopback.h"
 
 int factorial(int number) {
   return number <= 1 ? number : factorial(number - 1) * number;
@@ -14,6 +17,20 @@ TEST_CASE("testing the factorial function") {
   CHECK(factorial(10) == 3628800);
 }
 
-TEST_CASE("The answer to life, the universe, and everything") {
-  CHECK(service_record_lib_answer() == 42);
-}
\ No newline at end of file
+TEST_CASE("register, query and unregister over loopback") {
+  loopback_context context(0x100, "round-trip");
+  REQUIRE(context.status() == 0);
+
+  struct sr_dev_service srs[4];
+  CHECK(sr_query_service(context, srs, 4, 1) == 0);
+
+  REQUIRE(sr_register_service(context, "payload", 7, nullptr) == 0);
+  REQUIRE(sr_query_service(context, srs, 4, 1) == 1);
+  CHECK(srs[0].id == 0x100);
+  CHECK(std::strcmp(srs[0].name, "round-trip") == 0);
+  CHECK(std::memcmp(srs[0].data, "payload", 7) == 0);
+  CHECK(srs[0].lease > 0);
+
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+  CHECK(sr_query_service(context, srs, 4, 1) == 0);
+}
@@ -0,0 +1,133 @@
+// std
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <memory>
+#include <thread>
+// 3rd party
+#include <doctest/doctest.h>
+#include <sys/wait.h>
+#include <unistd.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+
+// Contexts of one process with the same service share a node snapshot like
+// processes do: each attaches to the segment on its own.
+
+namespace {
+
+uint64_t queries(struct sr_ctx* context) {
+  return sent(context, SR_STATS_GET) + sent(context, SR_STATS_GET_TABLE);
+}
+
+uint64_t hits(struct sr_ctx* context) {
+  struct sr_stats stats;
+  sr_get_stats(context, &stats);
+  return stats.snapshot_hits;
+}
+
+struct sr_config snapshot_config(uint64_t service_id, const char* service_name) {
+  struct sr_config conf = loopback_config(service_id, service_name);
+  conf.snapshot_ttl_ms = 10000;
+  return conf;
+}
+
+}  // namespace
+
+TEST_CASE("contexts read the records another one published") {
+  loopback_context publisher(0x1400, "snapshot");
+  REQUIRE(publisher.status() == 0);
+  REQUIRE(sr_register_service(publisher, "1", 1, nullptr) == 0);
+  struct sr_dev_service srs[4];
+
+  auto first = std::make_unique<loopback_context>(snapshot_config(0x1400, "snapshot"));
+  loopback_context second(snapshot_config(0x1400, "snapshot"));
+  REQUIRE(first->status() == 0);
+  REQUIRE(second.status() == 0);
+
+  REQUIRE(sr_query_service(*first, srs, 4, 1) == 1);
+  CHECK(queries(*first) == 1);
+  CHECK(hits(*first) == 0);
+
+  REQUIRE(sr_query_service(second, srs, 4, 1) == 1);
+  CHECK(srs[0].data[0] == '1');
+  CHECK(queries(second) == 0);
+  CHECK(hits(second) == 1);
+
+  // The segment outlives the context that created it while others use it
+  first.reset();
+  loopback_context third(snapshot_config(0x1400, "snapshot"));
+  REQUIRE(third.status() == 0);
+  REQUIRE(sr_query_service(third, srs, 4, 1) == 1);
+  CHECK(queries(third) == 0);
+  CHECK(hits(third) == 1);
+
+  CHECK(sr_unregister_service(publisher, nullptr) == 0);
+}
+
+TEST_CASE("a refresh claimed by a process that died is taken over") {
+  loopback_context publisher(0x1410, "snapshot-claim");
+  REQUIRE(publisher.status() == 0);
+  REQUIRE(sr_register_service(publisher, "1", 1, nullptr) == 0);
+
+  // The child claims the first refresh and is killed while the SA answers
+  pid_t pid = fork();
+  REQUIRE(pid >= 0);
+  if (!pid) {
+    struct sr_config conf = snapshot_config(0x1410, "snapshot-claim");
+    conf.fabric_timeout_ms = 100;
+    conf.query_sleep_max = 100000;
+    conf.loopback_latency_us = 10000000;
+    conf.sr_retries = 1;
+    struct sr_ctx* context;
+    struct sr_dev_service srs[4];
+    if (!sr_init(&context, "", 0, quiet_log, &conf))
+      sr_query_service(context, srs, 4, 1);
+    _exit(0);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  kill(pid, SIGKILL);
+  REQUIRE(waitpid(pid, nullptr, 0) == pid);
+
+  // With nothing published yet, the lookup waits for the claim to run out and refreshes itself
+  loopback_context context(snapshot_config(0x1410, "snapshot-claim"));
+  REQUIRE(context.status() == 0);
+  struct sr_dev_service srs[4];
+  auto start = std::chrono::steady_clock::now();
+  CHECK(sr_query_service(context, srs, 4, 1) == 1);
+  CHECK(queries(context) == 1);
+  CHECK(std::chrono::steady_clock::now() - start > std::chrono::milliseconds(100));
+
+  CHECK(sr_unregister_service(publisher, nullptr) == 0);
+}
+
+TEST_CASE("a failed refresh fails lookups until the resend delay passed") {
+  loopback_context publisher(0x1420, "snapshot-fail");
+  REQUIRE(publisher.status() == 0);
+  REQUIRE(sr_register_service(publisher, "1", 1, nullptr) == 0);
+
+  struct sr_config conf = snapshot_config(0x1420, "snapshot-fail");
+  conf.query_sleep = 300000;
+  conf.query_sleep_max = 300000;
+  conf.fabric_timeout_ms = 50;
+  conf.sr_retries = 1;
+  loopback_context failing(conf);
+  loopback_context context(conf);
+  REQUIRE(failing.status() == 0);
+  REQUIRE(context.status() == 0);
+  struct sr_dev_service srs[4];
+
+  failing->dev->loopback_latency_us = 200000;
+  CHECK(sr_query_service(failing, srs, 4, 0) == -ETIMEDOUT);
+
+  // The failure is served to the others instead of asking the SA again
+  CHECK(sr_query_service(context, srs, 4, 0) == -ETIMEDOUT);
+  CHECK(queries(context) == 0);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(350));
+  CHECK(sr_query_service(context, srs, 4, 0) == 1);
+  CHECK(queries(context) == 1);
+
+  CHECK(sr_unregister_service(publisher, nullptr) == 0);
+}
@@ -0,0 +1,100 @@
+// std
+#include <cstdint>
+// 3rd party
+#include <doctest/doctest.h>
+// project
+#include <service_record/service_record.h>
+#include "loopback.h"
+#include "services.h"
+
+namespace {
+
+constexpr int kForeign = 20;
+
+// Records of the context service as other ports would have registered them
+void register_foreign(struct sr_ctx* context, int num) {
+  for (int i = 0; i < num; ++i) {
+    struct sr_dev_service service;
+    struct sr_ib_service_record record;
+    REQUIRE(sr_prepare_ib_service_record(context, &service, &record, context->service_id, context->service_name, "f", 1,
+                                         nullptr) == 0);
+    record.service_gid[0] = 0xaa;
+    record.service_gid[15] = static_cast<uint8_t>(i + 1);
+
+    struct sr_sa_txn txn;
+    dev_register_txn_init(&txn, &record);
+    REQUIRE(dev_sa_wait(context->dev, &txn) == 1);
+  }
+}
+
+uint64_t lookups(struct sr_ctx* context) {
+  return sent(context, SR_STATS_GET) + sent(context, SR_STATS_GET_TABLE);
+}
+
+}  // namespace
+
+TEST_CASE("unregister deletes the records of every port in one burst") {
+  loopback_context context(0x800, "burst");
+  REQUIRE(context.status() == 0);
+  struct sr_dev_service srs[kForeign + 2];
+
+  REQUIRE(sr_register_service(context, "a", 1, nullptr) == 0);
+  register_foreign(context, kForeign);
+  REQUIRE(sr_query_service(context, srs, kForeign + 2, 1) == kForeign + 1);
+
+  uint64_t deletes = sent(context, SR_STATS_DELETE), before = lookups(context);
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+  CHECK(sent(context, SR_STATS_DELETE) == deletes + kForeign + 1);
+  CHECK(lookups(context) > before);
+  CHECK(sr_query_service(context, srs, kForeign + 2, 1) == 0);
+}
+
+TEST_CASE("bulk unregister deletes every record of this context only") {
+  struct sr_config conf = loopback_config(0x810, "bulk");
+  conf.flags = SR_BULK_UNREGISTER;
+  loopback_context context(conf);
+  REQUIRE(context.status() == 0);
+  struct sr_dev_service srs[kForeign + 2];
+
+  REQUIRE(sr_register_service(context, "a", 1, nullptr) == 0);
+  struct sr_service_entry entries[2] = {};
+  entries[0].id = 0x811;
+  entries[0].data = "b";
+  entries[0].data_size = 1;
+  entries[1].id = 0x812;
+  entries[1].name = "other";
+  entries[1].data = "c";
+  entries[1].data_size = 1;
+  REQUIRE(sr_register_services(context, entries, 2) == 2);
+  register_foreign(context, kForeign);
+
+  // One DELETE per record registered here, whatever its ID, and no lookup
+  uint64_t deletes = sent(context, SR_STATS_DELETE), before = lookups(context);
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+  CHECK(sent(context, SR_STATS_DELETE) == deletes + 3);
+  CHECK(lookups(context) == before);
+
+  struct sr_query_filter filter = {};
+  filter.id = 0x811;
+  CHECK(sr_query_service_filter(context, &filter, srs, 2, 1) == 0);
+  filter.id = 0x812;
+  CHECK(sr_query_service_filter(context, &filter, srs, 2, 1) == 0);
+
+  // Nothing is left to delete
+  deletes = sent(context, SR_STATS_DELETE);
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+  CHECK(sent(context, SR_STATS_DELETE) == deletes);
+
+  // What other ports left goes by an explicit list
+  REQUIRE(sr_query_service(context, srs, kForeign + 2, 1) == kForeign);
+  CHECK(sr_unregister_services(context, srs, kForeign / 2, nullptr) == 0);
+  CHECK(sr_query_service(context, srs, kForeign + 2, 1) == kForeign / 2);
+  CHECK(sr_unregister_services(context, srs, kForeign / 2, nullptr) == 0);
+  CHECK(sr_query_service(context, srs, kForeign + 2, 1) == 0);
+
+  // Registering after unregistering reaches the SA again
+  uint64_t sets = sent(context, SR_STATS_SET);
+  CHECK(sr_register_service(context, "a", 1, nullptr) == 0);
+  CHECK(sent(context, SR_STATS_SET) == sets + 1);
+  CHECK(sr_unregister_service(context, nullptr) == 0);
+}